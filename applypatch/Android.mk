@@ -15,11 +15,23 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
+# Set APPLYPATCH_BROTLI := true in BoardConfig.mk to apply (and let
+# imgdiff -c brotli generate) patches whose blocks are compressed with
+# brotli instead of bzip2.
+ifeq ($(APPLYPATCH_BROTLI),true)
+applypatch_brotli_cflags := -DAPPLYPATCH_USE_BROTLI
+endif
+
 LOCAL_SRC_FILES := applypatch.c bspatch.c freecache.c imgpatch.c utils.c
 LOCAL_MODULE := libapplypatch
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += external/bzip2 external/zlib bootable/recovery
 LOCAL_STATIC_LIBRARIES += libmtdutils_static libmincrypt libbz libz
+ifeq ($(APPLYPATCH_BROTLI),true)
+LOCAL_CFLAGS += $(applypatch_brotli_cflags)
+LOCAL_C_INCLUDES += external/brotli/c/include
+LOCAL_STATIC_LIBRARIES += libbrotli
+endif
 
 include $(BUILD_STATIC_LIBRARY)
 
@@ -29,6 +41,9 @@ LOCAL_SRC_FILES := main.c
 LOCAL_MODULE := applypatch
 LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils_static libmincrypt libbz libminelf
+ifeq ($(APPLYPATCH_BROTLI),true)
+LOCAL_STATIC_LIBRARIES += libbrotli
+endif
 LOCAL_SHARED_LIBRARIES += libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
@@ -41,16 +56,48 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils_static libmincrypt libbz libminelf
+ifeq ($(APPLYPATCH_BROTLI),true)
+LOCAL_STATIC_LIBRARIES += libbrotli
+endif
 LOCAL_STATIC_LIBRARIES += libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := imgdiff.c utils.c bsdiff.c
+LOCAL_SRC_FILES := imgdiff.c utils.c bsdiff.c sais.c
 LOCAL_MODULE := imgdiff
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_C_INCLUDES += external/zlib external/bzip2
 LOCAL_STATIC_LIBRARIES += libz libbz
+LOCAL_LDLIBS += -lpthread
+ifeq ($(APPLYPATCH_BROTLI),true)
+LOCAL_CFLAGS += $(applypatch_brotli_cflags)
+LOCAL_C_INCLUDES += external/brotli/c/include
+LOCAL_STATIC_LIBRARIES += libbrotli
+endif
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bsdiff_bench.c bsdiff.c sais.c
+LOCAL_MODULE := bsdiff_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += external/bzip2
+LOCAL_STATIC_LIBRARIES += libbz
 
 include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Runs the applypatch binary on generated and checked-in patches; the
+# imgdiff cases are skipped unless an imgdiff binary is on the PATH.
+LOCAL_SRC_FILES := applypatch_bench.c bsdiff.c sais.c
+LOCAL_MODULE := applypatch_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += external/zlib external/bzip2 bootable/recovery
+LOCAL_STATIC_LIBRARIES += libmincrypt libbz
+LOCAL_SHARED_LIBRARIES += libz libc
+
+include $(BUILD_EXECUTABLE)
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
@@ -30,7 +31,8 @@
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int may_map);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -53,12 +55,13 @@ static int mtd_partitions_scanned = 0;
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, 0);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -105,6 +108,87 @@ int LoadFileContents(const char* filename, FileContents* file,
     return 0;
 }
 
+// Like LoadFileContents(), but a regular file is mapped (privately, so
+// retouch masking doesn't touch the file) instead of read into the
+// heap.  A large source then costs page cache, which the kernel can
+// reclaim, rather than RAM.  Release with FreeFileContents().
+static int MapFileContents(const char* filename, FileContents* file,
+                           int retouch_flag) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        return LoadPartitionContents(filename, file, 1);
+    }
+    if (stat(filename, &file->st) != 0 ||
+        !S_ISREG(file->st.st_mode) || file->st.st_size == 0) {
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    void* data = mmap(NULL, file->st.st_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+    file->data = data;
+    file->size = file->st.st_size;
+    file->mapped = 1;
+
+    if (retouch_flag) {
+        int32_t desired_offset = 0;
+        if (retouch_mask_data(file->data, file->size,
+                              &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
+            printf("error trying to mask retouch entries\n");
+            FreeFileContents(file);
+            return -1;
+        }
+    }
+
+    SHA_hash(file->data, file->size, file->sha1);
+    return 0;
+}
+
+void FreeFileContents(FileContents* file) {
+    if (file->data != NULL) {
+        if (file->mapped) {
+            munmap(file->data, file->size);
+        } else {
+            free(file->data);
+        }
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
+// Once the source has been backed up to CACHE_TEMP_SOURCE, read it
+// from there instead.  That drops a heap copy of a partition, and lets
+// a mapped source file be deleted for real (a mapping keeps its blocks
+// allocated).  Keeps using the original if the copy can't be mapped.
+// Returns 0 if the cached copy is now in use.
+static int UseCachedSource(FileContents* source_file) {
+    FileContents copy;
+    if (MapFileContents(CACHE_TEMP_SOURCE, &copy, RETOUCH_DONT_MASK) != 0) {
+        return -1;
+    }
+    if (copy.size != source_file->size ||
+        memcmp(copy.sha1, source_file->sha1, SHA_DIGEST_SIZE) != 0) {
+        printf("cached source doesn't match; keeping original\n");
+        FreeFileContents(&copy);
+        return -1;
+    }
+    copy.st = source_file->st;
+    FreeFileContents(source_file);
+    *source_file = copy;
+    return 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -135,9 +219,15 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If may_map is set, an EMMC partition is mapped read-only rather
+// than read into the heap, as MapFileContents() does for files.  MTD
+// partitions can't be mapped, so they are still read whole: their size
+// is not bounded by PatchMemoryBudget().
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int may_map) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -225,8 +315,25 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
+    // map or allocate enough memory to hold the largest size.  Only
+    // map what the device actually has; touching a page past its end
+    // would raise SIGBUS instead of giving a short read.
+    size_t alloc = size[index[pairs-1]];
+    if (type == EMMC && may_map) {
+        off_t dev_size = lseek(fileno(dev), 0, SEEK_END);
+        if (dev_size >= 0 && (uint64_t)dev_size >= alloc) {
+            void* data = mmap(NULL, alloc, PROT_READ, MAP_PRIVATE,
+                              fileno(dev), 0);
+            if (data != MAP_FAILED) {
+                file->data = data;
+                file->mapped = 1;
+            }
+        }
+        fseek(dev, 0, SEEK_SET);
+    }
+    if (!file->mapped) {
+        file->data = malloc(alloc);
+    }
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -243,14 +350,14 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    read = file->mapped ? next : fread(p, 1, next, dev);
                     break;
             }
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
+                file->size = alloc;
+                FreeFileContents(file);
                 return -1;
             }
             SHA_update(&sha_ctx, p, read);
@@ -266,8 +373,8 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
+            file->size = alloc;
+            FreeFileContents(file);
             return -1;
         }
 
@@ -298,8 +405,8 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         // finding a match.
         printf("contents of partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
+        file->size = alloc;
+        FreeFileContents(file);
         return -1;
     }
 
@@ -308,6 +415,17 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         file->sha1[i] = sha_final[i];
     }
 
+    // A shorter size matched; drop the mapped pages past it so that
+    // FreeFileContents() releases the whole mapping.
+    if (file->mapped) {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t used = (file->size + page - 1) / page * page;
+        size_t mapped = (alloc + page - 1) / page * page;
+        if (used < mapped) {
+            munmap((char*)file->data + used, mapped - used);
+        }
+    }
+
     // Fake some stat() info.
     file->st.st_mode = 0644;
     file->st.st_uid = 0;
@@ -399,6 +517,8 @@ int WriteToPartition(unsigned char* data, size_t len,
                        partition);
                 return -1;
             }
+            // The rest of the partition is erased below anyway.
+            mtd_write_erase_ahead(ctx, MTD_ERASE_AHEAD_BLOCKS);
 
             size_t written = mtd_write_data(ctx, (char*)data, len);
             if (written != len) {
@@ -600,14 +720,13 @@ int applypatch_check(const char* filename,
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    if (LoadFileContents(filename, &file, RETOUCH_DO_MASK) != 0 ||
+    if (MapFileContents(filename, &file, RETOUCH_DO_MASK) != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -615,19 +734,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -687,6 +806,127 @@ int CacheSizeCheck(size_t bytes) {
     }
 }
 
+size_t PatchMemoryBudget() {
+    const char* env = getenv(APPLYPATCH_MEMORY_ENV);
+    if (env != NULL) {
+        long mb = strtol(env, NULL, 10);
+        if (mb > 0) return (size_t)mb << 20;
+    }
+    return APPLYPATCH_DEFAULT_MEMORY_BUDGET;
+}
+
+// Writes patch output straight to a partition named like the targets
+// WriteToPartition() takes.
+typedef struct {
+    enum PartitionType type;
+    MtdWriteContext* mtd;
+    int fd;
+    char* partition;
+    size_t written;
+} PartitionSinkInfo;
+
+static int OpenPartitionSink(const char* target, PartitionSinkInfo* psi) {
+    memset(psi, 0, sizeof(*psi));
+    psi->fd = -1;
+
+    char* copy = strdup(target);
+    const char* magic = strtok(copy, ":");
+    const char* partition = strtok(NULL, ":");
+    if (partition == NULL) {
+        printf("bad partition target name \"%s\"\n", target);
+        free(copy);
+        return -1;
+    }
+    psi->partition = strdup(partition);
+    psi->type = (strcmp(magic, "MTD") == 0) ? MTD : EMMC;
+    free(copy);
+
+    if (psi->type == MTD) {
+        if (!mtd_partitions_scanned) {
+            mtd_scan_partitions();
+            mtd_partitions_scanned = 1;
+        }
+        const MtdPartition* mtd = mtd_find_partition_by_name(psi->partition);
+        if (mtd == NULL || (psi->mtd = mtd_write_partition(mtd)) == NULL) {
+            printf("failed to init mtd partition \"%s\" for writing\n",
+                   psi->partition);
+            free(psi->partition);
+            return -1;
+        }
+        mtd_write_erase_ahead(psi->mtd, MTD_ERASE_AHEAD_BLOCKS);
+    } else {
+        psi->fd = open(psi->partition, O_RDWR);
+        if (psi->fd < 0) {
+            printf("failed to open %s: %s\n", psi->partition, strerror(errno));
+            free(psi->partition);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static ssize_t PartitionSink(unsigned char* data, ssize_t len, void* token) {
+    PartitionSinkInfo* psi = (PartitionSinkInfo*)token;
+    ssize_t done;
+    if (psi->type == MTD) {
+        done = mtd_write_data(psi->mtd, (char*)data, len);
+    } else {
+        done = FileSink(data, len, &psi->fd);
+    }
+    if (done > 0) psi->written += done;
+    return done;
+}
+
+// Finish writing; for eMMC, read the data back (past the page cache)
+// and check it against the expected SHA-1.  Returns 0 on success.
+static int ClosePartitionSink(PartitionSinkInfo* psi, int ok,
+                              const uint8_t* target_sha1) {
+    if (psi->type == MTD) {
+        if (ok && mtd_erase_blocks(psi->mtd, -1) < 0) {
+            printf("error finishing mtd write of %s\n", psi->partition);
+            ok = 0;
+        }
+        if (mtd_write_close(psi->mtd)) {
+            printf("error closing mtd write of %s\n", psi->partition);
+            ok = 0;
+        }
+    } else {
+        if (fsync(psi->fd) != 0) {
+            printf("error syncing %s (%s)\n", psi->partition, strerror(errno));
+            ok = 0;
+        }
+        if (ok) {
+            posix_fadvise(psi->fd, 0, 0, POSIX_FADV_DONTNEED);
+            SHA_CTX ctx;
+            SHA_init(&ctx);
+            unsigned char buffer[4096];
+            size_t p = 0;
+            while (ok && p < psi->written) {
+                size_t to_read = psi->written - p;
+                if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
+                ssize_t r = pread(psi->fd, buffer, to_read, p);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) {
+                    printf("verify read error %s at %ld: %s\n",
+                           psi->partition, (long)p, strerror(errno));
+                    ok = 0;
+                    break;
+                }
+                SHA_update(&ctx, buffer, r);
+                p += r;
+            }
+            if (ok && memcmp(SHA_final(&ctx), target_sha1,
+                             SHA_DIGEST_SIZE) != 0) {
+                printf("verification of %s failed\n", psi->partition);
+                ok = 0;
+            }
+        }
+        close(psi->fd);
+    }
+    free(psi->partition);
+    return ok ? 0 : -1;
+}
+
 
 // This function applies binary patches to files in a way that is safe
 // (the original file is not touched until we have the desired
@@ -738,19 +978,21 @@ int applypatch(const char* source_filename,
     FileContents copy_file;
     FileContents source_file;
     copy_file.data = NULL;
+    copy_file.mapped = 0;
     source_file.data = NULL;
+    source_file.mapped = 0;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
-                         RETOUCH_DO_MASK) == 0) {
+    if (MapFileContents(target_filename, &source_file,
+                        RETOUCH_DO_MASK) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -760,10 +1002,9 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
-                         RETOUCH_DO_MASK);
+        FreeFileContents(&source_file);
+        MapFileContents(source_filename, &source_file,
+                        RETOUCH_DO_MASK);
     }
 
     if (source_file.data != NULL) {
@@ -775,12 +1016,11 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
-                             RETOUCH_DO_MASK) < 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file,
+                            RETOUCH_DO_MASK) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
@@ -795,7 +1035,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -804,8 +1044,8 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
@@ -823,9 +1063,12 @@ static int GenerateTarget(FileContents* source_file,
     SHA_CTX ctx;
     int output;
     MemorySinkInfo msi;
+    PartitionSinkInfo psi;
+    int streamed = 0;
     FileContents* source_to_use;
     char* outname;
     int made_copy = 0;
+    int source_on_partition = 0;  // source_file maps a partition
 
     // assume that target_filename (eg "/system/app/Foo.apk") is located
     // on the same filesystem as its top-level directory ("/system").
@@ -853,16 +1096,23 @@ static int GenerateTarget(FileContents* source_file,
             // space to hold the file.
 
             // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            // the partition write is interrupted.  (If we're already
+            // working from that copy, it's there.)
+            if (source_patch_value != NULL) {
+                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
+                    printf("not enough free space on /cache\n");
+                    return 1;
+                }
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    return 1;
+                }
+                made_copy = 1;
+                if (UseCachedSource(source_file) != 0 && source_file->mapped &&
+                    strncmp(source_filename, "EMMC:", 5) == 0) {
+                    source_on_partition = 1;
+                }
             }
-            made_copy = 1;
             retry = 0;
         } else {
             int enough_space = 0;
@@ -904,6 +1154,7 @@ static int GenerateTarget(FileContents* source_file,
                     return 1;
                 }
                 made_copy = 1;
+                UseCachedSource(source_file);
                 unlink(source_filename);
 
                 size_t free_space = FreeSpaceForFile(target_fs);
@@ -929,8 +1180,29 @@ static int GenerateTarget(FileContents* source_file,
         void* token = NULL;
         output = -1;
         outname = NULL;
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
+        if ((strncmp(target_filename, "MTD:", 4) == 0 ||
+             strncmp(target_filename, "EMMC:", 5) == 0) &&
+            target_size > PatchMemoryBudget()) {
+            // Too big to hold in memory; write the output straight to the
+            // partition.  The source is safe in CACHE_TEMP_SOURCE if
+            // this is interrupted.
+            printf("streaming %ld bytes of output to %s\n",
+                   (long)target_size, target_filename);
+            if (source_to_use == source_file && source_on_partition) {
+                // The cached copy couldn't be used, so the source may be
+                // the partition being written; it would change under
+                // the patch.
+                printf("source is mapped from a partition; can't stream\n");
+                return 1;
+            }
+            if (OpenPartitionSink(target_filename, &psi) != 0) {
+                return 1;
+            }
+            streamed = 1;
+            sink = PartitionSink;
+            token = &psi;
+        } else if (strncmp(target_filename, "MTD:", 4) == 0 ||
+                   strncmp(target_filename, "EMMC:", 5) == 0) {
             // We store the decoded output in memory.
             msi.buffer = malloc(target_size);
             if (msi.buffer == NULL) {
@@ -965,8 +1237,7 @@ static int GenerateTarget(FileContents* source_file,
 
         int result;
 
-        if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
+        if (IsBSDiffPatch(header, header_bytes_read)) {
             result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
         } else if (header_bytes_read >= 8 &&
@@ -982,6 +1253,18 @@ static int GenerateTarget(FileContents* source_file,
             fsync(output);
             close(output);
         }
+        if (streamed) {
+            // Check the hash before the read-back verification uses it.
+            SHA_CTX check = ctx;
+            int ok = (result == 0 &&
+                      memcmp(SHA_final(&check), target_sha1,
+                             SHA_DIGEST_SIZE) == 0);
+            if (ClosePartitionSink(&psi, ok, target_sha1) != 0 && ok) {
+                printf("write of patched data to %s failed\n",
+                       target_filename);
+                return 1;
+            }
+        }
 
         if (result != 0) {
             if (retry == 0) {
@@ -1005,7 +1288,9 @@ static int GenerateTarget(FileContents* source_file,
         return 1;
     }
 
-    if (output < 0) {
+    if (streamed) {
+        // Already written (and verified) above.
+    } else if (output < 0) {
         // Copy the temp file to the partition.
         if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
             printf("write of patched data to %s failed\n", target_filename);
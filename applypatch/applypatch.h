@@ -32,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;           // data is mmap()ed rather than malloc()ed
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -41,12 +42,24 @@ typedef struct _FileContents {
 // and use it as the source instead.
 #define CACHE_TEMP_SOURCE "/cache/saved.file"
 
+// Partition targets up to this size are built in memory and only
+// written once their SHA-1 checks out; bigger ones are streamed to
+// the partition as they are patched.  APPLYPATCH_MEMORY_ENV, if set,
+// overrides the budget (in MiB).
+//
+// The budget covers the output only.  Sources are mapped where they
+// can be, but an MTD source is read whole into the heap, and imgdiff
+// expands each deflate chunk of the source into memory in full.
+#define APPLYPATCH_DEFAULT_MEMORY_BUDGET (64 << 20)
+#define APPLYPATCH_MEMORY_ENV "APPLYPATCH_MEMORY_MB"
+
 typedef ssize_t (*SinkFn)(unsigned char*, ssize_t, void*);
 
 // applypatch.c
 int ShowLicenses();
 size_t FreeSpaceForFile(const char* filename);
 int CacheSizeCheck(size_t bytes);
+size_t PatchMemoryBudget();
 int ParseSha1(const char* str, uint8_t* digest);
 
 int applypatch(const char* source_filename,
@@ -68,8 +81,9 @@ void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const* const  patch_sha1_str,
                       int num_patches);
 
-// bsdiff.c
+// bspatch.c
 void ShowBSDiffLicense();
+int IsBSDiffPatch(const char* data, ssize_t size);
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
                      SinkFn sink, void* token, SHA_CTX* ctx);
@@ -0,0 +1,582 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark and regression test for applypatch.
+ *
+ *     applypatch_bench [-n <iterations>] [-s <megabytes>] [-w <workdir>]
+ *                      [-a <applypatch>] [-i <imgdiff>] [-d <testdata>]
+ *
+ * e.g. applypatch_bench -d bootable/recovery/applypatch/testdata
+ *
+ * Generates old/new pairs (random data, APK-like zips with deflated
+ * entries, and boot-image-like blobs with gzipped kernel and ramdisk),
+ * makes bsdiff patches in-process and imgdiff patches with the imgdiff
+ * binary, then runs the applypatch binary on each one, end to end:
+ * loading the source and patch, patching, hashing and saving the
+ * target.  For each case it reports the best time, throughput and
+ * peak RSS of applypatch.  It exits nonzero if any patch fails to
+ * apply or produces a target whose SHA-1 differs from the new file.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zlib.h"
+#include "mincrypt/sha.h"
+#include "bsdiff.h"
+
+static const char* g_workdir = "/data/local/tmp/applypatch_bench";
+static const char* g_applypatch = "applypatch";
+static const char* g_imgdiff = "imgdiff";
+static int g_iterations = 3;
+static size_t g_scale = 16 << 20;
+
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    size_t alloc;
+} Buffer;
+
+static void Reserve(Buffer* b, size_t len) {
+    if (b->len + len > b->alloc) {
+        b->alloc = (b->len + len) * 2;
+        b->data = realloc(b->data, b->alloc);
+        if (b->data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+}
+
+static void Append(Buffer* b, const void* data, size_t len) {
+    Reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void Append2(Buffer* b, unsigned int v) {
+    unsigned char x[2] = { v & 0xff, (v >> 8) & 0xff };
+    Append(b, x, 2);
+}
+
+static void Append4(Buffer* b, unsigned int v) {
+    unsigned char x[4] = { v & 0xff, (v >> 8) & 0xff,
+                           (v >> 16) & 0xff, (v >> 24) & 0xff };
+    Append(b, x, 4);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --- data generators ---
+
+static uint32_t g_rand = 2463534242u;
+
+static uint32_t Rand(void) {
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 17;
+    g_rand ^= g_rand << 5;
+    return g_rand;
+}
+
+static void RandomBytes(unsigned char* p, size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i) p[i] = Rand() >> 24;
+}
+
+// Words from a small vocabulary, so the result compresses about as
+// well as code and resources do.
+static void TextBytes(unsigned char* p, size_t len) {
+    static const char* kWords[] = {
+        "the", "of", "android", "recovery", "package", "0x7f", "return",
+        "int", "void", "static", "const", "char", "data", "size", "for",
+        "if", "else", "while", "struct", "null", "true", "false", "i++",
+    };
+    size_t nwords = sizeof(kWords) / sizeof(kWords[0]);
+    size_t i = 0;
+    while (i < len) {
+        const char* w = kWords[Rand() % nwords];
+        while (*w && i < len) p[i++] = *w++;
+        if (i < len) p[i++] = (Rand() & 15) == 0 ? '\n' : ' ';
+    }
+}
+
+// Make 'count' small random edits to the data, as a rebuild would.
+static void Perturb(unsigned char* p, size_t len, int count) {
+    int i;
+    for (i = 0; i < count && len > 64; ++i) {
+        size_t at = Rand() % (len - 64);
+        RandomBytes(p + at, 1 + Rand() % 48);
+    }
+}
+
+static size_t Deflate(const unsigned char* in, size_t len, Buffer* out,
+                      int window_bits) {
+    z_stream strm;
+    unsigned char buf[32768];
+    size_t start = out->len;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    deflateInit2(&strm, 6, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+    strm.next_in = (unsigned char*)in;
+    strm.avail_in = len;
+    do {
+        strm.next_out = buf;
+        strm.avail_out = sizeof(buf);
+        ret = deflate(&strm, Z_FINISH);
+        Append(out, buf, sizeof(buf) - strm.avail_out);
+    } while (ret != Z_STREAM_END);
+    deflateEnd(&strm);
+    return out->len - start;
+}
+
+typedef struct {
+    char name[32];
+    unsigned char* data;
+    size_t len;
+    int stored;
+} ZipEntry;
+
+// Write a minimal zip file holding the given entries.
+static void MakeZip(ZipEntry* entries, int count, Buffer* out) {
+    Buffer cd = { NULL, 0, 0 };
+    int i;
+
+    out->len = 0;
+    for (i = 0; i < count; ++i) {
+        ZipEntry* e = entries + i;
+        unsigned int crc = crc32(0, e->data, e->len);
+        size_t offset = out->len;
+        size_t nlen = strlen(e->name);
+        size_t clen;
+
+        Append4(out, 0x04034b50);
+        Append2(out, 20);                   // version needed
+        Append2(out, 0);                    // flags
+        Append2(out, e->stored ? 0 : 8);    // method
+        Append4(out, 0);                    // time, date
+        Append4(out, crc);
+        size_t sizes = out->len;
+        Append4(out, 0);
+        Append4(out, e->len);
+        Append2(out, nlen);
+        Append2(out, 0);                    // extra len
+        Append(out, e->name, nlen);
+        if (e->stored) {
+            Append(out, e->data, e->len);
+            clen = e->len;
+        } else {
+            clen = Deflate(e->data, e->len, out, -15);
+        }
+        out->data[sizes] = clen & 0xff;
+        out->data[sizes+1] = (clen >> 8) & 0xff;
+        out->data[sizes+2] = (clen >> 16) & 0xff;
+        out->data[sizes+3] = (clen >> 24) & 0xff;
+
+        Append4(&cd, 0x02014b50);
+        Append2(&cd, 20);                   // version made by
+        Append2(&cd, 20);                   // version needed
+        Append2(&cd, 0);
+        Append2(&cd, e->stored ? 0 : 8);
+        Append4(&cd, 0);
+        Append4(&cd, crc);
+        Append4(&cd, clen);
+        Append4(&cd, e->len);
+        Append2(&cd, nlen);
+        Append2(&cd, 0);                    // extra len
+        Append2(&cd, 0);                    // comment len
+        Append2(&cd, 0);                    // disk
+        Append2(&cd, 0);                    // internal attrs
+        Append4(&cd, 0);                    // external attrs
+        Append4(&cd, offset);
+        Append(&cd, e->name, nlen);
+    }
+
+    size_t cd_offset = out->len;
+    Append(out, cd.data, cd.len);
+    Append4(out, 0x06054b50);
+    Append2(out, 0);
+    Append2(out, 0);
+    Append2(out, count);
+    Append2(out, count);
+    Append4(out, cd.len);
+    Append4(out, cd_offset);
+    Append2(out, 0);
+    free(cd.data);
+}
+
+static void MakeApkPair(Buffer* old, Buffer* new) {
+    int count = 48;
+    ZipEntry* entries = calloc(count, sizeof(ZipEntry));
+    size_t each = g_scale / count;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        ZipEntry* e = entries + i;
+        // Mostly compressible code and resources, with a few stored
+        // (already compressed) assets.
+        e->stored = (i % 8 == 7);
+        snprintf(e->name, sizeof(e->name), e->stored ? "res/raw/a%d.png"
+                 : (i == 0 ? "classes.dex" : "res/xml/r%d.xml"), i);
+        e->len = i == 0 ? each * 8 : each / 2 + Rand() % each;
+        e->data = malloc(e->len);
+        if (e->stored) {
+            RandomBytes(e->data, e->len);
+        } else {
+            TextBytes(e->data, e->len);
+        }
+    }
+    MakeZip(entries, count, old);
+
+    for (i = 0; i < count; ++i) {
+        if (i % 3 == 0) Perturb(entries[i].data, entries[i].len, 20);
+    }
+    MakeZip(entries, count, new);
+
+    for (i = 0; i < count; ++i) free(entries[i].data);
+    free(entries);
+}
+
+// Write a boot-image-like blob: a header page, a gzipped kernel and a
+// gzipped ramdisk, each padded to a page.
+static void MakeBootImage(const unsigned char* kernel, size_t klen,
+                          const unsigned char* ramdisk, size_t rlen,
+                          Buffer* out) {
+    static const unsigned char zeros[2048];
+
+    out->len = 0;
+    Append(out, "ANDROID!", 8);
+    Append(out, zeros, sizeof(zeros) - 8);
+    Deflate(kernel, klen, out, 31);
+    Append(out, zeros, (2048 - out->len % 2048) % 2048);
+    Deflate(ramdisk, rlen, out, 31);
+    Append(out, zeros, (2048 - out->len % 2048) % 2048);
+}
+
+static void MakeBootPair(Buffer* old, Buffer* new) {
+    size_t klen = g_scale / 2, rlen = g_scale / 4;
+    unsigned char* kernel = malloc(klen);
+    unsigned char* ramdisk = malloc(rlen);
+
+    // Kernels are mostly code: compressible, but not as much as text.
+    TextBytes(kernel, klen);
+    Perturb(kernel, klen, (int)(klen / 64));
+    TextBytes(ramdisk, rlen);
+    MakeBootImage(kernel, klen, ramdisk, rlen, old);
+
+    Perturb(kernel, klen, 200);
+    Perturb(ramdisk, rlen, 20);
+    MakeBootImage(kernel, klen, ramdisk, rlen, new);
+    free(kernel);
+    free(ramdisk);
+}
+
+static void MakeRandomPair(Buffer* old, Buffer* new) {
+    old->len = new->len = 0;
+    Reserve(old, g_scale);
+    RandomBytes(old->data, g_scale);
+    old->len = g_scale;
+
+    Append(new, old->data, g_scale / 3);
+    unsigned char insert[4096];
+    RandomBytes(insert, sizeof(insert));
+    Append(new, insert, sizeof(insert));
+    Append(new, old->data + g_scale / 3, g_scale - g_scale / 3);
+    Perturb(new->data, new->len, 500);
+}
+
+// --- running the tools ---
+
+static int WriteFile(const char* path, const unsigned char* data,
+                     size_t len) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL || (len > 0 && fwrite(data, len, 1, f) != 1)) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        if (f) fclose(f);
+        return -1;
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int CopyFile(const char* src, const char* dst) {
+    unsigned char buf[32768];
+    size_t n;
+    FILE* in = fopen(src, "rb");
+    FILE* out = in ? fopen(dst, "wb") : NULL;
+    int result = in != NULL && out != NULL ? 0 : -1;
+
+    while (result == 0 && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) result = -1;
+    }
+    if (in) fclose(in);
+    if (out && fclose(out) != 0) result = -1;
+    if (result != 0) fprintf(stderr, "failed to copy %s to %s\n", src, dst);
+    return result;
+}
+
+// Hash a file a block at a time, so the bench itself stays small.
+static int Sha1File(const char* path, char hex[41], size_t* len) {
+    unsigned char buf[32768];
+    const uint8_t* digest;
+    SHA_CTX ctx;
+    size_t n;
+    int i;
+    FILE* f = fopen(path, "rb");
+
+    if (f == NULL) return -1;
+    SHA_init(&ctx);
+    *len = 0;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        SHA_update(&ctx, buf, n);
+        *len += n;
+    }
+    fclose(f);
+    digest = SHA_final(&ctx);
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        sprintf(hex + i*2, "%02x", digest[i]);
+    }
+    return 0;
+}
+
+// Run argv[0], silently; return its exit status (or -1) and its peak
+// RSS in KB.  A child's peak RSS starts out at whatever the parent
+// was using when it forked, which is why the data is generated in
+// separate processes rather than here.
+static int Run(char* const argv[], long* maxrss_kb) {
+    struct rusage ru;
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0 || wait4(pid, &status, 0, &ru) != pid) return -1;
+    if (maxrss_kb) *maxrss_kb = ru.ru_maxrss;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// In a child process, generate a pair with 'make' into old_path and
+// new_path, and if bsdiff_patch is non-NULL diff them into it.
+static int Generate(void (*make)(Buffer*, Buffer*), const char* old_path,
+                    const char* new_path, const char* bsdiff_patch) {
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        Buffer old = { NULL, 0, 0 }, new = { NULL, 0, 0 };
+        make(&old, &new);
+        if (WriteFile(old_path, old.data, old.len) != 0 ||
+            WriteFile(new_path, new.data, new.len) != 0) {
+            _exit(1);
+        }
+        if (bsdiff_patch != NULL) {
+            SuffixArray* sa = NULL;
+            if (bsdiff(old.data, old.len, &sa, new.data, new.len,
+                       bsdiff_patch, BSDIFF_CODEC_BZIP2) != 0) {
+                _exit(1);
+            }
+            FreeSuffixArray(sa);
+        }
+        _exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "failed to generate %s\n", old_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Apply 'patch' to old_path and check the result against new_path.
+// Returns 0 if every run succeeds.
+static int BenchApply(const char* name, const char* old_path,
+                      const char* new_path, const char* patch) {
+    char old_sha1[41], new_sha1[41], size[32], patch_arg[PATH_MAX];
+    char out_path[PATH_MAX];
+    size_t old_len, new_len;
+    double best = 0;
+    long peak_kb = 0;
+    int it;
+
+    if (Sha1File(old_path, old_sha1, &old_len) != 0 ||
+        Sha1File(new_path, new_sha1, &new_len) != 0) {
+        fprintf(stderr, "%s: can't read %s or %s\n", name, old_path, new_path);
+        return -1;
+    }
+    snprintf(size, sizeof(size), "%zu", new_len);
+    snprintf(patch_arg, sizeof(patch_arg), "%s:%s", old_sha1, patch);
+    snprintf(out_path, sizeof(out_path), "%s/%s.out", g_workdir, name);
+
+    for (it = 0; it < g_iterations; ++it) {
+        char* argv[] = { (char*)g_applypatch, (char*)old_path, out_path,
+                         new_sha1, size, patch_arg, NULL };
+        char out_sha1[41];
+        size_t out_len;
+        long kb = 0;
+
+        unlink(out_path);
+        double start = now();
+        int status = Run(argv, &kb);
+        double elapsed = now() - start;
+        if (status != 0) {
+            fprintf(stderr, "%s: applypatch exited with %d\n", name, status);
+            return -1;
+        }
+        if (Sha1File(out_path, out_sha1, &out_len) != 0) {
+            fprintf(stderr, "%s: no output written\n", name);
+            return -1;
+        }
+        if (strcmp(out_sha1, new_sha1) != 0) {
+            fprintf(stderr, "%s: output sha1 %s, expected %s\n",
+                    name, out_sha1, new_sha1);
+            return -1;
+        }
+
+        if (it == 0 || elapsed < best) best = elapsed;
+        if (kb > peak_kb) peak_kb = kb;
+    }
+    unlink(out_path);
+
+    struct stat st;
+    stat(patch, &st);
+    printf("%-16s %8.1f MB  patch %9lld B  %8.3f s  %7.1f MB/s  "
+           "peak rss %7.1f MB\n",
+           name, new_len / (1024.0 * 1024.0), (long long)st.st_size, best,
+           best > 0 ? new_len / best / (1024.0 * 1024.0) : 0.0,
+           peak_kb / 1024.0);
+    return 0;
+}
+
+// Generate a pair with 'make', diff it with bsdiff (imgdiff_mode NULL)
+// or with the imgdiff binary (imgdiff_mode "" or "-z"), and bench
+// applying the patch.
+static int BenchCase(const char* name, void (*make)(Buffer*, Buffer*),
+                     const char* imgdiff_mode) {
+    char old_path[PATH_MAX], new_path[PATH_MAX], patch[PATH_MAX];
+    int result = -1;
+
+    snprintf(old_path, sizeof(old_path), "%s/%s.old", g_workdir, name);
+    snprintf(new_path, sizeof(new_path), "%s/%s.new", g_workdir, name);
+    snprintf(patch, sizeof(patch), "%s/%s.patch", g_workdir, name);
+
+    if (Generate(make, old_path, new_path,
+                 imgdiff_mode == NULL ? patch : NULL) != 0) {
+        goto done;
+    }
+    if (imgdiff_mode != NULL) {
+        char* argv[] = { (char*)g_imgdiff, (char*)imgdiff_mode,
+                         old_path, new_path, patch, NULL };
+        if (*imgdiff_mode == '\0') {
+            argv[1] = old_path;
+            argv[2] = new_path;
+            argv[3] = patch;
+            argv[4] = NULL;
+        }
+        int status = Run(argv, NULL);
+        if (status == 127) {
+            printf("%-16s skipped (can't run %s)\n", name, g_imgdiff);
+            result = 0;
+            goto done;
+        } else if (status != 0) {
+            fprintf(stderr, "%s: imgdiff exited with %d\n", name, status);
+            goto done;
+        }
+    }
+    result = BenchApply(name, old_path, new_path, patch);
+
+done:
+    unlink(old_path);
+    unlink(new_path);
+    unlink(patch);
+    return result;
+}
+
+// The checked-in bsdiff patch from testdata.
+static int BenchTestdata(const char* dir) {
+    char src[PATH_MAX], old_path[PATH_MAX], new_path[PATH_MAX];
+    char patch[PATH_MAX];
+    int result;
+
+    // applypatch may rewrite the source in place if it can't be
+    // patched elsewhere, so work on a copy.
+    snprintf(src, sizeof(src), "%s/old.file", dir);
+    snprintf(old_path, sizeof(old_path), "%s/testdata.old", g_workdir);
+    snprintf(new_path, sizeof(new_path), "%s/new.file", dir);
+    snprintf(patch, sizeof(patch), "%s/patch.bsdiff", dir);
+    if (CopyFile(src, old_path) != 0) return -1;
+    result = BenchApply("testdata", old_path, new_path, patch);
+    unlink(old_path);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    const char* testdata = NULL;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:w:a:i:d:")) != -1) {
+        switch (opt) {
+            case 'n': g_iterations = atoi(optarg); break;
+            case 's': g_scale = (size_t)atoi(optarg) << 20; break;
+            case 'w': g_workdir = optarg; break;
+            case 'a': g_applypatch = optarg; break;
+            case 'i': g_imgdiff = optarg; break;
+            case 'd': testdata = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n <iterations>] [-s <megabytes>] "
+                        "[-w <workdir>] [-a <applypatch>] [-i <imgdiff>] "
+                        "[-d <testdata>]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (g_iterations <= 0 || g_scale < (1 << 20)) {
+        fprintf(stderr, "iterations and size must be positive\n");
+        return 2;
+    }
+    mkdir(g_workdir, 0755);
+
+    if (testdata != NULL && BenchTestdata(testdata) != 0) failures++;
+
+    if (BenchCase("random-bsdiff", MakeRandomPair, NULL) != 0) failures++;
+    if (BenchCase("apk-bsdiff", MakeApkPair, NULL) != 0) failures++;
+    if (BenchCase("apk-imgdiff", MakeApkPair, "-z") != 0) failures++;
+    if (BenchCase("boot-bsdiff", MakeBootPair, NULL) != 0) failures++;
+    if (BenchCase("boot-imgdiff", MakeBootPair, "") != 0) failures++;
+
+    rmdir(g_workdir);
+    return failures == 0 ? 0 : 1;
+}
@@ -48,6 +48,9 @@
 #include <sys/types.h>
 
 #include <bzlib.h>
+#ifdef APPLYPATCH_USE_BROTLI
+#include <brotli/encode.h>
+#endif
 #include <err.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -55,6 +58,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "bsdiff.h"
+
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
 static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
@@ -156,6 +161,48 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+SuffixArray* BuildSuffixArray(const u_char* old, off_t oldsize, int method)
+{
+	SuffixArray* sa;
+
+	if ((sa = calloc(1, sizeof(SuffixArray))) == NULL) return NULL;
+	sa->n = oldsize;
+
+	if (method == SUFFIX_SORT_AUTO && oldsize < INT32_MAX) {
+		if ((sa->I32 = malloc((oldsize+1) * sizeof(int32_t))) == NULL ||
+		    sais(old, sa->I32 + 1, oldsize) != 0) {
+			FreeSuffixArray(sa);
+			return NULL;
+		}
+		sa->I32[0] = oldsize;
+	} else {
+		off_t* V;
+		sa->I64 = malloc((oldsize+1) * sizeof(off_t));
+		V = malloc((oldsize+1) * sizeof(off_t));
+		if (sa->I64 == NULL || V == NULL) {
+			free(V);
+			FreeSuffixArray(sa);
+			return NULL;
+		}
+		qsufsort(sa->I64, V, (u_char*)old, oldsize);
+		free(V);
+	}
+	return sa;
+}
+
+void FreeSuffixArray(SuffixArray* sa)
+{
+	if (sa == NULL) return;
+	free(sa->I32);
+	free(sa->I64);
+	free(sa);
+}
+
+size_t SuffixArrayBytes(const SuffixArray* sa)
+{
+	return (sa->n+1) * (sa->I32 ? sizeof(int32_t) : sizeof(off_t));
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,26 +213,29 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const SuffixArray *I,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
-	off_t x,y;
+	off_t x,y,ist,ien,ix;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		ist=SuffixArrayAt(I,st);
+		ien=SuffixArrayAt(I,en);
+		x=matchlen(old+ist,oldsize-ist,new,newsize);
+		y=matchlen(old+ien,oldsize-ien,new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=ist;
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=ien;
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
+	ix=SuffixArrayAt(I,x);
+	if(memcmp(old+ix,new,MIN(oldsize-ix,newsize))<0) {
 		return search(I,old,oldsize,new,newsize,x,en,pos);
 	} else {
 		return search(I,old,oldsize,new,newsize,st,x,pos);
@@ -210,56 +260,115 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+// Append len bytes of data to the patch, compressed with codec.
+static void write_block(FILE *pf, int codec, const u_char *data, off_t len,
+		const char *patch_filename)
+{
+	BZFILE *pfbz2;
+	int bz2err;
+
+	switch (codec) {
+	case BSDIFF_CODEC_NONE:
+		if (len > 0 && fwrite(data, len, 1, pf) != 1)
+			err(1, "fwrite(%s)", patch_filename);
+		return;
+
+	case BSDIFF_CODEC_BZIP2:
+		if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
+			errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+		BZ2_bzWrite(&bz2err, pfbz2, (void*)data, len);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+		BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+		return;
+
+#ifdef APPLYPATCH_USE_BROTLI
+	case BSDIFF_CODEC_BROTLI: {
+		BrotliEncoderState *bs;
+		size_t avail_in = len, avail_out;
+		const uint8_t *next_in = data;
+		uint8_t out[65536], *next_out;
+
+		if ((bs = BrotliEncoderCreateInstance(NULL, NULL, NULL)) == NULL)
+			errx(1, "BrotliEncoderCreateInstance");
+		BrotliEncoderSetParameter(bs, BROTLI_PARAM_QUALITY, 9);
+		BrotliEncoderSetParameter(bs, BROTLI_PARAM_LGWIN, 22);
+		BrotliEncoderSetParameter(bs, BROTLI_PARAM_SIZE_HINT,
+		    len < (1<<30) ? len : (1<<30));
+		do {
+			avail_out = sizeof(out);
+			next_out = out;
+			if (!BrotliEncoderCompressStream(bs,
+			    BROTLI_OPERATION_FINISH, &avail_in, &next_in,
+			    &avail_out, &next_out, NULL))
+				errx(1, "BrotliEncoderCompressStream");
+			if (avail_out < sizeof(out) &&
+			    fwrite(out, sizeof(out) - avail_out, 1, pf) != 1)
+				err(1, "fwrite(%s)", patch_filename);
+		} while (!BrotliEncoderIsFinished(bs));
+		BrotliEncoderDestroyInstance(bs);
+		return;
+	}
+#endif
+	}
+	errx(1, "unsupported patch codec %d", codec);
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
 //      data from files.  old and new are owned by the caller; we
 //      don't free them at the end.
 //
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
+//    - the suffix array is owned by the caller, who passes a
+//      pointer to *SAP, which can be NULL.  This way if we call
 //      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      the suffix sort the first time.
+//
+//    - the suffix array comes from BuildSuffixArray(), which uses
+//      SA-IS and 32-bit indices instead of qsufsort() when it can.
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+//    - the blocks are compressed with 'codec'.  Anything but bzip2
+//      makes a "BSDF2" patch rather than a "BSDIFF40" one.  The
+//      control block is collected in memory and written at the end.
+//
+int bsdiff(u_char* old, off_t oldsize, SuffixArray** SAP, u_char* new,
+           off_t newsize, const char* patch_filename, int codec)
 {
-	int fd;
-	off_t *I;
+	SuffixArray *I;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
 	off_t s,Sf,lenf,Sb,lenb;
 	off_t overlap,Ss,lens;
 	off_t i;
-	off_t dblen,eblen;
-	u_char *db,*eb;
-	u_char buf[8];
+	off_t dblen,eblen,cblen,cbsize;
+	u_char *db,*eb,*cb;
 	u_char header[32];
 	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
 
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+        if (*SAP == NULL) {
+            *SAP = BuildSuffixArray(old, oldsize, SUFFIX_SORT_AUTO);
+            if (*SAP == NULL) err(1, NULL);
         }
-        I = *IP;
+        I = *SAP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
 	dblen=0;
 	eblen=0;
+	cbsize=4096;
+	if((cb=malloc(cbsize))==NULL) err(1,NULL);
+	cblen=0;
 
 	/* Create the patch file */
 	if ((pf = fopen(patch_filename, "w")) == NULL)
               err(1, "%s", patch_filename);
 
 	/* Header is
-		0	8	 "BSDIFF40"
+		0	8	 "BSDIFF40" (or "BSDF2" and three codecs)
 		8	8	length of bzip2ed ctrl block
 		16	8	length of bzip2ed diff block
 		24	8	length of new file */
@@ -268,16 +377,19 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 		32	??	Bzip2ed ctrl block
 		??	??	Bzip2ed diff block
 		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
+	if (codec == BSDIFF_CODEC_BZIP2) {
+		memcpy(header,"BSDIFF40",8);
+	} else {
+		memcpy(header,"BSDF2",5);
+		header[5] = header[6] = header[7] = codec;
+	}
 	offtout(0, header + 8);
 	offtout(0, header + 16);
 	offtout(newsize, header + 24);
 	if (fwrite(header, 32, 1, pf) != 1)
 		err(1, "fwrite(%s)", patch_filename);
 
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+	/* Compute the differences, collecting ctrl as we go */
 	scan=0;len=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
@@ -340,29 +452,22 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 			dblen+=lenf;
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			if(cblen+24>cbsize) {
+				cbsize*=2;
+				if((cb=realloc(cb,cbsize))==NULL) err(1,NULL);
+			};
+			offtout(lenf,cb+cblen);
+			offtout((scan-lenb)-(lastscan+lenf),cb+cblen+8);
+			offtout((pos-lenb)-(lastpos+lenf),cb+cblen+16);
+			cblen+=24;
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	/* Write compressed ctrl data */
+	write_block(pf, codec, cb, cblen, patch_filename);
 
 	/* Compute size of compressed ctrl data */
 	if ((len = ftello(pf)) == -1)
@@ -370,14 +475,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(len-32, header + 8);
 
 	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	write_block(pf, codec, db, dblen, patch_filename);
 
 	/* Compute size of compressed diff data */
 	if ((newsize = ftello(pf)) == -1)
@@ -385,14 +483,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(newsize - len, header + 16);
 
 	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	write_block(pf, codec, eb, eblen, patch_filename);
 
 	/* Seek to the beginning, write the header, and close the file */
 	if (fseeko(pf, 0, SEEK_SET))
@@ -403,6 +494,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 		err(1, "fclose");
 
 	/* Free the memory we used */
+	free(cb);
 	free(db);
 	free(eb);
 
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BSDIFF_H
+#define _BSDIFF_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Patch containers.  Both start with a 32-byte header:
+//
+//   0   8   magic: "BSDIFF40", or "BSDF2" followed by one codec byte
+//           (BSDIFF_CODEC_*) for each of the three blocks
+//   8   8   length of the compressed control block
+//   16  8   length of the compressed diff block
+//   24  8   length of the new file
+//
+// and then the control, diff and extra blocks.  In a "BSDIFF40" patch
+// all three are bzip2.
+enum {
+    BSDIFF_CODEC_NONE = 0,
+    BSDIFF_CODEC_BZIP2 = 1,
+    BSDIFF_CODEC_BROTLI = 2,    // only with APPLYPATCH_USE_BROTLI
+};
+
+// Suffix array of the 'old' data, as used by bsdiff() to find matches.
+// Inputs under 2 GB are sorted with SA-IS into 32-bit indices; larger
+// ones fall back to qsufsort with off_t indices.
+typedef struct {
+    off_t n;         // length of the sorted data
+    int32_t* I32;
+    off_t* I64;
+} SuffixArray;
+
+enum {
+    SUFFIX_SORT_AUTO,       // SA-IS when the indices fit in 32 bits
+    SUFFIX_SORT_QSUFSORT,   // always use the original qsufsort
+};
+
+// Build the suffix array of old[0..oldsize-1].  Entry 0 is the empty
+// suffix (oldsize); entries 1..oldsize are the sorted suffixes.
+// Returns NULL if out of memory.
+SuffixArray* BuildSuffixArray(const u_char* old, off_t oldsize, int method);
+void FreeSuffixArray(SuffixArray* sa);
+
+// Bytes of memory held by sa's index.
+size_t SuffixArrayBytes(const SuffixArray* sa);
+
+static inline off_t SuffixArrayAt(const SuffixArray* sa, off_t i) {
+    return sa->I32 ? sa->I32[i] : sa->I64[i];
+}
+
+// Compute a bsdiff patch turning old into new and write it to
+// patch_filename.  *SAP caches the suffix array of old: if it is NULL
+// it is built (and left for the caller to free), so diffing several
+// targets against the same old data only sorts it once.  With
+// BSDIFF_CODEC_BZIP2 the patch is a "BSDIFF40" one; any other codec
+// gives a "BSDF2" patch.
+int bsdiff(u_char* old, off_t oldsize, SuffixArray** SAP,
+           u_char* new, off_t newsize, const char* patch_filename,
+           int codec);
+
+// In sais.c: sort the suffixes of s[0..n-1] into SA[0..n-1].  Returns
+// 0 on success or -1 if out of memory.
+int sais(const unsigned char* s, int32_t* SA, int32_t n);
+
+#endif
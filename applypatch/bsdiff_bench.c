@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compare patch generation with the qsufsort and SA-IS suffix sorts.
+ *
+ *     bsdiff_bench <old> <new> [<old> <new>...]
+ *
+ * Each pair is diffed once per sort, each time in a child process so
+ * that its peak RSS can be reported on its own.  The two suffix arrays
+ * and the two patches must be identical.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bsdiff.h"
+
+static const struct {
+    int method;
+    const char* name;
+} kSorts[] = {
+    { SUFFIX_SORT_QSUFSORT, "qsufsort" },
+    { SUFFIX_SORT_AUTO,     "sa-is" },
+};
+#define NUM_SORTS (sizeof(kSorts) / sizeof(kSorts[0]))
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u_char* read_file(const char* path, off_t* size) {
+    struct stat st;
+    FILE* f;
+    u_char* data;
+
+    if (stat(path, &st) != 0 || (f = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    data = malloc(st.st_size + 1);
+    if (data == NULL || fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+        fprintf(stderr, "failed to read %s\n", path);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *size = st.st_size;
+    return data;
+}
+
+static int same_file(const char* a, const char* b) {
+    off_t alen, blen;
+    u_char* adata = read_file(a, &alen);
+    u_char* bdata = read_file(b, &blen);
+    int same = adata && bdata && alen == blen &&
+               memcmp(adata, bdata, alen) == 0;
+    free(adata);
+    free(bdata);
+    return same;
+}
+
+// Check that both sorts produce the same suffix array.
+static int check_suffix_arrays(const u_char* old, off_t oldsize) {
+    SuffixArray* a = BuildSuffixArray(old, oldsize, SUFFIX_SORT_QSUFSORT);
+    SuffixArray* b = BuildSuffixArray(old, oldsize, SUFFIX_SORT_AUTO);
+    off_t i;
+    int ok = a != NULL && b != NULL;
+
+    for (i = 0; ok && i <= oldsize; ++i) {
+        if (SuffixArrayAt(a, i) != SuffixArrayAt(b, i)) {
+            fprintf(stderr, "suffix arrays differ at %lld\n", (long long)i);
+            ok = 0;
+        }
+    }
+    FreeSuffixArray(a);
+    FreeSuffixArray(b);
+    return ok;
+}
+
+// Run in a child: sort and diff, and report the times on 'out'.
+static void run_diff(const u_char* old, off_t oldsize,
+                     u_char* new, off_t newsize,
+                     int method, const char* patch, FILE* out) {
+    double start = now();
+    SuffixArray* sa = BuildSuffixArray(old, oldsize, method);
+    if (sa == NULL) _exit(1);
+    double sorted = now();
+    if (bsdiff((u_char*)old, oldsize, &sa, new, newsize, patch,
+               BSDIFF_CODEC_BZIP2) != 0) {
+        _exit(1);
+    }
+    double done = now();
+    fprintf(out, "%f %f %zu\n", sorted - start, done - start,
+            SuffixArrayBytes(sa));
+    fclose(out);
+    _exit(0);
+}
+
+static int bench_pair(const char* old_path, const char* new_path) {
+    off_t oldsize, newsize;
+    u_char* old = read_file(old_path, &oldsize);
+    u_char* new = read_file(new_path, &newsize);
+    char patches[NUM_SORTS][32];
+    unsigned int m;
+    int failures = 0;
+
+    if (old == NULL || new == NULL) {
+        free(old);
+        free(new);
+        return 1;
+    }
+
+    printf("%s -> %s (%lld -> %lld bytes)\n", old_path, new_path,
+           (long long)oldsize, (long long)newsize);
+    if (!check_suffix_arrays(old, oldsize)) failures++;
+
+    for (m = 0; m < NUM_SORTS; ++m) {
+        int fds[2];
+        int status;
+        struct rusage ru;
+        double sort_time, total_time;
+        size_t index_bytes;
+        FILE* in;
+        pid_t pid;
+
+        strcpy(patches[m], "/tmp/bsdiff-bench-XXXXXX");
+        close(mkstemp(patches[m]));
+        if (pipe(fds) != 0) {
+            fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+            failures++;
+            break;
+        }
+
+        pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            run_diff(old, oldsize, new, newsize, kSorts[m].method,
+                     patches[m], fdopen(fds[1], "w"));
+        }
+        close(fds[1]);
+        in = fdopen(fds[0], "r");
+        if (pid < 0 ||
+            fscanf(in, "%lf %lf %zu", &sort_time, &total_time,
+                   &index_bytes) != 3 ||
+            wait4(pid, &status, 0, &ru) != pid ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s: diff failed\n", kSorts[m].name);
+            fclose(in);
+            failures++;
+            continue;
+        }
+        fclose(in);
+
+        printf("  %-9s sort %8.3f s  diff %8.3f s  index %8.1f MB  "
+               "peak rss %8.1f MB\n",
+               kSorts[m].name, sort_time, total_time,
+               index_bytes / (1024.0 * 1024.0), ru.ru_maxrss / 1024.0);
+    }
+
+    for (m = 1; m < NUM_SORTS; ++m) {
+        if (!same_file(patches[0], patches[m])) {
+            fprintf(stderr, "%s and %s patches differ\n",
+                    kSorts[0].name, kSorts[m].name);
+            failures++;
+        }
+    }
+    for (m = 0; m < NUM_SORTS; ++m) unlink(patches[m]);
+
+    free(old);
+    free(new);
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    int failures = 0;
+    int i;
+
+    if (argc < 3 || argc % 2 != 1) {
+        fprintf(stderr, "Usage: %s <old> <new> [<old> <new>...]\n", argv[0]);
+        return 2;
+    }
+
+    for (i = 1; i < argc; i += 2) {
+        failures += bench_pair(argv[i], argv[i+1]);
+    }
+    return failures == 0 ? 0 : 1;
+}
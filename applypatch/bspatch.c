@@ -21,15 +21,20 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 
 #include <bzlib.h>
+#ifdef APPLYPATCH_USE_BROTLI
+#include <brotli/decode.h>
+#endif
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "bsdiff.h"
 
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
@@ -60,6 +65,10 @@ void ShowBSDiffLicense() {
          "\n------------------\n\n"
          "This program uses Julian R Seward's \"libbzip2\" library, available\n"
          "from http://www.bzip.org/.\n"
+#ifdef APPLYPATCH_USE_BROTLI
+         "\nand the Brotli decoder, available from\n"
+         "https://github.com/google/brotli.\n"
+#endif
         );
 }
 
@@ -97,156 +106,345 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+// One of the control, diff and extra streams of a patch, decoded with
+// whichever codec the patch header names for it.
+typedef struct {
+    int codec;                  // BSDIFF_CODEC_*
+    const char* what;
+    const unsigned char* next_in;
+    size_t avail_in;
+    bz_stream bz;
+#ifdef APPLYPATCH_USE_BROTLI
+    BrotliDecoderState* br;
+#endif
+} PatchStream;
+
+static int OpenPatchStream(PatchStream* ps, int codec, const char* data,
+                           ssize_t len, const char* what) {
+    memset(ps, 0, sizeof(*ps));
+    ps->codec = codec;
+    ps->what = what;
+    ps->next_in = (const unsigned char*)data;
+    ps->avail_in = len;
+
+    switch (codec) {
+        case BSDIFF_CODEC_NONE:
+            return 0;
+
+        case BSDIFF_CODEC_BZIP2: {
+            ps->bz.next_in = (char*)data;
+            ps->bz.avail_in = len;
+            int bzerr = BZ2_bzDecompressInit(&ps->bz, 0, 0);
+            if (bzerr != BZ_OK) {
+                printf("failed to bzinit %s stream (%d)\n", what, bzerr);
+                return -1;
+            }
+            return 0;
+        }
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
+#ifdef APPLYPATCH_USE_BROTLI
+        case BSDIFF_CODEC_BROTLI:
+            ps->br = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+            if (ps->br == NULL) {
+                printf("failed to create brotli decoder for %s stream\n",
+                       what);
+                return -1;
+            }
+            return 0;
+#endif
     }
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
-    }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+    printf("%s stream uses unsupported codec %d\n", what, codec);
+    return -1;
+}
+
+// Fill buffer[0..size-1] from the stream.
+static int ReadPatchStream(PatchStream* ps, unsigned char* buffer,
+                           ssize_t size) {
+    switch (ps->codec) {
+        case BSDIFF_CODEC_NONE:
+            if ((size_t)size > ps->avail_in) {
+                printf("%s stream is truncated\n", ps->what);
+                return -1;
+            }
+            memcpy(buffer, ps->next_in, size);
+            ps->next_in += size;
+            ps->avail_in -= size;
+            return 0;
+
+        case BSDIFF_CODEC_BZIP2:
+            return FillBuffer(buffer, size, &ps->bz);
+
+#ifdef APPLYPATCH_USE_BROTLI
+        case BSDIFF_CODEC_BROTLI: {
+            size_t avail_out = size;
+            while (avail_out > 0) {
+                BrotliDecoderResult r = BrotliDecoderDecompressStream(
+                    ps->br, &ps->avail_in, &ps->next_in,
+                    &avail_out, &buffer, NULL);
+                if (r == BROTLI_DECODER_RESULT_ERROR ||
+                    (avail_out > 0 &&
+                     r != BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT)) {
+                    printf("brotli error decompressing %s stream: %s\n",
+                           ps->what, BrotliDecoderErrorString(
+                               BrotliDecoderGetErrorCode(ps->br)));
+                    return -1;
+                }
+            }
+            return 0;
+        }
+#endif
     }
-    free(new_data);
+    return -1;
+}
 
-    return 0;
+static void ClosePatchStream(PatchStream* ps) {
+    switch (ps->codec) {
+        case BSDIFF_CODEC_BZIP2:
+            BZ2_bzDecompressEnd(&ps->bz);
+            break;
+#ifdef APPLYPATCH_USE_BROTLI
+        case BSDIFF_CODEC_BROTLI:
+            BrotliDecoderDestroyInstance(ps->br);
+            break;
+#endif
+    }
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
-    // Patch data format:
-    //   0       8       "BSDIFF40"
-    //   8       8       X
-    //   16      8       Y
-    //   24      8       sizeof(newfile)
-    //   32      X       bzip2(control block)
-    //   32+X    Y       bzip2(diff block)
-    //   32+X+Y  ???     bzip2(extra block)
-    // with control block a set of triples (x,y,z) meaning "add x bytes
-    // from oldfile to x bytes from the diff block; copy y bytes from the
-    // extra block; seek forwards in oldfile by z bytes".
+int IsBSDiffPatch(const char* data, ssize_t size) {
+    return size >= 8 && (memcmp(data, "BSDIFF40", 8) == 0 ||
+                         memcmp(data, "BSDF2", 5) == 0);
+}
 
-    unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
+// Parse the 32-byte patch header: the codec of each of the three
+// streams, the lengths of the first two, and the size of the output.
+static int ReadBSDiffHeader(const Value* patch, ssize_t patch_offset,
+                            int codecs[3], ssize_t* ctrl_len,
+                            ssize_t* data_len, ssize_t* new_size) {
+    const unsigned char* header =
+        (const unsigned char*) patch->data + patch_offset;
+    if (patch->size - patch_offset < 32 ||
+        !IsBSDiffPatch((const char*)header, patch->size - patch_offset)) {
         printf("corrupt bsdiff patch file header (magic number)\n");
-        return 1;
+        return -1;
+    }
+    int i;
+    for (i = 0; i < 3; ++i) {
+        codecs[i] = memcmp(header, "BSDF2", 5) == 0 ?
+            header[5+i] : BSDIFF_CODEC_BZIP2;
     }
 
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
-    *new_size = offtin(header+24);
-
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    *ctrl_len = offtin((u_char*)header+8);
+    *data_len = offtin((u_char*)header+16);
+    *new_size = offtin((u_char*)header+24);
+    if (*ctrl_len < 0 || *data_len < 0 || *new_size < 0 ||
+        32 + *ctrl_len + *data_len > patch->size - patch_offset) {
         printf("corrupt patch file header (data lengths)\n");
-        return 1;
+        return -1;
     }
+    return 0;
+}
 
-    int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+// Output is produced in windows of at most this many bytes and handed
+// to the sink as each fills, so the whole target is never in memory.
+#define BSDIFF_OUTPUT_WINDOW (1024*1024)
+
+typedef struct {
+    unsigned char* buffer;
+    ssize_t size;
+    ssize_t used;
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+} OutputWindow;
+
+static int FlushWindow(OutputWindow* w) {
+    if (w->used == 0) return 0;
+    if (w->sink(w->buffer, w->used, w->token) != w->used) {
+        printf("short write of output: %d (%s)\n", errno, strerror(errno));
+        return -1;
     }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+    if (w->ctx) {
+        SHA_update(w->ctx, w->buffer, w->used);
     }
+    w->used = 0;
+    return 0;
+}
 
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
-    }
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    // See ApplyBSDiffPatchMem() for the patch format.  Only one window
+    // of the output is kept in memory at a time.
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
+    int codecs[3];
+    ssize_t ctrl_len, data_len, new_size;
+    if (ReadBSDiffHeader(patch, patch_offset, codecs,
+                         &ctrl_len, &data_len, &new_size) != 0) {
         return 1;
     }
 
+    const char* base = patch->data + patch_offset + 32;
+    PatchStream cstream, dstream, estream;
+    int opened = 0;
+    if (OpenPatchStream(&cstream, codecs[0], base, ctrl_len,
+                        "control") != 0) {
+        goto fail;
+    }
+    ++opened;
+    if (OpenPatchStream(&dstream, codecs[1], base + ctrl_len, data_len,
+                        "diff") != 0) {
+        goto fail;
+    }
+    ++opened;
+    if (OpenPatchStream(&estream, codecs[2], base + ctrl_len + data_len,
+                        patch->size - (patch_offset + 32 + ctrl_len + data_len),
+                        "extra") != 0) {
+        goto fail;
+    }
+    ++opened;
+
+    OutputWindow w;
+    w.size = new_size < BSDIFF_OUTPUT_WINDOW ? new_size : BSDIFF_OUTPUT_WINDOW;
+    w.used = 0;
+    w.sink = sink;
+    w.token = token;
+    w.ctx = ctx;
+    w.buffer = malloc(w.size > 0 ? w.size : 1);
+    if (w.buffer == NULL) {
+        printf("failed to allocate %ld bytes for output window\n",
+               (long)w.size);
+        goto fail;
+    }
+
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (ReadPatchStream(&cstream, buf, 24) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto fail_window;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            newpos + ctrl[0] + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto fail_window;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
+        // Diff string plus old data, one window at a time.
+        off_t left = ctrl[0];
+        while (left > 0) {
+            ssize_t n = w.size - w.used;
+            if (n > left) n = left;
+            unsigned char* out = w.buffer + w.used;
+            if (ReadPatchStream(&dstream, out, n) != 0) {
+                printf("error while reading diff stream\n");
+                goto fail_window;
+            }
+            ssize_t i;
+            for (i = 0; i < n; ++i) {
+                if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
+                    out[i] += old_data[oldpos+i];
+                }
+            }
+            w.used += n;
+            oldpos += n;
+            left -= n;
+            if (w.used == w.size && FlushWindow(&w) != 0) goto fail_window;
         }
+        newpos += ctrl[0];
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Extra string
+        left = ctrl[1];
+        while (left > 0) {
+            ssize_t n = w.size - w.used;
+            if (n > left) n = left;
+            if (ReadPatchStream(&estream, w.buffer + w.used, n) != 0) {
+                printf("error while reading extra stream\n");
+                goto fail_window;
             }
+            w.used += n;
+            left -= n;
+            if (w.used == w.size && FlushWindow(&w) != 0) goto fail_window;
         }
+        newpos += ctrl[1];
+        oldpos += ctrl[2];
+    }
+    if (FlushWindow(&w) != 0) goto fail_window;
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
+    free(w.buffer);
+    ClosePatchStream(&cstream);
+    ClosePatchStream(&dstream);
+    ClosePatchStream(&estream);
+    return 0;
 
-        // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
+  fail_window:
+    free(w.buffer);
+  fail:
+    if (opened > 0) ClosePatchStream(&cstream);
+    if (opened > 1) ClosePatchStream(&dstream);
+    if (opened > 2) ClosePatchStream(&estream);
+    return 1;
+}
 
-        // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
-        }
+typedef struct {
+    unsigned char* buffer;
+    ssize_t size;
+    ssize_t pos;
+} MemoryTarget;
+
+static ssize_t MemoryTargetSink(unsigned char* data, ssize_t len,
+                                void* token) {
+    MemoryTarget* t = (MemoryTarget*)token;
+    if (len > t->size - t->pos) len = t->size - t->pos;
+    memcpy(t->buffer + t->pos, data, len);
+    t->pos += len;
+    return len;
+}
 
-        // Adjust pointers
-        newpos += ctrl[1];
-        oldpos += ctrl[2];
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    // Patch data format:
+    //   0       8       "BSDIFF40", or "BSDF2" and a codec byte for
+    //                   each block (see bsdiff.h)
+    //   8       8       X
+    //   16      8       Y
+    //   24      8       sizeof(newfile)
+    //   32      X       bzip2(control block)
+    //   32+X    Y       bzip2(diff block)
+    //   32+X+Y  ???     bzip2(extra block)
+    // with control block a set of triples (x,y,z) meaning "add x bytes
+    // from oldfile to x bytes from the diff block; copy y bytes from the
+    // extra block; seek forwards in oldfile by z bytes".
+
+    int codecs[3];
+    ssize_t ctrl_len, data_len;
+    if (ReadBSDiffHeader(patch, patch_offset, codecs,
+                         &ctrl_len, &data_len, new_size) != 0) {
+        return 1;
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+    MemoryTarget t;
+    t.size = *new_size;
+    t.pos = 0;
+    t.buffer = malloc(t.size > 0 ? t.size : 1);
+    if (t.buffer == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+    if (ApplyBSDiffPatch(old_data, old_size, patch, patch_offset,
+                         MemoryTargetSink, &t, NULL) != 0) {
+        free(t.buffer);
+        return 1;
+    }
+    *new_data = t.buffer;
     return 0;
 }
@@ -111,6 +111,9 @@
  *
  * After the header there are 'chunk count' bsdiff patches; the offset
  * of each from the beginning of the file is specified in the header.
+ * By default these are "BSDIFF40" patches (bzip2); "-c brotli" makes
+ * them "BSDF2" patches with brotli-compressed blocks, which decode
+ * several times faster on the device (see bsdiff.h).
  *
  * This tool can take an optional file of "bonus data".  This is an
  * extra file of data that is appended to chunk #1 after it is
@@ -122,14 +125,18 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
 
 #include "zlib.h"
+#include "bsdiff.h"
 #include "imgdiff.h"
 #include "utils.h"
 
@@ -138,12 +145,13 @@ typedef struct {
   size_t start;         // offset of chunk in original image file
 
   size_t len;
-  unsigned char* data;  // data to be patched (uncompressed, for deflate chunks)
+  unsigned char* data;  // data to be patched (uncompressed, for deflate
+                        // chunks, and NULL until ExpandChunk() is called)
 
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  SuffixArray* I;       // used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -159,6 +167,8 @@ typedef struct {
   size_t source_uncompressed_len;
 } ImageChunk;
 
+#define BUFFER_SIZE 32768
+
 typedef struct {
   int data_offset;
   int deflate_len;
@@ -178,27 +188,97 @@ static int fileentry_compare(const void* a, const void* b) {
   }
 }
 
-// from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
-
-unsigned char* ReadZip(const char* filename,
-                       int* num_chunks, ImageChunk** chunks,
-                       int include_pseudo_chunk) {
+/*
+ * Map the whole of the given file read-only, putting its size in
+ * *size.  The mapping is never unmapped; chunks point into it for the
+ * life of the program.  Returns NULL on failure.
+ */
+static unsigned char* MapFile(const char* filename, size_t* size) {
+  static unsigned char empty[1];
   struct stat st;
-  if (stat(filename, &st) != 0) {
-    printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+    if (fd >= 0) close(fd);
     return NULL;
   }
-
-  unsigned char* img = malloc(st.st_size);
-  FILE* f = fopen(filename, "rb");
-  if (fread(img, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read \"%s\" %s\n", filename, strerror(errno));
-    fclose(f);
+  *size = st.st_size;
+  if (st.st_size == 0) {
+    close(fd);
+    return empty;
+  }
+  unsigned char* img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (img == MAP_FAILED) {
+    printf("failed to map \"%s\": %s\n", filename, strerror(errno));
     return NULL;
   }
-  fclose(f);
+  return img;
+}
+
+/*
+ * Inflate a deflate chunk's data into a malloc'd buffer, if that
+ * hasn't been done already.  Deflate chunks are only expanded while
+ * they are needed, so that two large images don't have to fit in
+ * memory uncompressed.  Returns 0 on success.
+ */
+int ExpandChunk(ImageChunk* ch) {
+  if (ch->type != CHUNK_DEFLATE || ch->data != NULL) return 0;
+
+  ch->data = malloc(ch->len > 0 ? ch->len : 1);
+  if (ch->data == NULL) {
+    printf("failed to allocate %zu bytes for chunk\n", ch->len);
+    return -1;
+  }
+
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = ch->deflate_len;
+  strm.next_in = ch->deflate_data;
+
+  // -15 means we are decoding a 'raw' deflate stream; zlib will
+  // not expect zlib headers.
+  int ret = inflateInit2(&strm, -15);
+
+  strm.avail_out = ch->len;
+  strm.next_out = ch->data;
+  ret = inflate(&strm, Z_NO_FLUSH);
+  inflateEnd(&strm);
+  if (ret != Z_STREAM_END || strm.avail_out != 0) {
+    printf("failed to inflate \"%s\"; %d\n",
+           ch->filename ? ch->filename : "(gzip chunk)", ret);
+    free(ch->data);
+    ch->data = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Drop the uncompressed copy of a deflate chunk.
+ */
+void ReleaseChunk(ImageChunk* ch) {
+  if (ch->type != CHUNK_DEFLATE) return;
+  free(ch->data);
+  ch->data = NULL;
+}
+
+/*
+ * Map the given zip file and break it up into chunks, as for
+ * ReadImage().  Deflated entries become CHUNK_DEFLATE chunks whose
+ * uncompressed data is not read until ExpandChunk().
+ */
+unsigned char* ReadZip(const char* filename,
+                       int* num_chunks, ImageChunk** chunks,
+                       int include_pseudo_chunk) {
+  struct stat st;
+  size_t img_size;
+  unsigned char* img = MapFile(filename, &img_size);
+  if (img == NULL) return NULL;
+  st.st_size = img_size;
 
   // look for the end-of-central-directory record.
 
@@ -311,28 +391,7 @@ unsigned char* ReadZip(const char* filename,
       curr->I = NULL;
 
       curr->len = temp_entries[nextentry].uncomp_len;
-      curr->data = malloc(curr->len);
-
-      z_stream strm;
-      strm.zalloc = Z_NULL;
-      strm.zfree = Z_NULL;
-      strm.opaque = Z_NULL;
-      strm.avail_in = curr->deflate_len;
-      strm.next_in = curr->deflate_data;
-
-      // -15 means we are decoding a 'raw' deflate stream; zlib will
-      // not expect zlib headers.
-      int ret = inflateInit2(&strm, -15);
-
-      strm.avail_out = curr->len;
-      strm.next_out = curr->data;
-      ret = inflate(&strm, Z_NO_FLUSH);
-      if (ret != Z_STREAM_END) {
-        printf("failed to inflate \"%s\"; %d\n", curr->filename, ret);
-        return NULL;
-      }
-
-      inflateEnd(&strm);
+      curr->data = NULL;
 
       pos += curr->deflate_len;
       ++nextentry;
@@ -365,35 +424,20 @@ unsigned char* ReadZip(const char* filename,
 }
 
 /*
- * Read the given file and break it up into chunks, putting the number
+ * Map the given file and break it up into chunks, putting the number
  * of chunks and their info in *num_chunks and **chunks,
- * respectively.  Returns a malloc'd block of memory containing the
- * contents of the file; various pointers in the output chunk array
- * will point into this block of memory.  The caller should free the
- * return value when done with all the chunks.  Returns NULL on
- * failure.
+ * respectively.  Returns the mapping of the file; various pointers in
+ * the output chunk array point into it.  Deflate chunks are inflated
+ * once here to find where they end, but their uncompressed data is
+ * not kept until ExpandChunk() is called.  Returns NULL on failure.
  */
 unsigned char* ReadImage(const char* filename,
                          int* num_chunks, ImageChunk** chunks) {
   struct stat st;
-  if (stat(filename, &st) != 0) {
-    printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
-    return NULL;
-  }
-
-  unsigned char* img = malloc(st.st_size + 4);
-  FILE* f = fopen(filename, "rb");
-  if (fread(img, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read \"%s\" %s\n", filename, strerror(errno));
-    fclose(f);
-    return NULL;
-  }
-  fclose(f);
-
-  // append 4 zero bytes to the data so we can always search for the
-  // four-byte string 1f8b0800 starting at any point in the actual
-  // file data, without special-casing the end of the data.
-  memset(img+st.st_size, 0, 4);
+  size_t img_size;
+  unsigned char* img = MapFile(filename, &img_size);
+  if (img == NULL) return NULL;
+  st.st_size = img_size;
 
   size_t pos = 0;
 
@@ -429,12 +473,12 @@ unsigned char* ReadImage(const char* filename,
       curr->I = NULL;
 
       // We must decompress this chunk in order to discover where it
-      // ends, and so we can put the uncompressed data and its length
-      // into curr->data and curr->len.
+      // ends and how long it is uncompressed; the data itself goes
+      // into a scratch buffer and is thrown away.
 
-      size_t allocated = 32768;
+      unsigned char* scratch = malloc(BUFFER_SIZE);
       curr->len = 0;
-      curr->data = malloc(allocated);
+      curr->data = NULL;
       curr->start = pos;
       curr->deflate_data = p;
 
@@ -450,15 +494,17 @@ unsigned char* ReadImage(const char* filename,
       int ret = inflateInit2(&strm, -15);
 
       do {
-        strm.avail_out = allocated - curr->len;
-        strm.next_out = curr->data + curr->len;
+        strm.avail_out = BUFFER_SIZE;
+        strm.next_out = scratch;
         ret = inflate(&strm, Z_NO_FLUSH);
-        curr->len = allocated - strm.avail_out;
-        if (strm.avail_out == 0) {
-          allocated *= 2;
-          curr->data = realloc(curr->data, allocated);
-        }
-      } while (ret != Z_STREAM_END);
+        curr->len += BUFFER_SIZE - strm.avail_out;
+      } while (ret == Z_OK);
+      free(scratch);
+      if (ret != Z_STREAM_END) {
+        printf("failed to inflate gzip chunk at %zu; %d\n", pos, ret);
+        inflateEnd(&strm);
+        return NULL;
+      }
 
       curr->deflate_len = st.st_size - strm.avail_in - pos;
       inflateEnd(&strm);
@@ -486,7 +532,6 @@ unsigned char* ReadImage(const char* filename,
       if (footer_size != curr[-2].len) {
         printf("Error: footer size %d != decompressed size %d\n",
                 footer_size, curr[-2].len);
-        free(img);
         return NULL;
       }
     } else {
@@ -504,7 +549,8 @@ unsigned char* ReadImage(const char* filename,
       curr->data = p;
 
       for (curr->len = 0; curr->len < (st.st_size - pos); ++curr->len) {
-        if (p[curr->len] == 0x1f &&
+        if (st.st_size - pos - curr->len >= 4 &&
+            p[curr->len] == 0x1f &&
             p[curr->len+1] == 0x8b &&
             p[curr->len+2] == 0x08 &&
             p[curr->len+3] == 0x00) {
@@ -518,8 +564,6 @@ unsigned char* ReadImage(const char* filename,
   return img;
 }
 
-#define BUFFER_SIZE 32768
-
 /*
  * Takes the uncompressed data stored in the chunk, compresses it
  * using the zlib parameters stored in the chunk, and checks that it
@@ -598,25 +642,41 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
   return -1;
 }
 
+// Normal chunks this small are cheaper to store than to patch.
+static int IsTinyChunk(ImageChunk* tgt) {
+  return tgt->type == CHUNK_NORMAL && tgt->len <= 160;
+}
+
 /*
  * Given source and target chunks, compute a bsdiff patch between them
- * by running bsdiff in a subprocess.  Return the patch data, placing
- * its length in *size.  Return NULL on failure.  We expect the bsdiff
- * program to be in the path.
+ * by calling bsdiff() in-process.  src->I caches the source's suffix
+ * array and is built if NULL.  Return the patch data, placing its
+ * length in *size, or NULL on failure.  A normal target that is tiny,
+ * or that the patch wouldn't shrink, is turned into a raw chunk and its
+ * own data is returned instead.
+ *
+ * Safe to call from several threads at once provided src->I has already
+ * been built: src is then only read, and each call writes its patch to
+ * its own temporary file.
  */
-unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
-  if (tgt->type == CHUNK_NORMAL) {
-    if (tgt->len <= 160) {
-      tgt->type = CHUNK_RAW;
-      *size = tgt->len;
-      return tgt->data;
-    }
+unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size,
+                         int codec) {
+  if (IsTinyChunk(tgt)) {
+    tgt->type = CHUNK_RAW;
+    *size = tgt->len;
+    return tgt->data;
   }
 
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
+  int fd = mkstemp(ptemp);
+  if (fd < 0) {
+    printf("failed to create patch file: %s\n", strerror(errno));
+    return NULL;
+  }
+  close(fd);
 
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
+  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp,
+                 codec);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
     return NULL;
@@ -771,6 +831,169 @@ ImageChunk* FindChunkByName(const char* name,
   return NULL;
 }
 
+/*
+ * The chunk patches are independent, so they are computed on a pool
+ * of threads.  Each patch needs its source chunk expanded and sorted
+ * into a suffix array (done once per source, under that source's lock,
+ * and dropped when the last patch using it is done), its target chunk
+ * expanded, and bsdiff's working buffers.
+ * Patches are started in chunk order, and one is only started while
+ * others are running if its estimated memory fits in the budget, so a
+ * few large chunks can't all sort their sources at once.  The results
+ * land in per-chunk slots, so the output doesn't depend on the order
+ * in which the patches finish.
+ */
+typedef struct {
+  ImageChunk* src_chunks;
+  ImageChunk** srcs;            // source chunk for each target chunk
+  ImageChunk* tgt_chunks;
+  int num_chunks;
+  unsigned char** patch_data;
+  size_t* patch_size;
+  int codec;
+
+  pthread_mutex_t* src_locks;   // one per source chunk
+  int* src_users;               // patches still to use each source
+  char* src_ready;              // source expanded and sorted
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int next;                     // next target chunk to start
+  int running;
+  size_t mem_budget;
+  size_t mem_in_use;
+} PatchQueue;
+
+static size_t PatchMemoryCost(ImageChunk* src, ImageChunk* tgt,
+                              int src_ready) {
+  if (IsTinyChunk(tgt)) return 0;
+  // The expanded target and bsdiff's diff and extra blocks, plus the
+  // expanded source and its suffix array if nobody has made them yet.
+  size_t cost = 2 * (tgt->len + 1);
+  if (tgt->type == CHUNK_DEFLATE) cost += tgt->len;
+  if (!src_ready) {
+    cost += (src->len + 1) * sizeof(int32_t);
+    if (src->type == CHUNK_DEFLATE) cost += src->len;
+  }
+  return cost;
+}
+
+static void* PatchWorker(void* cookie) {
+  PatchQueue* q = (PatchQueue*)cookie;
+
+  pthread_mutex_lock(&q->lock);
+  while (q->next < q->num_chunks) {
+    int i = q->next;
+    ImageChunk* src = q->srcs[i];
+    ImageChunk* tgt = q->tgt_chunks + i;
+    int s = src - q->src_chunks;
+    size_t cost = PatchMemoryCost(src, tgt, q->src_ready[s]);
+
+    if (q->running > 0 && q->mem_in_use + cost > q->mem_budget) {
+      pthread_cond_wait(&q->cond, &q->lock);
+      continue;
+    }
+    ++q->next;
+    ++q->running;
+    q->mem_in_use += cost;
+    pthread_mutex_unlock(&q->lock);
+
+    int ok = 1;
+    if (!IsTinyChunk(tgt)) {
+      pthread_mutex_lock(&q->src_locks[s]);
+      if (src->I == NULL && ExpandChunk(src) == 0) {
+        src->I = BuildSuffixArray(src->data, src->len, SUFFIX_SORT_AUTO);
+      }
+      ok = src->I != NULL;
+      pthread_mutex_unlock(&q->src_locks[s]);
+      if (ok) {
+        pthread_mutex_lock(&q->lock);
+        q->src_ready[s] = 1;
+        pthread_mutex_unlock(&q->lock);
+      }
+      ok = ok && ExpandChunk(tgt) == 0;
+    }
+    if (ok) {
+      q->patch_data[i] = MakePatch(src, tgt, q->patch_size + i, q->codec);
+    } else {
+      printf("failed to prepare chunk %d\n", i);
+    }
+    ReleaseChunk(tgt);
+
+    pthread_mutex_lock(&q->lock);
+    if (--q->src_users[s] == 0) {
+      FreeSuffixArray(src->I);
+      src->I = NULL;
+      ReleaseChunk(src);
+    }
+    --q->running;
+    q->mem_in_use -= cost;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+/*
+ * Compute the patch for each target chunk against srcs[i], using up
+ * to 'threads' threads and (beyond the first patch running) about
+ * 'mem_budget' bytes.  patch_data[i] is NULL for patches that failed.
+ */
+void MakePatches(ImageChunk* src_chunks, int num_src_chunks,
+                 ImageChunk** srcs, ImageChunk* tgt_chunks, int num_chunks,
+                 unsigned char** patch_data, size_t* patch_size,
+                 int codec, int threads, size_t mem_budget) {
+  PatchQueue q;
+  int i;
+
+  q.src_chunks = src_chunks;
+  q.srcs = srcs;
+  q.tgt_chunks = tgt_chunks;
+  q.num_chunks = num_chunks;
+  q.patch_data = patch_data;
+  q.patch_size = patch_size;
+  q.codec = codec;
+  q.src_locks = malloc(num_src_chunks * sizeof(pthread_mutex_t));
+  q.src_users = calloc(num_src_chunks, sizeof(int));
+  q.src_ready = calloc(num_src_chunks, 1);
+  for (i = 0; i < num_src_chunks; ++i) {
+    pthread_mutex_init(&q.src_locks[i], NULL);
+  }
+  for (i = 0; i < num_chunks; ++i) {
+    patch_data[i] = NULL;
+    ++q.src_users[srcs[i] - src_chunks];
+  }
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.cond, NULL);
+  q.next = 0;
+  q.running = 0;
+  q.mem_budget = mem_budget;
+  q.mem_in_use = 0;
+
+  if (threads > num_chunks) threads = num_chunks;
+  pthread_t* tids = malloc(threads * sizeof(pthread_t));
+  int started = 0;
+  for (i = 1; i < threads; ++i) {
+    if (pthread_create(&tids[started], NULL, PatchWorker, &q) == 0) {
+      ++started;
+    }
+  }
+  PatchWorker(&q);
+  for (i = 0; i < started; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  free(tids);
+
+  pthread_cond_destroy(&q.cond);
+  pthread_mutex_destroy(&q.lock);
+  for (i = 0; i < num_src_chunks; ++i) {
+    pthread_mutex_destroy(&q.src_locks[i]);
+  }
+  free(q.src_locks);
+  free(q.src_users);
+  free(q.src_ready);
+}
+
 void DumpChunks(ImageChunk* chunks, int num_chunks) {
     int i;
     for (i = 0; i < num_chunks; ++i) {
@@ -781,12 +1004,45 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
 
 int main(int argc, char** argv) {
   int zip_mode = 0;
-
-  if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
-    zip_mode = 1;
-    --argc;
-    ++argv;
+  int codec = BSDIFF_CODEC_BZIP2;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  // By default let patches in flight use up to half of RAM.
+  size_t mem_budget = (size_t)sysconf(_SC_PHYS_PAGES) / 2 *
+                      sysconf(_SC_PAGESIZE);
+
+  while (argc >= 2) {
+    if (strcmp(argv[1], "-z") == 0) {
+      zip_mode = 1;
+      --argc;
+      ++argv;
+    } else if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+      threads = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+      if (strcmp(argv[2], "bzip2") == 0) {
+        codec = BSDIFF_CODEC_BZIP2;
+#ifdef APPLYPATCH_USE_BROTLI
+      } else if (strcmp(argv[2], "brotli") == 0) {
+        codec = BSDIFF_CODEC_BROTLI;
+#endif
+      } else if (strcmp(argv[2], "none") == 0) {
+        codec = BSDIFF_CODEC_NONE;
+      } else {
+        printf("unsupported patch codec \"%s\"\n", argv[2]);
+        return 2;
+      }
+      argc -= 2;
+      argv += 2;
+    } else if (argc >= 3 && strcmp(argv[1], "-m") == 0) {
+      mem_budget = (size_t)atoi(argv[2]) << 20;
+      argc -= 2;
+      argv += 2;
+    } else {
+      break;
+    }
   }
+  if (threads < 1) threads = 1;
 
   size_t bonus_size = 0;
   unsigned char* bonus_data = NULL;
@@ -815,8 +1071,8 @@ int main(int argc, char** argv) {
 
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
-            argv[0]);
+    printf("usage: %s [-z] [-c <codec>] [-j <threads>] [-m <megabytes>] "
+           "[-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n", argv[0]);
     return 2;
   }
 
@@ -882,7 +1138,12 @@ int main(int argc, char** argv) {
       // can recompress it and get exactly the same bits as are in the
       // input target image.  If this fails, treat the chunk as a normal
       // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
+      if (ExpandChunk(tgt_chunks+i) != 0) {
+        return 1;
+      }
+      int reconstructed = ReconstructDeflateChunk(tgt_chunks+i);
+      ReleaseChunk(tgt_chunks+i);
+      if (reconstructed < 0) {
         printf("failed to reconstruct target deflate chunk %d [%s]; "
                "treating as normal\n", i, tgt_chunks[i].filename);
         ChangeDeflateChunkToNormal(tgt_chunks+i);
@@ -946,25 +1207,41 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  ImageChunk** srcs = malloc(num_tgt_chunks * sizeof(ImageChunk*));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        srcs[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        srcs[i] = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
         printf("  using %d bytes of bonus data for chunk %d\n", bonus_size, i);
-        src_chunks[i].data = realloc(src_chunks[i].data, src_chunks[i].len + bonus_size);
-        memcpy(src_chunks[i].data+src_chunks[i].len, bonus_data, bonus_size);
+        if (ExpandChunk(src_chunks+i) != 0) {
+          return 1;
+        }
+        unsigned char* data = malloc(src_chunks[i].len + bonus_size);
+        memcpy(data, src_chunks[i].data, src_chunks[i].len);
+        memcpy(data+src_chunks[i].len, bonus_data, bonus_size);
+        ReleaseChunk(src_chunks+i);
+        src_chunks[i].data = data;
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      srcs[i] = src_chunks+i;
+    }
+  }
+
+  MakePatches(src_chunks, num_src_chunks, srcs, tgt_chunks, num_tgt_chunks,
+              patch_data, patch_size, codec, threads, mem_budget);
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL) {
+      printf("failed to construct patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Linear-time suffix array construction by induced sorting (SA-IS),
+ * after Nong, Zhang and Chan, "Two Efficient Algorithms for Linear
+ * Time Suffix Array Construction" (2009).
+ *
+ * Unlike the paper's version the input does not need to end in a
+ * unique smallest character: the end of the string acts as a virtual
+ * sentinel, so arbitrary binary data can be sorted as-is.  The reduced
+ * problem of each level is stored in the upper half of SA, so apart
+ * from SA itself the only extra memory is one type bit per character
+ * and one bucket array per level.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsdiff.h"
+
+// Suffix types: a suffix is S-type if it is smaller than the suffix
+// that follows it, L-type if it is larger.  The sentinel is S-type.
+#define TGET(t, i)  (((t)[(i) >> 3] >> ((i) & 7)) & 1)
+#define TSET(t, i)  ((t)[(i) >> 3] |= (1 << ((i) & 7)))
+
+// LMS ("leftmost S") positions are S-type suffixes preceded by an
+// L-type one.  Position n (the sentinel) is always LMS, but it never
+// appears in SA.
+#define IS_LMS(t, i)  ((i) > 0 && TGET(t, i) && !TGET(t, (i) - 1))
+
+// The top level sorts bytes; the recursion sorts int32 names.
+#define CHR(i)  (cs == 1 ? (int32_t)((const unsigned char*)s)[i] \
+                         : ((const int32_t*)s)[i])
+
+static void get_buckets(const void* s, int32_t* bkt, int32_t n,
+                        int32_t k, int cs, int end) {
+    int32_t i, sum = 0;
+
+    memset(bkt, 0, k * sizeof(int32_t));
+    for (i = 0; i < n; ++i) {
+        ++bkt[CHR(i)];
+    }
+    for (i = 0; i < k; ++i) {
+        sum += bkt[i];
+        bkt[i] = end ? sum : sum - bkt[i];
+    }
+}
+
+// Given the LMS suffixes at the ends of their buckets, fill in the
+// L-type suffixes (scanning left to right) and then the S-type ones
+// (right to left).
+static void induce(const void* s, const uint8_t* t, int32_t* SA,
+                   int32_t* bkt, int32_t n, int32_t k, int cs) {
+    int32_t i, j;
+
+    get_buckets(s, bkt, n, k, cs, 0);
+    // The suffix just before the sentinel is L-type, and it's the
+    // smallest suffix in its bucket.
+    SA[bkt[CHR(n - 1)]++] = n - 1;
+    for (i = 0; i < n; ++i) {
+        j = SA[i] - 1;
+        if (j >= 0 && !TGET(t, j)) {
+            SA[bkt[CHR(j)]++] = j;
+        }
+    }
+
+    get_buckets(s, bkt, n, k, cs, 1);
+    for (i = n - 1; i >= 0; --i) {
+        j = SA[i] - 1;
+        if (j >= 0 && TGET(t, j)) {
+            SA[--bkt[CHR(j)]] = j;
+        }
+    }
+}
+
+// Sort the suffixes of s[0..n-1] (characters in [0, k)) into SA.
+static int sais_main(const void* s, int32_t* SA, int32_t n, int32_t k,
+                     int cs) {
+    int32_t i, j, n1, name, prev;
+    int32_t* bkt;
+    int32_t* s1;
+    uint8_t* t;
+
+    if (n == 1) {
+        SA[0] = 0;
+        return 0;
+    }
+
+    t = calloc(n / 8 + 1, 1);
+    bkt = malloc(k * sizeof(int32_t));
+    if (t == NULL || bkt == NULL) {
+        free(t);
+        free(bkt);
+        return -1;
+    }
+
+    // Classify each suffix; the last one is L-type because it is
+    // followed by the (smaller) sentinel.
+    for (i = n - 2; i >= 0; --i) {
+        if (CHR(i) < CHR(i + 1) ||
+            (CHR(i) == CHR(i + 1) && TGET(t, i + 1))) {
+            TSET(t, i);
+        }
+    }
+
+    // Stage 1: sort the LMS substrings by inducing from the LMS
+    // positions placed, in any order, at the ends of their buckets.
+    get_buckets(s, bkt, n, k, cs, 1);
+    for (i = 0; i < n; ++i) {
+        SA[i] = -1;
+    }
+    for (i = 1; i < n; ++i) {
+        if (IS_LMS(t, i)) {
+            SA[--bkt[CHR(i)]] = i;
+        }
+    }
+    induce(s, t, SA, bkt, n, k, cs);
+
+    // Collect the sorted LMS substrings at the front of SA.  There are
+    // at most n/2 of them, so their names fit in the back half.
+    n1 = 0;
+    for (i = 0; i < n; ++i) {
+        if (IS_LMS(t, SA[i])) {
+            SA[n1++] = SA[i];
+        }
+    }
+    for (i = n1; i < n; ++i) {
+        SA[i] = -1;
+    }
+
+    // Name each LMS substring by its rank, giving equal substrings the
+    // same name.  A substring that runs into the sentinel is unique.
+    name = 0;
+    prev = -1;
+    for (i = 0; i < n1; ++i) {
+        int32_t pos = SA[i];
+        int diff = 0;
+        int32_t d;
+        for (d = 0; ; ++d) {
+            if (prev == -1 || pos + d == n || prev + d == n ||
+                CHR(pos + d) != CHR(prev + d) ||
+                TGET(t, pos + d) != TGET(t, prev + d)) {
+                diff = 1;
+                break;
+            }
+            if (d > 0 && (IS_LMS(t, pos + d) || IS_LMS(t, prev + d))) {
+                break;
+            }
+        }
+        if (diff) {
+            ++name;
+            prev = pos;
+        }
+        SA[n1 + pos / 2] = name - 1;
+    }
+    for (i = n - 1, j = n - 1; i >= n1; --i) {
+        if (SA[i] >= 0) {
+            SA[j--] = SA[i];
+        }
+    }
+
+    // Stage 2: sort the reduced string s1, recursing only if the names
+    // aren't already unique.
+    s1 = SA + n - n1;
+    if (name < n1) {
+        if (sais_main(s1, SA, n1, name, sizeof(int32_t)) != 0) {
+            free(t);
+            free(bkt);
+            return -1;
+        }
+    } else {
+        for (i = 0; i < n1; ++i) {
+            SA[s1[i]] = i;
+        }
+    }
+
+    // Stage 3: map the sorted reduced suffixes back to LMS positions,
+    // put them at the ends of their buckets in that order, and induce
+    // the rest of the suffix array from them.
+    for (i = 1, j = 0; i < n; ++i) {
+        if (IS_LMS(t, i)) {
+            s1[j++] = i;
+        }
+    }
+    for (i = 0; i < n1; ++i) {
+        SA[i] = s1[SA[i]];
+    }
+    for (i = n1; i < n; ++i) {
+        SA[i] = -1;
+    }
+    get_buckets(s, bkt, n, k, cs, 1);
+    for (i = n1 - 1; i >= 0; --i) {
+        j = SA[i];
+        SA[i] = -1;
+        SA[--bkt[CHR(j)]] = j;
+    }
+    induce(s, t, SA, bkt, n, k, cs);
+
+    free(t);
+    free(bkt);
+    return 0;
+}
+
+int sais(const unsigned char* s, int32_t* SA, int32_t n) {
+    if (n < 0) return -1;
+    if (n == 0) return 0;
+    return sais_main(s, SA, n, 256, 1);
+}
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "expr.h"
@@ -32,8 +33,15 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
+static Value* CallFunction(State* state, Expr* expr);
+
 char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    // Literals are most of the arguments in a typical script; skip
+    // building a Value just to unwrap it again.
+    if (expr->fn == Literal) {
+        return strdup(expr->name);
+    }
+    Value* v = CallFunction(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -46,7 +54,7 @@ char* Evaluate(State* state, Expr* expr) {
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    return CallFunction(state, expr);
 }
 
 Value* StringValue(char* str) {
@@ -68,7 +76,11 @@ Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
         return StringValue(strdup(""));
     }
-    char** strings = malloc(argc * sizeof(char*));
+    char* local_strings[8];
+    char** strings = local_strings;
+    if (argc > 8) {
+        strings = malloc(argc * sizeof(char*));
+    }
     int i;
     for (i = 0; i < argc; ++i) {
         strings[i] = NULL;
@@ -95,7 +107,9 @@ Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     for (i = 0; i < argc; ++i) {
         free(strings[i]);
     }
-    free(strings);
+    if (strings != local_strings) {
+        free(strings);
+    }
     return StringValue(result);
 }
 
@@ -264,11 +278,17 @@ Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(result);
 }
 
+// Evaluate each argument in turn and return the last one's value.  The
+// parser only builds two-argument sequences; CompileExpr() merges a
+// chain of them into one.
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
-    Value* left = EvaluateValue(state, argv[0]);
-    if (left == NULL) return NULL;
-    FreeValue(left);
-    return EvaluateValue(state, argv[1]);
+    int i;
+    for (i = 0; i < argc - 1; ++i) {
+        Value* v = EvaluateValue(state, argv[i]);
+        if (v == NULL) return NULL;
+        FreeValue(v);
+    }
+    return EvaluateValue(state, argv[argc-1]);
 }
 
 Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -324,12 +344,16 @@ Value* Literal(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(strdup(name));
 }
 
+// Name of the nodes made by Build(); it isn't malloc'd, unlike the
+// names the parser gives literals and function calls.
+static char operator_name[] = "(operator)";
+
 Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_list v;
     va_start(v, count);
     Expr* e = malloc(sizeof(Expr));
     e->fn = fn;
-    e->name = "(operator)";
+    e->name = operator_name;
     e->argc = count;
     e->argv = malloc(count * sizeof(Expr*));
     int i;
@@ -342,6 +366,134 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     return e;
 }
 
+void FreeExpr(Expr* e) {
+    // Walk down argv[0] iteratively: a long chain of ';' is one level
+    // deeper per statement.
+    while (e != NULL) {
+        Expr* next = NULL;
+        int i;
+        for (i = e->argc - 1; i > 0; --i) {
+            FreeExpr(e->argv[i]);
+        }
+        if (e->argc > 0) {
+            next = e->argv[0];
+        }
+        free(e->argv);
+        if (e->name != operator_name) {
+            free(e->name);
+        }
+        free(e);
+        e = next;
+    }
+}
+
+// -----------------------------------------------------------------
+//   compiling
+// -----------------------------------------------------------------
+
+// Return the number of statements in a chain of ';', which the parser
+// builds as a left-deep tree of two-argument SequenceFn nodes.
+static int SequenceLength(Expr* e) {
+    int n = 1;
+    while (e->fn == SequenceFn && e->argc == 2) {
+        ++n;
+        e = e->argv[0];
+    }
+    return n;
+}
+
+// Store e's statements (if it's a chain of ';') or its arguments in
+// args, which must have room for max(SequenceLength(e), e->argc).
+static int CollectArgs(Expr* e, Expr** args) {
+    int n = SequenceLength(e);
+    int i;
+    if (n == 1) {
+        for (i = 0; i < e->argc; ++i) {
+            args[i] = e->argv[i];
+        }
+        return e->argc;
+    }
+    for (i = n - 1; i > 0; --i) {
+        args[i] = e->argv[1];
+        e = e->argv[0];
+    }
+    args[0] = e;
+    return n;
+}
+
+typedef struct {
+    size_t nodes;
+    size_t args;
+    size_t chars;
+} CompiledSize;
+
+static void MeasureExpr(Expr* e, CompiledSize* size) {
+    size->nodes++;
+    size->chars += strlen(e->name) + 1;
+
+    int n = SequenceLength(e);
+    if (n == 1) {
+        int i;
+        size->args += e->argc;
+        for (i = 0; i < e->argc; ++i) {
+            MeasureExpr(e->argv[i], size);
+        }
+        return;
+    }
+    size->args += n;
+    for (; n > 1; --n) {
+        MeasureExpr(e->argv[1], size);
+        e = e->argv[0];
+    }
+    MeasureExpr(e, size);
+}
+
+typedef struct {
+    Expr* node;
+    Expr** args;
+    char* chars;
+} CompiledCursor;
+
+static Expr* EmitExpr(Expr* e, CompiledCursor* c) {
+    Expr* out = c->node++;
+    size_t len = strlen(e->name) + 1;
+
+    out->fn = e->fn;
+    out->name = memcpy(c->chars, e->name, len);
+    c->chars += len;
+    out->start = e->start;
+    out->end = e->end;
+
+    out->argv = c->args;
+    out->argc = CollectArgs(e, out->argv);
+    c->args += out->argc;
+    if (out->argc == 0) {
+        out->argv = NULL;
+    }
+
+    int i;
+    for (i = 0; i < out->argc; ++i) {
+        out->argv[i] = EmitExpr(out->argv[i], c);
+    }
+    return out;
+}
+
+Expr* CompileExpr(Expr* root) {
+    CompiledSize size = { 0, 0, 0 };
+    MeasureExpr(root, &size);
+
+    char* block = malloc(size.nodes * sizeof(Expr) +
+                         size.args * sizeof(Expr*) + size.chars);
+    if (block == NULL) {
+        return NULL;
+    }
+    CompiledCursor c;
+    c.node = (Expr*) block;
+    c.args = (Expr**) (c.node + size.nodes);
+    c.chars = (char*) (c.args + size.args);
+    return EmitExpr(root, &c);
+}
+
 // -----------------------------------------------------------------
 //   the function table
 // -----------------------------------------------------------------
@@ -395,6 +547,170 @@ void RegisterBuiltins() {
 }
 
 
+// -----------------------------------------------------------------
+//   profiling
+// -----------------------------------------------------------------
+
+typedef struct {
+    int calls;
+    int64_t total_us;       // includes functions called by this one
+    int64_t self_us;
+    uint64_t bytes;
+} FunctionProfile;
+
+// One per profiled call in progress, linked from the innermost out.
+typedef struct ProfileFrame {
+    FunctionProfile* fp;
+    int64_t child_us;
+    struct ProfileFrame* parent;
+} ProfileFrame;
+
+typedef struct {
+    const char* name;
+    int64_t self_us;
+    int start, end;
+} SlowCall;
+
+#define PROFILE_SLOW_CALLS 10
+
+// Indexed like fn_table; NULL unless profiling.
+static FunctionProfile* fn_profile = NULL;
+static ProfileFrame* profile_top = NULL;
+static SlowCall slow_calls[PROFILE_SLOW_CALLS];
+static int slow_call_count = 0;
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void ProfileStart() {
+    free(fn_profile);
+    fn_profile = calloc(fn_entries > 0 ? fn_entries : 1,
+                        sizeof(FunctionProfile));
+    profile_top = NULL;
+    slow_call_count = 0;
+}
+
+void ProfileAddBytes(uint64_t bytes) {
+    if (profile_top != NULL) {
+        profile_top->fp->bytes += bytes;
+    }
+}
+
+// Literals and operators aren't in the function table; their time is
+// charged to whatever called them.
+static FunctionProfile* FindProfile(Expr* expr) {
+    if (expr->fn == Literal) return NULL;
+    NamedFunction key;
+    key.name = expr->name;
+    NamedFunction* nf = bsearch(&key, fn_table, fn_entries,
+                                sizeof(NamedFunction), fn_entry_compare);
+    if (nf == NULL || nf->fn != expr->fn) return NULL;
+    return fn_profile + (nf - fn_table);
+}
+
+// Keep the PROFILE_SLOW_CALLS calls with the most self time, slowest
+// first.
+static void RecordSlowCall(Expr* expr, int64_t self_us) {
+    int i = slow_call_count;
+    if (i == PROFILE_SLOW_CALLS) {
+        if (self_us <= slow_calls[i-1].self_us) return;
+        --i;
+    } else {
+        ++slow_call_count;
+    }
+    for (; i > 0 && slow_calls[i-1].self_us < self_us; --i) {
+        slow_calls[i] = slow_calls[i-1];
+    }
+    slow_calls[i].name = expr->name;
+    slow_calls[i].self_us = self_us;
+    slow_calls[i].start = expr->start;
+    slow_calls[i].end = expr->end;
+}
+
+static Value* CallFunction(State* state, Expr* expr) {
+    FunctionProfile* fp;
+    if (fn_profile == NULL || (fp = FindProfile(expr)) == NULL) {
+        return expr->fn(expr->name, state, expr->argc, expr->argv);
+    }
+
+    ProfileFrame frame;
+    frame.fp = fp;
+    frame.child_us = 0;
+    frame.parent = profile_top;
+    profile_top = &frame;
+
+    int64_t start = now_us();
+    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    int64_t elapsed = now_us() - start;
+
+    profile_top = frame.parent;
+    if (profile_top != NULL) {
+        profile_top->child_us += elapsed;
+    }
+    fp->calls++;
+    fp->total_us += elapsed;
+    fp->self_us += elapsed - frame.child_us;
+    RecordSlowCall(expr, elapsed - frame.child_us);
+    return v;
+}
+
+static int profile_compare(const void* a, const void* b) {
+    int64_t sa = fn_profile[*(const int*)a].self_us;
+    int64_t sb = fn_profile[*(const int*)b].self_us;
+    return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+void ProfileReport(FILE* f, State* state) {
+    if (fn_profile == NULL || f == NULL) return;
+
+    int* order = malloc((fn_entries > 0 ? fn_entries : 1) * sizeof(int));
+    int count = 0;
+    int i;
+    for (i = 0; i < fn_entries; ++i) {
+        if (fn_profile[i].calls > 0) order[count++] = i;
+    }
+    qsort(order, count, sizeof(int), profile_compare);
+
+    fprintf(f, "script profile (ms; total includes nested calls):\n");
+    fprintf(f, "  %-28s %7s %10s %10s %12s %8s\n",
+            "function", "calls", "self", "total", "bytes", "MB/s");
+    for (i = 0; i < count; ++i) {
+        const FunctionProfile* fp = fn_profile + order[i];
+        fprintf(f, "  %-28s %7d %10.1f %10.1f %12llu",
+                fn_table[order[i]].name, fp->calls, fp->self_us / 1000.0,
+                fp->total_us / 1000.0, (unsigned long long)fp->bytes);
+        if (fp->bytes > 0 && fp->total_us > 0) {
+            fprintf(f, " %8.1f\n", fp->bytes / (double)fp->total_us);
+        } else {
+            fprintf(f, " %8s\n", "-");
+        }
+    }
+    free(order);
+
+    fprintf(f, "slowest calls (self ms):\n");
+    for (i = 0; i < slow_call_count; ++i) {
+        const SlowCall* sc = slow_calls + i;
+        int line = 1;
+        int j;
+        for (j = 0; j < sc->start && state->script[j] != '\0'; ++j) {
+            if (state->script[j] == '\n') ++line;
+        }
+        char text[61];
+        int len = sc->end - sc->start;
+        if (len > (int)sizeof(text) - 1) len = sizeof(text) - 1;
+        for (j = 0; j < len; ++j) {
+            char c = state->script[sc->start + j];
+            text[j] = (c == '\n' || c == '\t') ? ' ' : c;
+        }
+        text[len] = '\0';
+        fprintf(f, "  %10.1f  line %-5d %s\n", sc->self_us / 1000.0, line, text);
+    }
+}
+
+
 // -----------------------------------------------------------------
 //   convenience methods for functions
 // -----------------------------------------------------------------
@@ -403,25 +719,25 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
+        char* arg = Evaluate(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            // Go back over the ones already handed out.
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                free(*(va_arg(v, char**)));
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
+        *(va_arg(v, char**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -429,25 +745,25 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
+        Value* arg = EvaluateValue(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            // Go back over the ones already handed out.
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
+                FreeValue(*(va_arg(v, Value**)));
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
+        *(va_arg(v, Value**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -17,6 +17,8 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #include "yydefs.h"
@@ -96,6 +98,16 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 // of arguments.
 Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 
+// Free a tree returned by the parser.
+void FreeExpr(Expr* e);
+
+// Copy the parse tree rooted at root into a single allocation, merging
+// each chain of ';' into one SequenceFn node so that evaluating a long
+// script doesn't recurse once per statement.  The result evaluates
+// exactly like the tree; the tree can be freed afterwards.  Release the
+// result with free().  Returns NULL if out of memory.
+Expr* CompileExpr(Expr* root);
+
 // Global builtins, registered by RegisterBuiltins().
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
@@ -130,6 +142,22 @@ void FinishRegistration();
 Function FindFunction(const char* name);
 
 
+// --- profiling ---
+
+// Start recording, for each registered function, how often it is
+// called, the wall time spent in it and the bytes it reports with
+// ProfileAddBytes().  Call after FinishRegistration().
+void ProfileStart();
+
+// Credit bytes read or written to the registered function currently
+// being evaluated.  Does nothing unless profiling.
+void ProfileAddBytes(uint64_t bytes);
+
+// Print the profile gathered since ProfileStart(), most self time
+// first, followed by the slowest individual calls in state->script.
+void ProfileReport(FILE* f, State* state);
+
+
 // --- convenience functions for use in functions ---
 
 // Evaluate the expressions in argv, giving 'count' char* (the ... is
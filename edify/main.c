@@ -40,12 +40,17 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         return 0;
     }
 
+    // Run the compiled form, as the updater does.
+    Expr* program = CompileExpr(e);
+    FreeExpr(e);
+
     State state;
     state.cookie = NULL;
     state.script = strdup(expr_str);
     state.errmsg = NULL;
 
-    result = Evaluate(&state, e);
+    result = Evaluate(&state, program);
+    free(program);
     free(state.errmsg);
     free(state.script);
     if (result == NULL && expected != NULL) {
@@ -18,12 +18,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <fs_mgr.h>
 
 #include "common.h"
 #include "install.h"
@@ -43,6 +48,7 @@ extern "C" {
 #include "root_device.hpp"
 
 #include "firmware.h"
+#include "updater/cmd_protocol.h"
 
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
@@ -129,9 +135,461 @@ int load_cotsettings()
 
 
 bool skip_check_device_info(char *ignore_device_info);
-			
+
+// Signature verification runs on its own thread while the package is
+// opened and the update binary extracted, so the package is only read
+// from storage once.  Nothing gets to run (and so nothing gets written
+// to a partition) until finish_verification() says the package is good.
+typedef struct {
+    const char* path;
+    Certificate* keys;
+    int num_keys;
+    bool running;
+    pthread_t thread;
+    int result;
+} PendingVerify;
+
+static void* verify_package_thread(void* cookie) {
+    PendingVerify* v = (PendingVerify*) cookie;
+    v->result = verify_file_cached(v->path, v->keys, v->num_keys);
+    return NULL;
+}
+
+static void start_verification(PendingVerify* v) {
+    v->result = VERIFY_FAILURE;
+    v->running = pthread_create(&v->thread, NULL, verify_package_thread, v) == 0;
+    if (!v->running) {
+        verify_package_thread(v);
+    }
+}
+
+// Wait for the verifier thread (if it's still going) and return its
+// result.  Safe to call more than once.
+static int finish_verification(PendingVerify* v) {
+    if (v->running) {
+        pthread_join(v->thread, NULL);
+        v->running = false;
+        LOGI("verify_file returned %d\n", v->result);
+    }
+    free(v->keys);
+    v->keys = NULL;
+    return v->result;
+}
+
+// How often text printed by the update binary is put on the screen;
+// anything printed in between is drawn in one go.
+#define UI_TEXT_FLUSH_MS 33
+
+// State shared between try_update_binary() and the thread reading the
+// update binary's command pipe.
+typedef struct {
+    int fd;
+    int currstatus;             // zipflash:CDI
+    char* firmware_type;
+    char* firmware_filename;
+
+    pthread_mutex_t lock;       // protects pending_text and done
+    pthread_cond_t cond;        // signalled when done is set
+    string pending_text;        // ui_print output not yet on screen
+    bool done;
+    bool bad_message;           // the pipe held something unparseable
+
+    uint64_t last_bytes;        // for the MB/s readout
+    uint64_t last_bytes_us;
+} UpdaterChannel;
+
+static void queue_ui_text(UpdaterChannel* ch, const char* str) {
+    char tmpbuf[256];
+    if (str)
+        snprintf(tmpbuf, 255, "<#selectbg_g><b>%s</b></#>", str);
+    else
+        snprintf(tmpbuf, 255, "<#selectbg_g><b>\n</b></#>");
+
+    pthread_mutex_lock(&ch->lock);
+    if (!ch->pending_text.empty()) ch->pending_text += '\n';
+    ch->pending_text += tmpbuf;
+    pthread_mutex_unlock(&ch->lock);
+}
+
+// Handle one command from the text protocol (see try_update_binary).
+static void handle_text_command(UpdaterChannel* ch, char* buffer) {
+    char* command = strtok(buffer, " \n");
+    if (command == NULL) {
+        return;
+    } else if (strcmp(command, "assert") == 0) {
+        if (ch->currstatus) {
+            char *ignore_device_info = strtok(NULL, " \n");
+            if (skip_check_device_info(ignore_device_info))
+                return;
+            char *ignore_device_info_part_two = strtok(NULL, "||");
+            if (skip_check_device_info(ignore_device_info_part_two))
+                return;
+        } else {
+            printf("assert command checking \n");
+        }
+    } else if (strcmp(command, "progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        char* seconds_s = strtok(NULL, " \n");
+
+        float fraction = strtof(fraction_s, NULL);
+        int seconds = strtol(seconds_s, NULL, 10);
+
+        ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                         seconds);
+    } else if (strcmp(command, "set_progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        float fraction = strtof(fraction_s, NULL);
+        ui_set_progress(fraction);
+    } else if (strcmp(command, "firmware") == 0) {
+        char* type = strtok(NULL, " \n");
+        char* filename = strtok(NULL, " \n");
+
+        if (type != NULL && filename != NULL) {
+            if (ch->firmware_type != NULL) {
+                LOGE("ignoring attempt to do multiple firmware updates");
+            } else {
+                ch->firmware_type = strdup(type);
+                ch->firmware_filename = strdup(filename);
+            }
+        }
+    } else if (strcmp(command, "ui_print") == 0) {
+        char* str = strtok(NULL, "\n");
+        queue_ui_text(ch, str);
+    } else if (strcmp(command, "wipe_cache") == 0) {
+        // *wipe_cache = 1;
+    } else if (strcmp(command, "minzip:") == 0) {
+        char* str = strtok(NULL, "\n");
+        miuiInstall_set_info(str);
+    } else {
+        char * str = strtok(NULL, "\n");
+        if (str)
+            LOGD("[%s]:%s\n",command, str);
+    }
+}
+
+// Handle one message from the binary protocol (see cmd_protocol.h).
+// payload is NUL-terminated.
+static void handle_message(UpdaterChannel* ch, const CmdMsgHeader* header,
+                           char* payload) {
+    switch (header->type) {
+        case CMD_MSG_UI_PRINT:
+            queue_ui_text(ch, header->payload_len > 0 ? payload : NULL);
+            break;
+
+        case CMD_MSG_PROGRESS:
+        case CMD_MSG_SET_PROGRESS: {
+            CmdMsgProgress p;
+            if (header->payload_len < sizeof(p)) break;
+            memcpy(&p, payload, sizeof(p));
+            float fraction = p.fraction_ppm / 1000000.0f;
+            if (header->type == CMD_MSG_PROGRESS) {
+                ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                                 p.seconds);
+            } else {
+                ui_set_progress(fraction);
+            }
+            break;
+        }
+
+        case CMD_MSG_BYTES:
+            if (ch->last_bytes_us != 0 && header->timestamp_us > ch->last_bytes_us) {
+                double mb = (header->bytes_done - ch->last_bytes) / (1024.0 * 1024.0);
+                double secs = (header->timestamp_us - ch->last_bytes_us) / 1e6;
+                char rate[32];
+                snprintf(rate, sizeof(rate), "%.1f MB/s", mb / secs);
+                miuiInstall_set_info(rate);
+            }
+            ch->last_bytes = header->bytes_done;
+            ch->last_bytes_us = header->timestamp_us;
+            break;
+
+        case CMD_MSG_COMMAND:
+            handle_text_command(ch, payload);
+            break;
+
+        default:
+            LOGD("ignoring updater message type %d\n", header->type);
+            break;
+    }
+}
+
+// Read commands from the update binary until it closes the pipe.  Both
+// text lines and binary messages are accepted; see try_update_binary()
+// and cmd_protocol.h.
+static void* read_updater_commands(void* cookie) {
+    UpdaterChannel* ch = (UpdaterChannel*) cookie;
+    char buffer[sizeof(CmdMsgHeader) + CMD_MSG_MAX_PAYLOAD + 1];
+    size_t len = 0;
+    bool eof = false;
+
+    while (!eof || len > 0) {
+        // Try to take one complete command off the front of the buffer.
+        size_t used = 0;
+        if (len > 0 && (unsigned char) buffer[0] == CMD_MSG_MAGIC) {
+            CmdMsgHeader header;
+            if (len >= sizeof(header)) {
+                memcpy(&header, buffer, sizeof(header));
+                if (header.version != CMD_PROTOCOL_VERSION ||
+                    header.payload_len > CMD_MSG_MAX_PAYLOAD) {
+                    LOGE("bad message from update binary\n");
+                    ch->bad_message = true;
+                    break;
+                }
+                if (len >= sizeof(header) + header.payload_len) {
+                    char payload[CMD_MSG_MAX_PAYLOAD + 1];
+                    memcpy(payload, buffer + sizeof(header), header.payload_len);
+                    payload[header.payload_len] = '\0';
+                    handle_message(ch, &header, payload);
+                    used = sizeof(header) + header.payload_len;
+                }
+            }
+            if (used == 0 && eof) break;    // truncated message
+        } else if (len > 0) {
+            char* newline = (char*) memchr(buffer, '\n', len);
+            if (newline != NULL || eof || len == sizeof(buffer) - 1) {
+                used = newline != NULL ? (size_t)(newline - buffer) + 1 : len;
+                char line[sizeof(buffer)];
+                memcpy(line, buffer, used);
+                line[used] = '\0';
+                handle_text_command(ch, line);
+            }
+        }
+
+        if (used > 0) {
+            len -= used;
+            memmove(buffer, buffer + used, len);
+            continue;
+        }
+
+        ssize_t n = read(ch->fd, buffer + len, sizeof(buffer) - 1 - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) eof = true;
+        else len += n;
+    }
+
+    // Keep the pipe drained so the update binary can't block on it and
+    // leave try_update_binary() stuck in waitpid().
+    if (ch->bad_message) {
+        ssize_t n;
+        while ((n = read(ch->fd, buffer, sizeof(buffer))) > 0 ||
+               (n < 0 && errno == EINTR)) {
+        }
+    }
+
+    pthread_mutex_lock(&ch->lock);
+    ch->done = true;
+    pthread_cond_signal(&ch->cond);
+    pthread_mutex_unlock(&ch->lock);
+    return NULL;
+}
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+// Returns an anonymous in-memory file to hold the update binary, or -1
+// if the kernel doesn't support memfd_create().  The fd is close-on-exec;
+// exec of /proc/self/fd/N still works for ELF binaries, and nothing else
+// inherits it.  Scripts can't be run this way (see is_script_fd()).
+static int create_updater_memfd() {
+#ifdef __NR_memfd_create
+    int fd = syscall(__NR_memfd_create, "updater", MFD_CLOEXEC);
+    if (fd < 0) {
+        LOGI("memfd_create failed (%s)\n", strerror(errno));
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+// Returns true if the file behind fd starts with "#!".  The kernel hands
+// a script's path to its interpreter after the close-on-exec memfd is
+// already gone, so those binaries have to run from /tmp instead.
+static bool is_script_fd(int fd) {
+    char magic[2];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           magic[0] == '#' && magic[1] == '!';
+}
+
+// Turn a legacy /sdcard-style path into the real one by resolving the
+// symlink at its first component.  Requires: symlink uses absolute path.
+static void resolve_package_path(const char* path, char* resolved) {
+    strlcpy(resolved, path, PATH_MAX);
+    if (strlen(path) > 1) {
+        const char *rest = strchr(path + 1, '/');
+        if (rest != NULL) {
+            char new_path[PATH_MAX];
+            int readlink_length;
+            int root_length = rest - path;
+            char *root = (char*)malloc(root_length + 1);
+            strncpy(root, path, root_length);
+            root[root_length] = 0;
+            readlink_length = readlink(root, new_path, PATH_MAX);
+            if (readlink_length > 0) {
+                strncpy(new_path + readlink_length, rest, PATH_MAX - readlink_length);
+                strlcpy(resolved, new_path, PATH_MAX);
+            }
+            free(root);
+        }
+    }
+}
+
+// Read the signature settings from settings.ini.  Returns false if it
+// can't be loaded.
+static bool load_verify_settings(bool* check_signature) {
+    if (1==load_cotsettings()) {
+        return false;
+    }
+    *check_signature = iniparser_getboolean(ini_install, "dev:signaturecheck", -1) == 1;
+    iniparser_freedict(ini_install);
+    return true;
+}
+
+// While one package of a queue is installing, the next one is checked
+// against the keys, opened and has its update binary inflated into a
+// memfd on a background thread (see install_package_queue()).  Only the
+// work is done early: when its turn comes the package still goes through
+// really_install_package(), whose signature check is then answered from
+// the verification cache.
+typedef struct {
+    char path[PATH_MAX];        // resolved path
+    bool check_signature;
+    bool running;
+    pthread_t thread;
+
+    // Filled in by the staging thread; only valid once it's been joined.
+    ZipArchive zip;
+    bool zip_open;
+    struct stat st;             // the file the zip was opened from
+    int binary_fd;              // inflated update binary, or -1
+} StagedPackage;
+
+static void init_staged_package(StagedPackage* s, const char* path) {
+    strlcpy(s->path, path, PATH_MAX);
+    s->check_signature = false;
+    s->running = false;
+    s->zip_open = false;
+    s->binary_fd = -1;
+}
+
+static void* stage_package_thread(void* cookie) {
+    StagedPackage* s = (StagedPackage*) cookie;
+
+    if (s->check_signature) {
+        int num_keys;
+        Certificate* keys = load_keys(PUBLIC_KEYS_FILE, &num_keys);
+        int status = VERIFY_FAILURE;
+        if (keys != NULL) {
+            status = verify_file_cached_quiet(s->path, keys, num_keys);
+            free(keys);
+        }
+        if (status != VERIFY_SUCCESS) {
+            // Leave it to really_install_package() to report.
+            LOGW("%s failed verification; not staging it\n", s->path);
+            return NULL;
+        }
+    }
+
+    if (mzOpenZipArchiveLazy(s->path, &s->zip) != 0) {
+        return NULL;
+    }
+    if (fstat(s->zip.fd, &s->st) != 0) {
+        mzCloseZipArchive(&s->zip);
+        return NULL;
+    }
+    s->zip_open = true;
+
+    const ZipEntry* binary_entry =
+            mzFindZipEntry(&s->zip, ASSUMED_UPDATE_BINARY_NAME);
+    if (binary_entry != NULL) {
+        s->binary_fd = create_updater_memfd();
+        if (s->binary_fd >= 0 &&
+            !mzExtractZipEntryToFile(&s->zip, binary_entry, s->binary_fd)) {
+            close(s->binary_fd);
+            s->binary_fd = -1;
+        }
+    }
+    LOGI("staged %s (update binary %s)\n", s->path,
+         s->binary_fd >= 0 ? "ready" : "not staged");
+    return NULL;
+}
+
+// Start staging s in the background.  Called once the previous package's
+// update binary is running.  Packages on /data or /cache are left alone:
+// holding them open would keep the running script from formatting the
+// volume they live on.
+static void start_staging(StagedPackage* s) {
+    if (s == NULL) return;
+
+    char resolved[PATH_MAX];
+    resolve_package_path(s->path, resolved);
+    strlcpy(s->path, resolved, PATH_MAX);
+
+    Volume_* v = volume_for_path(s->path);
+    if (v == NULL || strcmp(v->mount_point, "/data") == 0 ||
+        strcmp(v->mount_point, "/cache") == 0 ||
+        is_data_media_volume_path(s->path)) {
+        LOGI("not staging %s\n", s->path);
+        return;
+    }
+    if (ensure_path_mounted(s->path) != 0 ||
+        !load_verify_settings(&s->check_signature)) {
+        return;
+    }
+    s->running = pthread_create(&s->thread, NULL, stage_package_thread, s) == 0;
+}
+
+// Wait for the staging thread, if any.  Safe to call more than once.
+static void finish_staging(StagedPackage* s) {
+    if (s->running) {
+        pthread_join(s->thread, NULL);
+        s->running = false;
+    }
+}
+
+// Drop whatever staging produced that hasn't been used.
+static void discard_staged_package(StagedPackage* s) {
+    finish_staging(s);
+    if (s->zip_open) {
+        mzCloseZipArchive(&s->zip);
+        s->zip_open = false;
+    }
+    if (s->binary_fd >= 0) {
+        close(s->binary_fd);
+        s->binary_fd = -1;
+    }
+}
+
+// Hand the staged archive and update binary for path over to the caller,
+// provided the file hasn't been replaced or modified since it was staged.
+static bool take_staged_package(StagedPackage* s, const char* path,
+                                ZipArchive* zip, int* binary_fd) {
+    if (s == NULL) return false;
+    finish_staging(s);
+
+    struct stat st;
+    if (!s->zip_open || strcmp(s->path, path) != 0 || stat(path, &st) != 0 ||
+        st.st_dev != s->st.st_dev || st.st_ino != s->st.st_ino ||
+        st.st_size != s->st.st_size || st.st_mtime != s->st.st_mtime) {
+        discard_staged_package(s);
+        return false;
+    }
+    *zip = s->zip;
+    *binary_fd = s->binary_fd;
+    s->zip_open = false;
+    s->binary_fd = -1;
+    LOGI("using staged %s\n", path);
+    return true;
+}
+
 // If the package contains an update binary, extract it and run it.
-static int try_update_binary(const char *path, ZipArchive *zip) {
+// If verify is non-NULL, the binary isn't run until it has passed.
+// staged_binary_fd, if not -1, already holds the update binary.  Once the
+// binary is running, the next package in the queue (if any) is staged.
+static int try_update_binary(const char *path, ZipArchive *zip,
+                             PendingVerify *verify, int staged_binary_fd,
+                             StagedPackage *next) {
     const ZipEntry* binary_entry =
             mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
     struct stat st;
@@ -147,51 +605,93 @@ static int try_update_binary(const char *path, ZipArchive *zip) {
         }
 
         mzCloseZipArchive(zip);
+        if (staged_binary_fd >= 0) close(staged_binary_fd);
         return INSTALL_UPDATE_BINARY_MISSING;
     }
 
-    string binary_str = "/tmp/updater";
-    unlink(binary_str.c_str());
-   
-   int fd;
-  if (0 > ( fd = open(binary_str.c_str(), (O_CREAT|O_WRONLY|O_TRUNC), 0755))) {
-		   printf("create /tmp/updater error (%s)\n", strerror(errno));
-  }
-
-
-	   
-    if (fd < 0) {
-        mzCloseZipArchive(zip);
-        LOGE("Can't make %s\n", binary_str.c_str());
-        return 1;
+    // Inflate the binary into an anonymous memfd and run it from there,
+    // so nothing is written to (and read back from) /tmp and back-to-back
+    // installs can't race on the same file.  /tmp/updater is only used
+    // if the kernel has no memfd support or the binary is a script.
+    string binary_str;
+    int binary_fd = staged_binary_fd;
+    if (binary_fd < 0) {
+        binary_fd = create_updater_memfd();
+        if (binary_fd >= 0 &&
+            !mzExtractZipEntryToFile(zip, binary_entry, binary_fd)) {
+            LOGW("Can't copy %s to memfd; trying /tmp\n", ASSUMED_UPDATE_BINARY_NAME);
+            close(binary_fd);
+            binary_fd = -1;
+        }
+    }
+    if (binary_fd >= 0 && is_script_fd(binary_fd)) {
+        LOGI("%s is a script; running it from /tmp\n", ASSUMED_UPDATE_BINARY_NAME);
+        close(binary_fd);
+        binary_fd = -1;
+    }
+    if (binary_fd >= 0) {
+        // The memfd is run through /proc, which might not be mounted.
+        char fd_path[32];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", binary_fd);
+        if (access(fd_path, X_OK) == 0) {
+            binary_str = fd_path;
+        } else {
+            LOGW("Can't run %s (%s); trying /tmp\n", fd_path, strerror(errno));
+            close(binary_fd);
+            binary_fd = -1;
+        }
     }
 
+    if (binary_fd < 0) {
+        binary_str = "/tmp/updater";
+        unlink(binary_str.c_str());
 
-    bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
+        int fd = open(binary_str.c_str(), (O_CREAT|O_WRONLY|O_TRUNC), 0755);
+        if (fd < 0) {
+            printf("create /tmp/updater error (%s)\n", strerror(errno));
+            mzCloseZipArchive(zip);
+            LOGE("Can't make %s\n", binary_str.c_str());
+            return 1;
+        }
 
-    close(fd);
-    mzCloseZipArchive(zip);
+        bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
+        close(fd);
 
-    if (!ok) {
-        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
-	mzCloseZipArchive(zip);
-        return 1;
+        if (!ok) {
+            LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
+            mzCloseZipArchive(zip);
+            return 1;
+        }
     }
+    LOGI("package index used %zu bytes\n", mzZipArchiveMemoryUsage(zip));
+    mzCloseZipArchive(zip);
 
 
  
     int currstatus;
     if (1==load_cotsettings()) {
+        if (binary_fd >= 0) close(binary_fd);
         return INSTALL_CORRUPT;
     }
     
     currstatus = iniparser_getboolean(ini_install, "zipflash:CDI", -1);
+    bool profile_script = iniparser_getboolean(ini_install, "dev:scriptprofile", -1) == 1;
     iniparser_freedict(ini_install);
 
 
        
 
 
+    if (verify != NULL && finish_verification(verify) != VERIFY_SUCCESS) {
+        LOGE("signature verification failed\n");
+        if (binary_fd >= 0) {
+            close(binary_fd);
+        } else {
+            unlink(binary_str.c_str());
+        }
+        return INSTALL_CORRUPT;
+    }
+
     int pipefd[2];
     pipe(pipefd);
     char tmpbuf[256];
@@ -227,8 +727,17 @@ static int try_update_binary(const char *path, ZipArchive *zip) {
     //        ui_print <string>
     //            display <string> on the screen.
     //
+    //     Update binaries that find CMD_PROTOCOL_ENV in their environment
+    //     may instead send the binary messages described in
+    //     updater/cmd_protocol.h, which also carry timestamps and a count
+    //     of the bytes written so far.
+    //
     //   - the name of the package zip file.
     //
+    // If UPDATER_PROFILE_ENV is set, the update binary also writes a
+    // timing profile of the script to UPDATER_PROFILE_FILE, which is
+    // appended to last_install.
+    //
 
     const char** args = ( const char**)malloc(sizeof(char*) * 5);
     args[0] = binary_str.c_str();
@@ -243,6 +752,10 @@ static int try_update_binary(const char *path, ZipArchive *zip) {
     pid_t pid = fork();
     if (pid == 0) {
 	setenv("UPDATE_PACKAGE", path, 1);
+        setenv(CMD_PROTOCOL_ENV, EXPAND(CMD_PROTOCOL_VERSION), 1);
+        if (profile_script) {
+            setenv(UPDATER_PROFILE_ENV, UPDATER_PROFILE_FILE, 1);
+        }
         close(pipefd[0]);
         execv(binary_str.c_str(),(char* const *) args);
         fprintf(stdout, "E:Can't run %s (%s)\n", binary_str.c_str(), strerror(errno));
@@ -250,83 +763,66 @@ static int try_update_binary(const char *path, ZipArchive *zip) {
         _exit(-1);
     }
     close(pipefd[1]);
-    
-    char *firmware_type = NULL;
-    char *firmware_filename = NULL;
+    if (binary_fd >= 0) close(binary_fd);
 
-    char buffer[1024];
+    // The update binary is mostly waiting on flash writes from here on;
+    // use the time to get the next package ready.
+    start_staging(next);
+    
+    UpdaterChannel channel;
+    channel.fd = pipefd[0];
+    channel.currstatus = currstatus;
+    channel.firmware_type = NULL;
+    channel.firmware_filename = NULL;
+    channel.done = false;
+    channel.bad_message = false;
+    channel.last_bytes = 0;
+    channel.last_bytes_us = 0;
+    pthread_mutex_init(&channel.lock, NULL);
+    pthread_cond_init(&channel.cond, NULL);
+
+    // The reader thread drains the pipe as fast as the update binary
+    // writes to it; this thread puts whatever text has piled up on the
+    // screen about once per frame.
+    pthread_t reader;
+    bool have_reader =
+        pthread_create(&reader, NULL, read_updater_commands, &channel) == 0;
+    if (!have_reader) {
+        read_updater_commands(&channel);
+    }
 
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-         } else if (strcmp(command, "assert") == 0) {
-		 if (currstatus) {
-                char *ignore_device_info = strtok(NULL, " \n");
-                if (skip_check_device_info(ignore_device_info)) 
-                        continue;
-                char *ignore_device_info_part_two = strtok(NULL, "||");
-                if (skip_check_device_info(ignore_device_info_part_two))
-                        continue;     
-		 } else {
-		 printf("assert command checking \n");
-		 }	 
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
-
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
-
-            ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
-                             seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui_set_progress(fraction);
-	} else if (strcmp(command, "firmware") == 0) {
-            char* type = strtok(NULL, " \n");
-            char* filename = strtok(NULL, " \n");
-
-            if (type != NULL && filename != NULL) {
-                if (firmware_type != NULL) {
-                    LOGE("ignoring attempt to do multiple firmware updates");
-                } else {
-                    firmware_type = strdup(type);
-                    firmware_filename = strdup(filename);
-                }
+    pthread_mutex_lock(&channel.lock);
+    for (;;) {
+        if (!channel.done) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += UI_TEXT_FLUSH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
             }
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str)
-                snprintf(tmpbuf, 255, "<#selectbg_g><b>%s</b></#>", str);
-            else 
-                snprintf(tmpbuf, 255, "<#selectbg_g><b>\n</b></#>");
-            miuiInstall_set_text(tmpbuf);
-        } else if (strcmp(command, "wipe_cache") == 0) {
-           // *wipe_cache = 1;
-        } else if (strcmp(command, "minzip:") == 0) {
-            char* str = strtok(NULL, "\n");
-            miuiInstall_set_info(str);
-        } 
-        else {
-#if 0 
-            snprintf(tmpbuf, 255, "%s", command);
-	        miuiInstall_set_text(tmpbuf);
-            char* str = strtok(NULL, "\n");
-            if (str)
-            {
-                snprintf(tmpbuf, 255, "%s", str);
-                miuiInstall_set_text(tmpbuf);
-            }
-#endif
-            char * str = strtok(NULL, "\n");
-            if (str)
-                LOGD("[%s]:%s\n",command, str);
+            pthread_cond_timedwait(&channel.cond, &channel.lock, &deadline);
         }
+        bool done = channel.done;
+        string text;
+        text.swap(channel.pending_text);
+        pthread_mutex_unlock(&channel.lock);
+
+        if (!text.empty()) {
+            miuiInstall_set_text((char*) text.c_str());
+        }
+        if (done) break;
+        pthread_mutex_lock(&channel.lock);
+    }
+    if (have_reader) {
+        pthread_join(reader, NULL);
     }
-    fclose(from_child);
+    pthread_mutex_destroy(&channel.lock);
+    pthread_cond_destroy(&channel.cond);
+    close(pipefd[0]);
+
+    char *firmware_type = channel.firmware_type;
+    char *firmware_filename = channel.firmware_filename;
     
 
     int status;
@@ -339,6 +835,11 @@ static int try_update_binary(const char *path, ZipArchive *zip) {
         miuiInstall_set_text(tmpbuf);
         return INSTALL_ERROR;
     }
+    if (channel.bad_message) {
+        LOGE("Error in %s\n(garbled messages from update binary)\n", path);
+        mzCloseZipArchive(zip);
+        return INSTALL_ERROR;
+    }
 
 
     if (firmware_type != NULL) {
@@ -353,7 +854,8 @@ static int try_update_binary(const char *path, ZipArchive *zip) {
 
 
 
-static int really_install_package(const char *path)
+static int really_install_package(const char *path, StagedPackage *staged,
+                                  StagedPackage *next)
 
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
@@ -361,24 +863,9 @@ static int really_install_package(const char *path)
     ui_show_indeterminate_progress();
 
      // Resolve symlink in case legacy /sdcard path is used
-    // Requires: symlink uses absolute path
     char new_path[PATH_MAX];
-    if (strlen(path) > 1) {
-        char *rest = strchr(path + 1, '/');
-        if (rest != NULL) {
-            int readlink_length;
-            int root_length = rest - path;
-            char *root = (char*)malloc(root_length + 1);
-            strncpy(root, path, root_length);
-            root[root_length] = 0;
-            readlink_length = readlink(root, new_path, PATH_MAX);
-            if (readlink_length > 0) {
-                strncpy(new_path + readlink_length, rest, PATH_MAX - readlink_length);
-                path = new_path;
-            }
-            free(root);
-        }
-    }
+    resolve_package_path(path, new_path);
+    path = new_path;
 
     LOGI("Update location: %s\n", path);
 
@@ -391,17 +878,16 @@ static int really_install_package(const char *path)
 
 
  // check the signature 
-     int currstatus;
-    if (1==load_cotsettings()) {
+    bool check_signature;
+    if (!load_verify_settings(&check_signature)) {
         return INSTALL_CORRUPT;
     }
-    
-    currstatus = iniparser_getboolean(ini_install, "dev:signaturecheck", -1);
-    iniparser_freedict(ini_install);
 
      int err = 0;	     
 
-    if (currstatus == 1) {
+    PendingVerify verify;
+    PendingVerify* pending = NULL;
+    if (check_signature) {
 
         int numKeys;
         Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
@@ -417,38 +903,48 @@ static int really_install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
-        free(loadedKeys);
-        LOGI("verify_file returned %d\n", err);
-        if (err != VERIFY_SUCCESS) {
-            LOGE("signature verification failed\n");
-                return INSTALL_CORRUPT;
-        }
+        verify.path = path;
+        verify.keys = loadedKeys;
+        verify.num_keys = numKeys;
+        pending = &verify;
+        start_verification(pending);
     }
   
 
-    /* Try to open the package.
+    /* Try to open the package, unless it was staged while the previous
+     * package in the queue was installing.
      */
  
     ZipArchive zip;
-     err = 0;
-    err = mzOpenZipArchive(path, &zip);
-    if (err != 0) {
-        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
-        return INSTALL_CORRUPT;
+    int staged_binary_fd = -1;
+    if (!take_staged_package(staged, path, &zip, &staged_binary_fd)) {
+        // Only a couple of entries are looked up here, so don't index
+        // the whole package.
+        err = mzOpenZipArchiveLazy(path, &zip);
+        if (err != 0) {
+            LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+            if (pending) finish_verification(pending);
+            return INSTALL_CORRUPT;
+        }
     }
 
     /* Verify and install the contents of the package.
      */
     ui_print("Installing update...\n");
 
-    return try_update_binary(path, &zip);
+    int result = try_update_binary(path, &zip, pending, staged_binary_fd, next);
+    if (pending) finish_verification(pending);
+    return result;
 
 }
 
-int
-install_package(const char* path)
+static int
+install_staged_package(const char* path, StagedPackage* staged,
+                       StagedPackage* next)
 {
+    // Don't let a previous package's profile end up in this one's log.
+    unlink(UPDATER_PROFILE_FILE);
+
     FILE* install_log = fopen_path(LAST_INSTALL_FILE, "w");
     if (install_log) {
         fputs(path, install_log);
@@ -456,16 +952,86 @@ install_package(const char* path)
     } else {
         LOGE("failed to open last_install: %s\n", strerror(errno));
     }
-    int result = really_install_package(path);
+    int result = really_install_package(path, staged, next);
     if (install_log) {
         fputc(result == INSTALL_SUCCESS ? '1' : '0', install_log);
         fputc('\n', install_log);
+        FILE* profile = fopen(UPDATER_PROFILE_FILE, "r");
+        if (profile) {
+            char buf[1024];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), profile)) > 0) {
+                fwrite(buf, 1, n, install_log);
+            }
+            fclose(profile);
+        }
         fclose(install_log);
 	chmod(LAST_INSTALL_FILE, 0644);
     }
     return result;
 }
 
+int
+install_package(const char* path)
+{
+    return install_staged_package(path, NULL, NULL);
+}
+
+int
+install_package_queue(const char* const* paths, int count)
+{
+    // Two slots: the package being installed and the one being staged.
+    StagedPackage slots[2];
+    char tmpbuf[256];
+    int result = count > 0 ? INSTALL_SUCCESS : INSTALL_ERROR;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        StagedPackage* current = i > 0 ? &slots[i % 2] : NULL;
+        StagedPackage* next = NULL;
+        if (i + 1 < count) {
+            next = &slots[(i + 1) % 2];
+            init_staged_package(next, paths[i + 1]);
+        }
+
+        snprintf(tmpbuf, 255, "<#selectbg_g><b>Package %d of %d: %s\n</b></#>",
+                 i + 1, count, paths[i]);
+        miuiInstall_set_text(tmpbuf);
+        result = install_staged_package(paths[i], current, next);
+
+        if (current) discard_staged_package(current);
+        if (next) finish_staging(next);
+        if (result != INSTALL_SUCCESS) {
+            if (next) discard_staged_package(next);
+            if (i + 1 < count) {
+                LOGE("Skipping the remaining %d package(s)\n", count - i - 1);
+            }
+            break;
+        }
+    }
+    return result;
+}
+
+int
+install_package_list(const char* path_list)
+{
+    char* list = strdup(path_list);
+    int count = 0;
+    const char** paths = (const char**) malloc(sizeof(char*) * (strlen(list) + 1));
+    char* save;
+    char* path;
+
+    for (path = strtok_r(list, "\n", &save); path != NULL;
+         path = strtok_r(NULL, "\n", &save)) {
+        paths[count++] = path;
+    }
+    int result = count == 1 ? install_package(paths[0])
+                            : install_package_queue(paths, count);
+    free(paths);
+    free(list);
+    return result;
+}
+
 /*
  * This func is for check the device info
  * @ignore_device_info is the parse from strtok(NULL, " \n");
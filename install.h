@@ -24,6 +24,15 @@ extern "C" {
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT, INSTALL_UPDATE_SCRIPT_MISSING, INSTALL_UPDATE_BINARY_MISSING };
 int install_package(const char *root_path);
 
+// Install the packages one after another, stopping at the first one
+// that fails.  While a package installs, the next one is verified and
+// opened in the background.
+int install_package_queue(const char* const* paths, int count);
+
+// Same, for a newline-separated list of paths (what the installer screen
+// and ORS scripts pass around).  A single path is just install_package().
+int install_package_list(const char* path_list);
+
 
 #ifdef __cplusplus
 }
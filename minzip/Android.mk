@@ -14,8 +14,30 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_STATIC_LIBRARIES := libselinux
 
+# Set MINZIP_INFLATE_BACKEND := libdeflate in BoardConfig.mk to inflate
+# whole entries with libdeflate instead of zlib.
+ifeq ($(MINZIP_INFLATE_BACKEND),libdeflate)
+LOCAL_CFLAGS += -DMINZIP_USE_LIBDEFLATE
+LOCAL_C_INCLUDES += external/libdeflate
+LOCAL_WHOLE_STATIC_LIBRARIES += libdeflate
+endif
+
 LOCAL_MODULE := libminzip
 
 LOCAL_CFLAGS += -Wall
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := inflate_bench.c
+
+LOCAL_C_INCLUDES := external/zlib
+
+LOCAL_MODULE := minzip_inflate_bench
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libminzip libselinux libz
+LOCAL_SHARED_LIBRARIES := libc
+
+include $(BUILD_EXECUTABLE)
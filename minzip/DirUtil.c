@@ -22,7 +22,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "DirUtil.h"
 
@@ -235,60 +237,519 @@ dirUnlinkHierarchy(const char *path)
     return rmdir(path);
 }
 
+/*
+ * State shared by the threads of one dirSetHierarchyPermissions() walk.
+ * Directories waiting to be read are kept on a FIFO of path names; the
+ * entries inside a directory are handled relative to its fd.
+ */
+typedef struct PermWork {
+    struct PermWork *next;
+    char path[1];
+} PermWork;
+
+typedef struct {
+    int uid, gid, dirMode, fileMode;
+    DirPermissionsErrorFunction onError;
+    void *cookie;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    PermWork *head, *tail;
+    int active;             /* directories being read right now */
+    int firstErrno;         /* 0 until something fails */
+} PermWalk;
+
+#define PERM_WALK_MAX_THREADS 4
+
+static void
+permReportError(PermWalk *w, const char *dir, const char *name,
+        const char *op, int err)
+{
+    char path[PATH_MAX];
+    if (name != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        dir = path;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (w->firstErrno == 0) {
+        w->firstErrno = err ? err : EIO;
+    }
+    /* Called with the lock held so the callback need not be thread-safe. */
+    if (w->onError != NULL) {
+        w->onError(dir, op, err, w->cookie);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static bool
+permQueueDir(PermWalk *w, const char *dir, const char *name)
+{
+    size_t dirLen = strlen(dir);
+    size_t nameLen = (name != NULL) ? strlen(name) : 0;
+    PermWork *work = malloc(sizeof(PermWork) + dirLen + nameLen + 1);
+    if (work == NULL) {
+        return false;
+    }
+    memcpy(work->path, dir, dirLen);
+    if (name != NULL) {
+        work->path[dirLen++] = '/';
+        memcpy(work->path + dirLen, name, nameLen);
+    }
+    work->path[dirLen + nameLen] = '\0';
+    work->next = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail != NULL) {
+        w->tail->next = work;
+    } else {
+        w->head = work;
+    }
+    w->tail = work;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return true;
+}
+
+/* Chown and chmod everything directly inside one directory, and queue
+ * its subdirectories.  The directory itself has already been done.
+ */
+static void
+permWalkDir(PermWalk *w, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        permReportError(w, path, NULL, "open", errno);
+        return;
+    }
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        permReportError(w, path, NULL, "opendir", errno);
+        close(fd);
+        return;
+    }
+
+    const struct dirent *de;
+    for (;;) {
+        errno = 0;
+        if ((de = readdir(dir)) == NULL) {
+            if (errno != 0) {
+                permReportError(w, path, NULL, "readdir", errno);
+            }
+            break;
+        }
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+
+        unsigned char type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+                permReportError(w, path, de->d_name, "lstat", errno);
+                continue;
+            }
+            type = S_ISLNK(st.st_mode) ? DT_LNK :
+                   S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+
+        /* ignore symlinks */
+        if (type == DT_LNK) {
+            continue;
+        }
+
+        /* directories and files get different permissions */
+        int mode = (type == DT_DIR) ? w->dirMode : w->fileMode;
+        if (fchownat(fd, de->d_name, w->uid, w->gid, AT_SYMLINK_NOFOLLOW)) {
+            permReportError(w, path, de->d_name, "chown", errno);
+            continue;
+        }
+        if (fchmodat(fd, de->d_name, mode, 0)) {
+            permReportError(w, path, de->d_name, "chmod", errno);
+            continue;
+        }
+
+        if (type == DT_DIR && !permQueueDir(w, path, de->d_name)) {
+            permReportError(w, path, de->d_name, "queue", ENOMEM);
+        }
+    }
+
+    closedir(dir);
+}
+
+static void *
+permWalkThread(void *arg)
+{
+    PermWalk *w = (PermWalk *)arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->head == NULL && w->active > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        PermWork *work = w->head;
+        if (work == NULL) {
+            /* Nothing queued and nobody left to queue more: done. */
+            break;
+        }
+        w->head = work->next;
+        if (w->head == NULL) {
+            w->tail = NULL;
+        }
+        w->active++;
+        pthread_mutex_unlock(&w->lock);
+
+        permWalkDir(w, work->path);
+        free(work);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->active == 0 && w->head == NULL) {
+            pthread_cond_broadcast(&w->cond);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
 int
-dirSetHierarchyPermissions(const char *path,
-        int uid, int gid, int dirMode, int fileMode)
+dirSetHierarchyPermissionsWithCallback(const char *path,
+        int uid, int gid, int dirMode, int fileMode,
+        DirPermissionsErrorFunction onError, void *cookie)
 {
+    PermWalk w;
+    memset(&w, 0, sizeof(w));
+    w.uid = uid;
+    w.gid = gid;
+    w.dirMode = dirMode;
+    w.fileMode = fileMode;
+    w.onError = onError;
+    w.cookie = cookie;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+
     struct stat st;
     if (lstat(path, &st)) {
-        return -1;
+        permReportError(&w, path, NULL, "lstat", errno);
+        goto done;
     }
 
     /* ignore symlinks */
     if (S_ISLNK(st.st_mode)) {
-        return 0;
+        goto done;
     }
 
     /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    if (chown(path, uid, gid)) {
+        permReportError(&w, path, NULL, "chown", errno);
+        goto done;
+    }
+    if (chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+        permReportError(&w, path, NULL, "chmod", errno);
+        goto done;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        goto done;
+    }
+    if (!permQueueDir(&w, path, NULL)) {
+        permReportError(&w, path, NULL, "queue", ENOMEM);
+        goto done;
+    }
+
+    /* Subdirectories are spread over a few threads; this one helps too.
+     * A thread that can't be started just leaves more work for the rest.
+     */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (cpus > PERM_WALK_MAX_THREADS) ? PERM_WALK_MAX_THREADS :
+                   (cpus > 1) ? (int)cpus : 1;
+    pthread_t threads[PERM_WALK_MAX_THREADS];
+    int started = 0;
+    while (started < nthreads - 1 &&
+           pthread_create(&threads[started], NULL, permWalkThread, &w) == 0) {
+        started++;
+    }
+    permWalkThread(&w);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+
+done:
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    if (w.firstErrno != 0) {
+        errno = w.firstErrno;
         return -1;
     }
+    return 0;
+}
 
-    /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
-            return -1;
+int
+dirSetHierarchyPermissions(const char *path,
+        int uid, int gid, int dirMode, int fileMode)
+{
+    return dirSetHierarchyPermissionsWithCallback(path, uid, gid,
+            dirMode, fileMode, NULL, NULL);
+}
+
+/*
+ * State shared by the threads of one dirUnlinkChildren() walk.  Each
+ * directory is a work item that stays allocated until everything in it
+ * is gone; 'pending' counts its subdirectories that still exist, plus
+ * one while the directory itself is being read.  Whoever drops it to
+ * zero removes the directory and then releases the parent the same way.
+ */
+typedef struct UnlinkWork {
+    struct UnlinkWork *next;
+    struct UnlinkWork *parent;
+    int pending;
+    char path[1];
+} UnlinkWork;
+
+typedef struct {
+    const char * const *keep;
+    UnlinkWork *root;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UnlinkWork *head, *tail;
+    int active;             /* directories being read right now */
+    int firstErrno;         /* 0 until something fails */
+} UnlinkWalk;
+
+/* Unlinking mostly waits on the filesystem rather than the CPU, so use
+ * the same few threads even on a single core.
+ */
+#define UNLINK_WALK_THREADS 4
+
+static void
+unlinkReportError(UnlinkWalk *w, int err)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->firstErrno == 0) {
+        w->firstErrno = err ? err : EIO;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static bool
+unlinkQueueDir(UnlinkWalk *w, UnlinkWork *parent, const char *name)
+{
+    size_t dirLen = strlen(parent->path);
+    size_t nameLen = strlen(name);
+    UnlinkWork *work = malloc(sizeof(UnlinkWork) + dirLen + nameLen + 1);
+    if (work == NULL) {
+        return false;
+    }
+    memcpy(work->path, parent->path, dirLen);
+    work->path[dirLen++] = '/';
+    memcpy(work->path + dirLen, name, nameLen + 1);
+    work->next = NULL;
+    work->parent = parent;
+    work->pending = 1;
+
+    pthread_mutex_lock(&w->lock);
+    parent->pending++;
+    if (w->tail != NULL) {
+        w->tail->next = work;
+    } else {
+        w->head = work;
+    }
+    w->tail = work;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return true;
+}
+
+/* Drop one reference to work, and remove each directory on the way up
+ * that has nothing left in it.  The root itself is never removed.
+ */
+static void
+unlinkRelease(UnlinkWalk *w, UnlinkWork *work)
+{
+    while (work != NULL) {
+        pthread_mutex_lock(&w->lock);
+        bool empty = (--work->pending == 0);
+        pthread_mutex_unlock(&w->lock);
+        if (!empty) {
+            break;
+        }
+
+        UnlinkWork *parent = work->parent;
+        if (parent != NULL && rmdir(work->path) < 0) {
+            unlinkReportError(w, errno);
         }
+        free(work);
+        work = parent;
+    }
+}
 
+static bool
+unlinkKeep(UnlinkWalk *w, UnlinkWork *work, const char *name)
+{
+    const char * const *k;
+    if (work != w->root || w->keep == NULL) {
+        return false;
+    }
+    for (k = w->keep; *k != NULL; ++k) {
+        if (!strcmp(*k, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Unlink everything directly inside one directory except for its
+ * subdirectories, which are queued.
+ */
+static void
+unlinkWalkDir(UnlinkWalk *w, UnlinkWork *work)
+{
+    /* The root may be a symlink (/sdcard -> /data/media), which is
+     * followed like "rm -rf link/*" would; nothing below it is.
+     */
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (work != w->root) {
+        flags |= O_NOFOLLOW;
+    }
+    int fd = open(work->path, flags);
+    if (fd < 0) {
+        unlinkReportError(w, errno);
+        return;
+    }
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        unlinkReportError(w, errno);
+        close(fd);
+        return;
+    }
+
+    const struct dirent *de;
+    for (;;) {
         errno = 0;
-        const struct dirent *de;
-        while (errno == 0 && (de = readdir(dir)) != NULL) {
-            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+        if ((de = readdir(dir)) == NULL) {
+            if (errno != 0) {
+                unlinkReportError(w, errno);
+            }
+            break;
+        }
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+        if (unlinkKeep(w, work, de->d_name)) {
+            continue;
+        }
+
+        unsigned char type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+                unlinkReportError(w, errno);
                 continue;
             }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
-                errno = 0;
-            } else if (errno == 0) {
-                errno = -1;
+        if (type == DT_DIR) {
+            if (!unlinkQueueDir(w, work, de->d_name)) {
+                unlinkReportError(w, ENOMEM);
             }
+        } else if (unlinkat(fd, de->d_name, 0) < 0) {
+            unlinkReportError(w, errno);
         }
+    }
 
-        if (errno != 0) {
-            int save = errno;
-            closedir(dir);
-            errno = save;
-            return -1;
+    closedir(dir);
+}
+
+static void *
+unlinkWalkThread(void *arg)
+{
+    UnlinkWalk *w = (UnlinkWalk *)arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->head == NULL && w->active > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
         }
+        UnlinkWork *work = w->head;
+        if (work == NULL) {
+            /* Nothing queued and nobody left to queue more: done. */
+            break;
+        }
+        w->head = work->next;
+        if (w->head == NULL) {
+            w->tail = NULL;
+        }
+        w->active++;
+        pthread_mutex_unlock(&w->lock);
 
-        if (closedir(dir)) {
-            return -1;
+        unlinkWalkDir(w, work);
+        unlinkRelease(w, work);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->active == 0 && w->head == NULL) {
+            pthread_cond_broadcast(&w->cond);
         }
     }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
 
+int
+dirUnlinkChildren(const char *path, const char * const *keep)
+{
+    size_t len = strlen(path);
+    UnlinkWork *root = malloc(sizeof(UnlinkWork) + len);
+    if (root == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(root->path, path, len + 1);
+    root->next = NULL;
+    root->parent = NULL;
+    root->pending = 1;
+
+    UnlinkWalk w;
+    memset(&w, 0, sizeof(w));
+    w.keep = keep;
+    w.root = root;
+    w.head = w.tail = root;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+
+    /* As with the permissions walk, this thread helps too. */
+    pthread_t threads[UNLINK_WALK_THREADS - 1];
+    int started = 0;
+    while (started < UNLINK_WALK_THREADS - 1 &&
+           pthread_create(&threads[started], NULL, unlinkWalkThread, &w) == 0) {
+        started++;
+    }
+    unlinkWalkThread(&w);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    if (w.firstErrno != 0) {
+        errno = w.firstErrno;
+        return -1;
+    }
     return 0;
 }
+
+int
+dirUnlinkHierarchyParallel(const char *path)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return unlink(path);
+    }
+    if (dirUnlinkChildren(path, NULL) < 0) {
+        return -1;
+    }
+    return rmdir(path);
+}
@@ -48,6 +48,22 @@ int dirCreateHierarchy(const char *path, int mode,
  */
 int dirUnlinkHierarchy(const char *path);
 
+/* Remove everything inside <path>, like rm -rf, except for <path>
+ * itself and any top-level entries whose names are in keep (a
+ * NULL-terminated list, or NULL).  If <path> is a symlink to a
+ * directory, the directory's contents are removed.  Entries
+ * are unlinked relative to their directory's fd, with subdirectories
+ * spread over a few threads.  Keeps going after a failure.
+ *
+ * Returns 0 if everything was removed; otherwise returns -1 with errno
+ * set from the first failure.
+ */
+int dirUnlinkChildren(const char *path, const char * const *keep);
+
+/* Like dirUnlinkHierarchy(), but built on dirUnlinkChildren().
+ */
+int dirUnlinkHierarchyParallel(const char *path);
+
 /* chown -R <uid>:<gid> <path>
  * chmod -R <mode> <path>
  *
@@ -56,6 +72,24 @@ int dirUnlinkHierarchy(const char *path);
 int dirSetHierarchyPermissions(const char *path,
          int uid, int gid, int dirMode, int fileMode);
 
+/* Called for each path that dirSetHierarchyPermissionsWithCallback()
+ * couldn't handle.  op is "lstat", "chown", "chmod", "open", etc. and
+ * err is the errno value.  Calls are serialized.
+ */
+typedef void (*DirPermissionsErrorFunction)(const char *path,
+        const char *op, int err, void *cookie);
+
+/* Like dirSetHierarchyPermissions(), but reports every failure to
+ * onError (if non-NULL) and keeps going.  Subdirectories are walked by
+ * a few threads at once, so onError sees paths in no particular order.
+ *
+ * Returns 0 if everything succeeded; otherwise returns -1 with errno
+ * set from the first failure.
+ */
+int dirSetHierarchyPermissionsWithCallback(const char *path,
+        int uid, int gid, int dirMode, int fileMode,
+        DirPermissionsErrorFunction onError, void *cookie);
+
 #ifdef __cplusplus
 }
 #endif
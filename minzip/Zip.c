@@ -157,6 +157,66 @@ static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
     }
 }
 
+/*
+ * Compare a (non-NUL-terminated) name against an entry's name.
+ *
+ * Names are ordered bytewise, with a name sorting before any longer name
+ * it is a prefix of.  This is the order the entries are kept in.
+ */
+static int compareZipEntryName(const ZipEntry* pEntry,
+        const char* name, unsigned int nameLen)
+{
+    unsigned int diffLen;
+    int diff;
+
+    diffLen = pEntry->fileNameLen < nameLen ? pEntry->fileNameLen : nameLen;
+    diff = memcmp(pEntry->fileName, name, diffLen);
+    if (diff == 0) {
+        diff = (int)pEntry->fileNameLen - (int)nameLen;
+    }
+    return diff;
+}
+
+#if SORT_ENTRIES
+/*
+ * (This is a qsort callback.)
+ *
+ * Compare two ZipEntry structs, by name.
+ */
+static int compareZipEntryNames(const void* ventry1, const void* ventry2)
+{
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+
+    return compareZipEntryName((const ZipEntry*) ventry1,
+            entry2->fileName, entry2->fileNameLen);
+}
+
+/*
+ * Return the index of the first entry whose name is not less than
+ * "prefix", or numEntries if there is no such entry.  Since the entries
+ * are sorted, every entry that starts with "prefix" follows it directly.
+ */
+static unsigned int findFirstEntryWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int prefixLen)
+{
+    unsigned int low, high;
+
+    low = 0;
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + ((high - low) / 2); // avoid overflow
+
+        if (compareZipEntryName(&pArchive->pEntries[mid],
+                prefix, prefixLen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+#endif
+
 static int validFilename(const char *fileName, unsigned int fileNameLen)
 {
     // Forbid super long filenames.
@@ -178,9 +238,10 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
 }
 
 /*
- * Parse the contents of a Zip archive.  After confirming that the file
- * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * Parse the end-of-central-directory record of a Zip archive.  After
+ * confirming that the file is in fact a Zip, we record the number of
+ * entries and where the central directory lives.  The entries themselves
+ * are read by loadZipEntries().
  *
  * Returns "true" on success.
  */
@@ -188,7 +249,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 {
     bool result = false;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    unsigned int numEntries, cdOffset;
     unsigned int val;
 
     /*
@@ -230,154 +291,150 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     cdOffset = get4LE(ptr + ENDOFF);
 
     LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
+    if (numEntries == 0 || cdOffset >= pMap->length ||
+            (const unsigned char*) pMap->addr + cdOffset > ptr) {
         LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
             numEntries, cdOffset, pMap->length);
         goto bail;
     }
 
-    /*
-     * Create data structures to hold entries.
-     */
     pArchive->numEntries = numEntries;
-    pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
-        goto bail;
+    pArchive->cdOffset = cdOffset;
+    pArchive->cdLength = ptr - ((const unsigned char*) pMap->addr + cdOffset);
+    result = true;
 
-    ptr = pMap->addr + cdOffset;
-    for (i = 0; i < numEntries; i++) {
-        ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
-        const char *fileName;
+bail:
+    return result;
+}
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
-            LOGW("Ran off the end (at %d)\n", i);
-            goto bail;
-        }
-        if (get4LE(ptr) != CENSIG) {
-            LOGW("Missed a central dir sig (at %d)\n", i);
-            goto bail;
-        }
+/*
+ * Fill in "pEntry" from the central directory record at "ptr", which is
+ * entry number "i", checking it against the map.
+ *
+ * Returns a pointer to the next record, or NULL if this one is bad.
+ */
+static const unsigned char* parseCentralDirEntry(const MemMapping* pMap,
+        const unsigned char* ptr, unsigned int i, ZipEntry* pEntry)
+{
+    unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
+    const unsigned char* localHdr;
+    const char *fileName;
 
-        localHdrOffset = get4LE(ptr + CENOFF);
-        fileNameLen = get2LE(ptr + CENNAM);
-        extraLen = get2LE(ptr + CENEXT);
-        commentLen = get2LE(ptr + CENCOM);
-        fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
-            LOGW("Filename ran off the end (at %d)\n", i);
-            goto bail;
-        }
-        if (!validFilename(fileName, fileNameLen)) {
-            LOGW("Invalid filename (at %d)\n", i);
-            goto bail;
-        }
+    if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        LOGW("Ran off the end (at %d)\n", i);
+        return NULL;
+    }
+    if (get4LE(ptr) != CENSIG) {
+        LOGW("Missed a central dir sig (at %d)\n", i);
+        return NULL;
+    }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
+    localHdrOffset = get4LE(ptr + CENOFF);
+    fileNameLen = get2LE(ptr + CENNAM);
+    extraLen = get2LE(ptr + CENEXT);
+    commentLen = get2LE(ptr + CENCOM);
+    fileName = (const char*)ptr + CENHDR;
+    if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        LOGW("Filename ran off the end (at %d)\n", i);
+        return NULL;
+    }
+    if (!validFilename(fileName, fileNameLen)) {
+        LOGW("Invalid filename (at %d)\n", i);
+        return NULL;
+    }
 
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
-        pEntry = &pArchive->pEntries[i];
-#endif
+    //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
+    //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
+
+    pEntry->fileNameLen = fileNameLen;
+    pEntry->fileName = fileName;
+
+    pEntry->compLen = get4LE(ptr + CENSIZ);
+    pEntry->uncompLen = get4LE(ptr + CENLEN);
+    pEntry->compression = get2LE(ptr + CENHOW);
+    pEntry->modTime = get4LE(ptr + CENTIM);
+    pEntry->crc32 = get4LE(ptr + CENCRC);
+
+    /* These two are necessary for finding the mode of the file.
+     */
+    pEntry->versionMadeBy = get2LE(ptr + CENVEM);
+    if ((pEntry->versionMadeBy & 0xff00) != 0 &&
+            (pEntry->versionMadeBy & 0xff00) != CENVEM_UNIX)
+    {
+        LOGW("Incompatible \"version made by\": 0x%02x (at %d)\n",
+                pEntry->versionMadeBy >> 8, i);
+        return NULL;
+    }
+    pEntry->externalFileAttributes = get4LE(ptr + CENATX);
+
+    // Perform pMap->addr + localHdrOffset, ensuring that it won't
+    // overflow. This is needed because localHdrOffset is untrusted.
+    if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
+        (uintptr_t)localHdrOffset)) {
+        LOGW("Integer overflow adding in parseZipArchive\n");
+        return NULL;
+    }
+    if ((uintptr_t)localHdr + LOCHDR >
+        (uintptr_t)pMap->addr + pMap->length) {
+        LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        return NULL;
+    }
+    if (get4LE(localHdr) != LOCSIG) {
+        LOGW("Missed a local header sig (at %d)\n", i);
+        return NULL;
+    }
+    pEntry->offset = localHdrOffset + LOCHDR
+        + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
+    if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
+        LOGW("Integer overflow adding in parseZipArchive\n");
+        return NULL;
+    }
+    if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        LOGW("Data ran off the end (at %d)\n", i);
+        return NULL;
+    }
+    if (pEntry->compression == STORED &&
+        pEntry->compLen != pEntry->uncompLen) {
+        LOGW("Stored entry has mismatched lengths (at %d)\n", i);
+        return NULL;
+    }
+
+    //dumpEntry(pEntry);
+    return ptr + CENHDR + fileNameLen + extraLen + commentLen;
+}
 
-        //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
-        //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
+/*
+ * Scan out the contents of the central directory located by
+ * parseZipArchive() and store it in a hash table.
+ *
+ * Returns "true" on success.
+ */
+static bool loadZipEntries(ZipArchive* pArchive, const MemMapping* pMap)
+{
+    bool result = false;
+    const unsigned char* ptr;
+    unsigned int i, numEntries;
 
-        pEntry->fileNameLen = fileNameLen;
-        pEntry->fileName = fileName;
+    numEntries = pArchive->numEntries;
 
-        pEntry->compLen = get4LE(ptr + CENSIZ);
-        pEntry->uncompLen = get4LE(ptr + CENLEN);
-        pEntry->compression = get2LE(ptr + CENHOW);
-        pEntry->modTime = get4LE(ptr + CENTIM);
-        pEntry->crc32 = get4LE(ptr + CENCRC);
+    /*
+     * Create data structures to hold entries.
+     */
+    pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
+    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
+    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+        goto bail;
 
-        /* These two are necessary for finding the mode of the file.
+    ptr = pMap->addr + pArchive->cdOffset;
+    for (i = 0; i < numEntries; i++) {
+        /* Entries are stored in central directory order here and sorted
+         * by name in a single pass once they've all been read.
          */
-        pEntry->versionMadeBy = get2LE(ptr + CENVEM);
-        if ((pEntry->versionMadeBy & 0xff00) != 0 &&
-                (pEntry->versionMadeBy & 0xff00) != CENVEM_UNIX)
-        {
-            LOGW("Incompatible \"version made by\": 0x%02x (at %d)\n",
-                    pEntry->versionMadeBy >> 8, i);
-            goto bail;
-        }
-        pEntry->externalFileAttributes = get4LE(ptr + CENATX);
+        ZipEntry* pEntry = &pArchive->pEntries[i];
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
-            goto bail;
-        }
-        if (get4LE(localHdr) != LOCSIG) {
-            LOGW("Missed a local header sig (at %d)\n", i);
-            goto bail;
-        }
-        pEntry->offset = localHdrOffset + LOCHDR
-            + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
-            LOGW("Data ran off the end (at %d)\n", i);
+        ptr = parseCentralDirEntry(pMap, ptr, i, pEntry);
+        if (ptr == NULL)
             goto bail;
-        }
 
 #if !SORT_ENTRIES
         /* Add to hash table; no need to lock here.
@@ -386,12 +443,17 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
          */
         addEntryToHashTable(pArchive->pHash, pEntry);
 #endif
-
-        //dumpEntry(pEntry);
-        ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
 #if SORT_ENTRIES
+    /* Sort the entries by name once, so that everything living under
+     * a given directory ends up in one contiguous run.  This used to be
+     * an insertion sort done while reading the central directory, which
+     * is quadratic in the number of entries.
+     */
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry),
+            compareZipEntryNames);
+
     /* If we're sorting, we have to wait until all entries
      * are in their final places, otherwise the pointers will
      * probably point to the wrong things.
@@ -404,15 +466,127 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 #endif
 
     result = true;
+    LOGV("Loaded %u entries (%zu bytes of index for %zu bytes of "
+        "central directory)\n", numEntries,
+        mzZipArchiveMemoryUsage(pArchive), pArchive->cdLength);
 
 bail:
     if (!result) {
+        free(pArchive->pEntries);
+        pArchive->pEntries = NULL;
         mzHashTableFree(pArchive->pHash);
         pArchive->pHash = NULL;
     }
     return result;
 }
 
+/*
+ * Build the entry table of an archive opened with mzOpenZipArchiveLazy(),
+ * if that hasn't been done yet.
+ *
+ * If the central directory turns out to be bad, the archive is left
+ * looking empty so that mzZipEntryCount() and later lookups agree.
+ */
+static bool ensureZipEntries(ZipArchive* pArchive)
+{
+    if (pArchive->pEntries != NULL) {
+        return true;
+    }
+    if (pArchive->numEntries == 0) {
+        return false;
+    }
+    if (!loadZipEntries(pArchive, &pArchive->map)) {
+        LOGW("Bad central directory; treating archive as empty\n");
+        pArchive->numEntries = 0;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Look up an entry of a lazily-opened archive without building the
+ * table: walk the central directory in the map and parse only the
+ * record whose name matches.  Found entries are kept (so the pointers
+ * stay good until the archive is closed) in a block of at most
+ * MZ_LAZY_LOOKUPS; after that the full table is built instead.
+ */
+static const ZipEntry* findZipEntryLazy(ZipArchive* pArchive,
+        const char* entryName)
+{
+    const MemMapping* pMap = &pArchive->map;
+    const unsigned char* end =
+        (const unsigned char*) pMap->addr + pMap->length;
+    const unsigned char* ptr;
+    size_t nameLen = strlen(entryName);
+    unsigned int i;
+
+    for (i = 0; i < pArchive->numLookups; i++) {
+        const ZipEntry* pEntry = &pArchive->pLookups[i];
+        if (pEntry->fileNameLen == nameLen &&
+                memcmp(pEntry->fileName, entryName, nameLen) == 0) {
+            return pEntry;
+        }
+    }
+    if (pArchive->numLookups == MZ_LAZY_LOOKUPS) {
+        if (!ensureZipEntries(pArchive)) {
+            return NULL;
+        }
+        return mzFindZipEntry(pArchive, entryName);
+    }
+
+    ptr = pMap->addr + pArchive->cdOffset;
+    for (i = 0; i < pArchive->numEntries; i++) {
+        unsigned int fileNameLen;
+
+        if (ptr + CENHDR > end || get4LE(ptr) != CENSIG) {
+            LOGW("Bad central directory (at %d)\n", i);
+            return NULL;
+        }
+        fileNameLen = get2LE(ptr + CENNAM);
+        if (fileNameLen == nameLen && ptr + CENHDR + nameLen <= end &&
+                memcmp(ptr + CENHDR, entryName, nameLen) == 0) {
+            ZipEntry* pEntry;
+
+            if (pArchive->pLookups == NULL) {
+                pArchive->pLookups =
+                    (ZipEntry*) malloc(MZ_LAZY_LOOKUPS * sizeof(ZipEntry));
+                if (pArchive->pLookups == NULL) {
+                    return NULL;
+                }
+            }
+            pEntry = &pArchive->pLookups[pArchive->numLookups];
+            if (parseCentralDirEntry(pMap, ptr, i, pEntry) == NULL) {
+                return NULL;
+            }
+            pArchive->numLookups++;
+            return pEntry;
+        }
+        ptr += CENHDR + fileNameLen + get2LE(ptr + CENEXT) +
+            get2LE(ptr + CENCOM);
+    }
+    return NULL;
+}
+
+/*
+ * Return the number of bytes of heap used to index the archive's entries.
+ */
+size_t mzZipArchiveMemoryUsage(const ZipArchive* pArchive)
+{
+    size_t size = 0;
+
+    if (pArchive->pEntries != NULL) {
+        size += pArchive->numEntries * sizeof(ZipEntry);
+    }
+    if (pArchive->pHash != NULL) {
+        size += sizeof(HashTable) +
+            pArchive->pHash->tableSize * sizeof(HashEntry);
+    }
+    if (pArchive->pLookups != NULL) {
+        size += MZ_LAZY_LOOKUPS * sizeof(ZipEntry);
+    }
+    return size;
+}
+
 /*
  * Open a Zip archive and scan out the contents.
  *
@@ -427,7 +601,8 @@ bail:
  *
  * On success, we fill out the contents of "pArchive".
  */
-int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+static int openZipArchive(const char* fileName, ZipArchive* pArchive,
+        bool lazy)
 {
     MemMapping map;
     int err;
@@ -456,7 +631,8 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (!parseZipArchive(pArchive, &map) ||
+            (!lazy && !loadZipEntries(pArchive, &map))) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
@@ -474,6 +650,19 @@ bail:
     return err;
 }
 
+int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, pArchive, false);
+}
+
+/*
+ * Open a Zip archive, but only locate the central directory.
+ */
+int mzOpenZipArchiveLazy(const char* fileName, ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, pArchive, true);
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -489,12 +678,16 @@ void mzCloseZipArchive(ZipArchive* pArchive)
         sysReleaseShmem(&pArchive->map);
 
     free(pArchive->pEntries);
+    free(pArchive->pLookups);
 
     mzHashTableFree(pArchive->pHash);
 
     pArchive->fd = -1;
+    pArchive->numEntries = 0;
     pArchive->pHash = NULL;
     pArchive->pEntries = NULL;
+    pArchive->pLookups = NULL;
+    pArchive->numLookups = 0;
 }
 
 /*
@@ -505,12 +698,39 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int itemHash;
 
+    if (pArchive->pEntries == NULL) {
+        /* The lookup block and the table are caches; filling them in
+         * doesn't change what the archive looks like to callers.
+         */
+        return findZipEntryLazy((ZipArchive*) pArchive, entryName);
+    }
+    itemHash = computeHash(entryName, strlen(entryName));
     return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
                 itemHash, (char*) entryName, hashcmpZipName, false);
 }
 
+/*
+ * Get the number of entries, building the table of a lazily-opened
+ * archive first.
+ */
+unsigned int mzZipEntryCount(const ZipArchive* pArchive)
+{
+    ensureZipEntries((ZipArchive*) pArchive);
+    return pArchive->numEntries;
+}
+
+const ZipEntry* mzGetZipEntryAt(const ZipArchive* pArchive,
+        unsigned int index)
+{
+    if (ensureZipEntries((ZipArchive*) pArchive) &&
+            index < pArchive->numEntries) {
+        return pArchive->pEntries + index;
+    }
+    return NULL;
+}
+
 /*
  * Return true if the entry is a symbolic link.
  */
@@ -659,6 +879,113 @@ bail:
     return true;
 }
 
+/*
+ * Whole-entry inflate backends.
+ *
+ * When the caller has a buffer big enough for the whole entry, there's
+ * no need to push the data through 32K bounce buffers: the compressed
+ * bytes are already mapped, so they can be decoded in one call straight
+ * into the destination.  The backend is picked at build time; zlib's
+ * one-shot inflate is the default and the streaming path above is
+ * always used for everything else.
+ */
+#ifdef MINZIP_USE_LIBDEFLATE
+#include <libdeflate.h>
+
+static bool inflateWholeEntry(const unsigned char* in, size_t inLen,
+        unsigned char* out, size_t outLen)
+{
+    struct libdeflate_decompressor* d;
+    enum libdeflate_result res;
+    size_t actualLen = 0;
+
+    d = libdeflate_alloc_decompressor();
+    if (d == NULL) {
+        LOGE("Can't allocate libdeflate decompressor\n");
+        return false;
+    }
+    res = libdeflate_deflate_decompress(d, in, inLen, out, outLen, &actualLen);
+    libdeflate_free_decompressor(d);
+    if (res != LIBDEFLATE_SUCCESS || actualLen != outLen) {
+        LOGW("libdeflate failed (res=%d, %zu vs %zu)\n",
+            (int) res, actualLen, outLen);
+        return false;
+    }
+    return true;
+}
+
+const char* mzInflateBackendName(void)
+{
+    return "libdeflate";
+}
+#else
+static bool inflateWholeEntry(const unsigned char* in, size_t inLen,
+        unsigned char* out, size_t outLen)
+{
+    z_stream zstream;
+    int zerr;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.next_in = (Bytef*) in;
+    zstream.avail_in = inLen;
+    zstream.next_out = (Bytef*) out;
+    zstream.avail_out = outLen;
+
+    /* No zlib header; see processDeflatedEntry(). */
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    zerr = inflate(&zstream, Z_FINISH);
+    inflateEnd(&zstream);
+    if (zerr != Z_STREAM_END || zstream.total_out != outLen) {
+        LOGW("zlib inflate call failed (zerr=%d, %lu vs %zu)\n",
+            zerr, zstream.total_out, outLen);
+        return false;
+    }
+    return true;
+}
+
+const char* mzInflateBackendName(void)
+{
+    return "zlib";
+}
+#endif
+
+/*
+ * Uncompress the whole of "pEntry" from the mapped archive into "buf",
+ * which must hold at least uncompLen bytes.
+ */
+static bool extractWholeEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buf)
+{
+    const unsigned char* data =
+        (const unsigned char*) pArchive->map.addr + pEntry->offset;
+
+    switch (pEntry->compression) {
+    case STORED:
+        /* The central directory parse rejects these, but the copy below
+         * must never read past the map.
+         */
+        if (pEntry->compLen != pEntry->uncompLen ||
+            (size_t)pEntry->offset + pEntry->compLen > pArchive->map.length) {
+            LOGE("Bad stored entry '%.*s'\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            return false;
+        }
+        memcpy(buf, data, pEntry->uncompLen);
+        return true;
+    case DEFLATED:
+        return inflateWholeEntry(data, pEntry->compLen,
+                buf, pEntry->uncompLen);
+    default:
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+}
+
 /*
  * Stream the uncompressed data through the supplied function,
  * passing cookie to it each time it gets called.  processFunction
@@ -758,6 +1085,14 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
     CopyProcessArgs args;
     bool ret;
 
+    if (bufLen >= pEntry->uncompLen) {
+        if (!extractWholeEntry(pArchive, pEntry, (unsigned char*) buf)) {
+            LOGE("Can't extract entry to buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
     args.buf = buf;
     args.bufLen = bufLen;
     ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
@@ -810,22 +1145,6 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     return true;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    long len;
-} BufferExtractCookie;
-
-static bool bufferProcessFunction(const unsigned char *data, int dataLen,
-    void *cookie) {
-    BufferExtractCookie *bec = (BufferExtractCookie*)cookie;
-
-    memmove(bec->buffer, data, dataLen);
-    bec->buffer += dataLen;
-    bec->len -= dataLen;
-
-    return true;
-}
-
 /*
  * Uncompress "pEntry" in "pArchive" to buffer, which must be large
  * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
@@ -833,13 +1152,7 @@ static bool bufferProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
-    BufferExtractCookie bec;
-    bec.buffer = buffer;
-    bec.len = mzGetZipEntryUncompLen(pEntry);
-
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry,
-        bufferProcessFunction, (void*)&bec);
-    if (!ret || bec.len != 0) {
+    if (!extractWholeEntry(pArchive, pEntry, buffer)) {
         LOGE("Can't extract entry to memory buffer.\n");
         return false;
     }
@@ -967,6 +1280,12 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     }
     zpath[zipDirLen] = '\0';
 
+    if (!ensureZipEntries((ZipArchive*) pArchive)) {
+        LOGE("Can't read entries of zip archive\n");
+        free(zpath);
+        return false;
+    }
+
     /* Set up the helper structure that we'll use to assemble paths.
      */
     MzPathHelper helper;
@@ -978,14 +1297,19 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.bufLen = 0;
 
     /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+     * with zpath.  Since the entries are sorted, start at the first
+     * possible match and stop at the first non-match: every entry
+     * after it sorts after zpath's prefix range too, even when
+     * nothing matched at all.
      */
     unsigned int i;
-    bool seenMatch = false;
     int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
+#if SORT_ENTRIES
+    i = findFirstEntryWithPrefix(pArchive, zpath, zipDirLen);
+#else
+    i = 0;
+#endif
+    for (; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
         if (pEntry->fileNameLen < zipDirLen) {
 //TODO: look out for a single empty directory entry that matches zpath, but
@@ -995,32 +1319,23 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* No chance of matching.
              */
 #if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
+            break;
+#else
             continue;
+#endif
         }
         /* If zpath is empty, this strncmp() will match everything,
          * which is what we want.
          */
         if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
 #if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
+            break;
+#else
             continue;
+#endif
         }
         /* This entry begins with zipDir, so we'll extract it.
          */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
@@ -48,11 +48,21 @@ typedef struct ZipEntry {
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
-    ZipEntry*   pEntries;
+    ZipEntry*   pEntries;       // NULL until needed if opened lazily
     HashTable*  pHash;          // maps file name to ZipEntry
     MemMapping  map;
+    size_t      cdOffset;       // central directory span within map
+    size_t      cdLength;
+    ZipEntry*   pLookups;       // found without the table (lazy only)
+    unsigned int numLookups;
 } ZipArchive;
 
+/*
+ * How many entries a lazily-opened archive looks up one at a time
+ * before it builds the whole table.
+ */
+#define MZ_LAZY_LOOKUPS 16
+
 /*
  * Represents a non-NUL-terminated string,
  * which is how entry names are stored.
@@ -70,6 +80,27 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Open a Zip archive, checking only the end-of-central-directory record.
+ * mzFindZipEntry() then walks the central directory in place and parses
+ * just the entry asked for; the first MZ_LAZY_LOOKUPS entries found are
+ * kept in a small fixed block.  The full entry table is only built on a
+ * later lookup, or by mzZipEntryCount(), mzGetZipEntryAt() or
+ * mzExtractRecursive().  A bad central directory makes the archive look
+ * empty at that point rather than failing the open.
+ *
+ * Lookups fill in caches inside the archive, so they mustn't run on
+ * several threads at once.
+ *
+ * Returns 0 or a nonzero errno value, like mzOpenZipArchive().
+ */
+int mzOpenZipArchiveLazy(const char* fileName, ZipArchive* pArchive);
+
+/*
+ * Get the number of heap bytes used to index the archive's entries.
+ */
+size_t mzZipArchiveMemoryUsage(const ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -88,24 +119,16 @@ const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
 /*
  * Get the number of entries in the Zip archive.
  */
-INLINE unsigned int mzZipEntryCount(const ZipArchive* pArchive) {
-    return pArchive->numEntries;
-}
+unsigned int mzZipEntryCount(const ZipArchive* pArchive);
 
 /*
  * Get an entry by index.  Returns NULL if the index is out-of-bounds.
  */
-INLINE const ZipEntry*
-mzGetZipEntryAt(const ZipArchive* pArchive, unsigned int index)
-{
-    if (index < pArchive->numEntries) {
-        return pArchive->pEntries + index;
-    }
-    return NULL;
-}
+const ZipEntry* mzGetZipEntryAt(const ZipArchive* pArchive,
+        unsigned int index);
 
 /*
- * Get the index number of an entry in the archive.
+ * Get the index number of an entry returned by mzGetZipEntryAt().
  */
 INLINE unsigned int
 mzGetZipEntryIndex(const ZipArchive *pArchive, const ZipEntry *pEntry) {
@@ -133,6 +156,9 @@ INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
 INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
     return pEntry->crc32;
 }
+INLINE bool mzIsZipEntryStored(const ZipEntry* pEntry) {
+    return pEntry->compression == 0;
+}
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 
 
@@ -182,6 +208,13 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char* buffer);
 
+/*
+ * Name of the backend used when a whole entry is inflated into memory
+ * (mzExtractZipEntryToBuffer() and mzReadZipEntry() with a large enough
+ * buffer).  Streaming extraction always uses zlib.
+ */
+const char* mzInflateBackendName(void);
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compare the streaming inflate path against the whole-entry backend.
+ *
+ *     minzip_inflate_bench [-n <iterations>] <zip>...
+ *
+ * e.g. minzip_inflate_bench bootable/recovery/testdata/*.zip
+ *
+ * Every entry is decoded both ways, and the CRC of each result is
+ * checked against the central directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zlib.h"
+#include "Zip.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool crcProcess(const unsigned char *data, int dataLen, void *cookie) {
+    unsigned long *crc = (unsigned long *)cookie;
+    *crc = crc32(*crc, data, dataLen);
+    return true;
+}
+
+static double mbps(long long bytes, double secs) {
+    return secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0.0;
+}
+
+static int bench_zip(const char* path, int iterations) {
+    ZipArchive za;
+    unsigned int i;
+    int it;
+    long long bytes = 0;
+    double streamTime = 0, wholeTime = 0;
+    int failures = 0;
+
+    if (mzOpenZipArchive(path, &za) != 0) {
+        // Some of the test packages are deliberately not zips.
+        printf("%-40s skipped (can't open)\n", path);
+        return 0;
+    }
+
+    for (i = 0; i < mzZipEntryCount(&za); i++) {
+        const ZipEntry* pEntry = mzGetZipEntryAt(&za, i);
+        long len = mzGetZipEntryUncompLen(pEntry);
+        unsigned char* buf = malloc(len > 0 ? len : 1);
+        if (buf == NULL) {
+            fprintf(stderr, "can't allocate %ld bytes\n", len);
+            failures++;
+            break;
+        }
+
+        for (it = 0; it < iterations; it++) {
+            unsigned long crc = crc32(0L, Z_NULL, 0);
+            double start = now();
+            bool ok = mzProcessZipEntryContents(&za, pEntry, crcProcess, &crc);
+            streamTime += now() - start;
+            if (!ok || crc != (unsigned long)mzGetZipEntryCrc32(pEntry)) {
+                fprintf(stderr, "%s: entry %u: streaming decode mismatch\n",
+                        path, i);
+                failures++;
+                break;
+            }
+
+            start = now();
+            ok = mzExtractZipEntryToBuffer(&za, pEntry, buf);
+            wholeTime += now() - start;
+            crc = crc32(crc32(0L, Z_NULL, 0), buf, len);
+            if (!ok || crc != (unsigned long)mzGetZipEntryCrc32(pEntry)) {
+                fprintf(stderr, "%s: entry %u: %s decode mismatch\n",
+                        path, i, mzInflateBackendName());
+                failures++;
+                break;
+            }
+            bytes += len;
+        }
+        free(buf);
+    }
+    mzCloseZipArchive(&za);
+
+    printf("%-40s %10lld bytes  stream %8.1f MB/s  %s %8.1f MB/s\n",
+           path, bytes, mbps(bytes, streamTime),
+           mzInflateBackendName(), mbps(bytes, wholeTime));
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    int iterations = 10;
+    int failures = 0;
+    int i = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        i = 3;
+    }
+    if (i >= argc || iterations <= 0) {
+        fprintf(stderr, "Usage: %s [-n <iterations>] <zip>...\n", argv[0]);
+        return 2;
+    }
+
+    for (; i < argc; i++) {
+        failures += bench_zip(argv[i], iterations);
+    }
+    return failures == 0 ? 0 : 1;
+}
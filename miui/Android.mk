@@ -11,7 +11,7 @@ libmiui_common_src_files := \
     libs/minutf8/minutf8.c \
     src/edify/lex.yy.c \
 	src/edify/parser.c \
-	src/edify/expr.c \
+	../edify/expr.c \
     src/libs/miui_array.c \
     src/libs/miui_freetype.c \
     src/libs/miui_graph.c \
@@ -36,7 +36,7 @@ libmiui_common_src_files :=libs/png/png.c \
     libs/freetype/truetype/truetype.c \
 	src/edify/lex.yy.c \
 	src/edify/parser.c \
-	src/edify/expr.c \
+	../edify/expr.c \
     src/libs/miui_array.c \
     src/libs/miui_freetype.c \
     src/libs/miui_graph.c \
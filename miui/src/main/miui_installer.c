@@ -220,6 +220,9 @@ static void *ac_progressthread(void *cookie){
     if (ai_progress_pos<0) ai_progress_pos=0.0;
     int prog_g = ai_prog_w; //-(ai_prog_r*2);
     int prog_w = round(ai_prog_w*ai_progress_pos);
+    //-- set by the install's pipe reader thread
+    char progress_info[sizeof(ai_progress_info)];
+    memcpy(progress_info,ai_progress_info,sizeof(progress_info));
 
     pthread_mutex_unlock(&ai_progress_mutex);
 
@@ -264,8 +267,8 @@ static void *ac_progressthread(void *cookie){
     
     ag_textfs(ai_cv,ptx1_w,ptx1_x+1,ptxt_y+1,ai_progress_text,acfg()->winbg,0);
     ag_texts (ai_cv,ptx1_w,ptx1_x  ,ptxt_y  ,ai_progress_text,acfg()->winfg,0);
-    ag_textfs(ai_cv,ai_prog_w-(ai_prog_or*2),ptx1_x+1,ptxt_y+1+ag_fontheight(0),ai_progress_info,acfg()->winbg,0);
-    ag_texts (ai_cv,ai_prog_w-(ai_prog_or*2),ptx1_x  ,ptxt_y+ag_fontheight(0)+agdp(),ai_progress_info,acfg()->winfg_gray,0);
+    ag_textfs(ai_cv,ai_prog_w-(ai_prog_or*2),ptx1_x+1,ptxt_y+1+ag_fontheight(0),progress_info,acfg()->winbg,0);
+    ag_texts (ai_cv,ai_prog_w-(ai_prog_or*2),ptx1_x  ,ptxt_y+ag_fontheight(0)+agdp(),progress_info,acfg()->winfg_gray,0);
 
     ag_textfs(ai_cv,ptxt_w,ptxt_x+1,ptxt_y+1,prog_percent_str,acfg()->winbg,0);
     ag_texts (ai_cv,ptxt_w,ptxt_x,ptxt_y,prog_percent_str,acfg()->winfg,0);
@@ -602,6 +605,9 @@ void miuiInstall_set_info(char* file_name)
 {
 
     char *filename = file_name;
+    if (filename == NULL) return;
+    pthread_mutex_lock(&ai_progress_mutex);
     snprintf(ai_progress_info,100,"%s",filename);
+    pthread_mutex_unlock(&ai_progress_mutex);
     return ;
 }
@@ -2162,12 +2162,19 @@ int miui_ui_config(const char *file)
        miui_printf("read file %s failed!\n", file);
        goto config_fail;
    }
+   Expr* program = CompileExpr(root);
+   FreeExpr(root);
+   if (program == NULL) {
+       miui_printf("compile file %s failed!\n", file);
+       goto config_fail;
+   }
    //--- EVALUATE CONFIG SCRIPT 
    State state;
    state.cookie = NULL;
    state.script = script_data;
    state.errmsg = NULL;
-   char* result = Evaluate(&state, root);
+   char* result = Evaluate(&state, program);
+   free(program);
    if (result == NULL) {
        if (state.errmsg == NULL) {
            miui_printf("script abortedl\n");
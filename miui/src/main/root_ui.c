@@ -90,6 +90,7 @@ int load_settings()
 			   "\n"
 			   "[dev]\n"
 			   "signaturecheck=0\n"
+			   "scriptprofile=0\n"
 			   "\n\n");
 	   fclose(f);
 
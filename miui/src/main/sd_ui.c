@@ -116,6 +116,56 @@ static STATUS sd_update_show(menuUnit *p)
     miuiIntent_send(INTENT_SETSYSTEM,1,"0");
     return MENU_BACK;
 }
+//zips picked in the queue menu, installed one after another
+#define SD_QUEUE_MAX 16
+static char sd_queue[SD_QUEUE_MAX * SD_MAX_PATH];
+static int sd_queue_count = 0;
+static int sd_queue_rejected = 0;
+
+//callback function, add the zip to the queue
+static int file_queue(char *file_name, int file_len, void *data)
+{
+    return_val_if_fail(file_name != NULL, RET_FAIL);
+    return_val_if_fail(strlen(file_name) <= file_len, RET_INVALID_ARG);
+    //never install a cut-off path; leave the queue as it was
+    size_t need = strlen(file_name) + (sd_queue_count > 0 ? 1 : 0);
+    if (strlen(sd_queue) + need >= sizeof(sd_queue)) {
+        miui_alert(4, "<~sd.queue.title>", "<~sd.queue.toolong>", "@alert", acfg()->text_ok);
+        sd_queue_rejected = 1;
+        return 0;
+    }
+    if (sd_queue_count > 0)
+        strlcat(sd_queue, "\n", sizeof(sd_queue));
+    strlcat(sd_queue, file_name, sizeof(sd_queue));
+    sd_queue_count++;
+    return 0;
+}
+
+static STATUS sd_queue_show(menuUnit *p)
+{
+    //ensure_mounte sd path
+    miuiIntent_send(INTENT_MOUNT, 1, "/sdcard");
+    sd_queue[0] = '\0';
+    sd_queue_count = 0;
+    while (1) {
+        int count = sd_queue_count;
+        sd_queue_rejected = 0;
+        file_scan("/sdcard", sizeof("/sdcard"), p->name, strlen(p->name), &file_queue, (void *)p, &file_filter);
+        //back from the file list without choosing, drop the queue
+        if (sd_queue_count == 0 || (sd_queue_count == count && !sd_queue_rejected))
+            return MENU_BACK;
+        //nothing more fits: install all of it or none of it
+        if (sd_queue_count == SD_QUEUE_MAX) {
+            if (RET_YES != miui_confirm(3, "<~sd.queue.title>", sd_queue, "@sd.choose"))
+                return MENU_BACK;
+            break;
+        }
+        if (RET_YES == miui_confirm(5, "<~sd.queue.title>", sd_queue, "@sd.choose", "<~sd.queue.install>", "<~sd.queue.more>"))
+            break;
+    }
+    miuiIntent_send(INTENT_INSTALL, 1, sd_queue);
+    return MENU_BACK;
+}
 struct _menuUnit * sd_ui_init()
 {
     struct _menuUnit *p = common_ui_init();
@@ -132,6 +182,13 @@ struct _menuUnit * sd_ui_init()
     strncpy(temp->name, "<~sd.install.name>", MENU_LEN);
     temp->show = &sd_menu_show;
     assert_if_fail(menuNode_add(p, temp) == RET_OK);
+    //install several zips from sd, one after another
+    temp = common_ui_init();
+    return_null_if_fail(temp != NULL);
+    menuUnit_set_icon(temp, "@sd.choose");
+    strncpy(temp->name, "<~sd.queue.name>", MENU_LEN);
+    temp->show = &sd_queue_show;
+    assert_if_fail(menuNode_add(p, temp) == RET_OK);
     //install update.bin from sd
     temp = common_ui_init();
     menuUnit_set_icon(temp, "@sd.install");
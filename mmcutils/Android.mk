@@ -8,6 +8,7 @@ LOCAL_SRC_FILES := \
 
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
+LOCAL_STATIC_LIBRARIES := libmincrypt
 
 include $(BUILD_SHARED_LIBRARY)
 
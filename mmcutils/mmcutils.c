@@ -33,12 +33,17 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
 #include "mmcutils.h"
 
 unsigned ext3_count = 0;
@@ -418,169 +423,456 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
     return rv;
 }
 
-int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
+/*
+ * Raw copies.  The source is read into one of two aligned buffers on
+ * a separate thread while the destination is written from the other,
+ * MMC_COPY_CHUNK bytes at a time, so a copy runs at the speed of the
+ * slower device rather than the sum of the two.
+ */
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+#define MMC_COPY_CHUNK          (4 * 1024 * 1024)
+#define MMC_COPY_SECTOR         512
+
+static ssize_t
+read_full (int fd, unsigned char *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buf + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+static int
+write_full (int fd, const unsigned char *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, buf + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+// Open with O_DIRECT if asked to and the filesystem allows it.
+static int
+open_raw (const char *path, int flags, int direct) {
+    int fd = -1;
+    if (direct)
+        fd = open(path, flags | O_DIRECT, 0644);
+    if (fd < 0)
+        fd = open(path, flags, 0644);
+    return fd;
+}
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+static unsigned char *
+alloc_chunks (int count) {
+    // mmap gives page-aligned buffers, as O_DIRECT needs.
+    void *p = mmap(NULL, count * MMC_COPY_CHUNK, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        printf("Can't allocate copy buffers: %s\n", strerror(errno));
+        return NULL;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
+    return p;
+}
+
+/*
+ * Flashing.  The data is hashed as it is written.  With
+ * MMC_COPY_VERIFY a second thread reads back each chunk once it is on
+ * the device and hashes that too, and the two digests are compared
+ * when the context is closed, so verifying costs little more than the
+ * final fsync.  Without O_DIRECT the read-back has to wait for that
+ * fsync, and then drops the page cache first.
+ */
+struct MmcFlashContext {
+    char *device;
+    int fd;
+    int flags;
+    int direct;
+    int error;
+    unsigned char *buffer;  // MMC_COPY_CHUNK staging buffer, then the
+                            // read-back buffer
+    int chunks;             // ...if there is one
+    size_t stored;
+    off64_t written;
+    SHA_CTX sha1;
+    SHA256_CTX sha256;
+
+    pthread_t verifier;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    off64_t readable;       // how far the verifier may read
+    int final;              // no more data is coming
+    int verify_direct;      // read back with O_DIRECT
+    int verify_error;
+    SHA_CTX verify_sha1;
+};
+
+static void *
+flash_verifier (void *cookie) {
+    MmcFlashContext *ctx = (MmcFlashContext *) cookie;
+    unsigned char *buf = ctx->buffer + MMC_COPY_CHUNK;
+    off64_t pos = 0;
+    int fd = open_raw(ctx->device, O_RDONLY, ctx->verify_direct);
+
+    if (fd < 0) {
+        printf("verify: can't open %s: %s\n", ctx->device, strerror(errno));
+        ctx->verify_error = 1;
+        return NULL;
     }
 
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
+    for (;;) {
+        off64_t readable;
+        int final;
+
+        pthread_mutex_lock(&ctx->mu);
+        while (pos == ctx->readable && !ctx->final)
+            pthread_cond_wait(&ctx->cv, &ctx->mu);
+        readable = ctx->readable;
+        final = ctx->final;
+        pthread_mutex_unlock(&ctx->mu);
+        if (pos == readable && final)
+            break;
 
+        if (pos == 0 && !ctx->verify_direct)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+        size_t want = readable - pos < MMC_COPY_CHUNK ?
+                (size_t) (readable - pos) : MMC_COPY_CHUNK;
+        // O_DIRECT reads need a whole number of sectors.
+        size_t rounded = (want + MMC_COPY_SECTOR - 1) & ~(MMC_COPY_SECTOR - 1);
+        ssize_t got = read_full(fd, buf, rounded);
+        if (got < (ssize_t) want) {
+            printf("verify: short read of %s at %lld\n",
+                   ctx->device, (long long) pos);
+            ctx->verify_error = 1;
+            break;
+        }
+        SHA_update(&ctx->verify_sha1, buf, want);
+        pos += want;
+    }
+    close(fd);
+    return NULL;
 }
 
+MmcFlashContext *
+mmc_flash_open (const char *device, int flags) {
+    MmcFlashContext *ctx = calloc(1, sizeof(MmcFlashContext));
+    if (ctx == NULL)
+        return NULL;
+
+    ctx->flags = flags;
+    ctx->fd = open_raw(device, O_WRONLY | O_CREAT | O_TRUNC,
+                       flags & MMC_COPY_DIRECT_OUT);
+    if (ctx->fd < 0) {
+        printf("Can't open %s: %s\n", device, strerror(errno));
+        free(ctx);
+        return NULL;
+    }
+    ctx->direct = (fcntl(ctx->fd, F_GETFL) & O_DIRECT) != 0;
+    ctx->device = strdup(device);
+    // One chunk for staging writes and, when verifying, one to read
+    // back into; both are allocated once, here.
+    ctx->chunks = (flags & MMC_COPY_VERIFY) ? 2 : 1;
+    ctx->buffer = alloc_chunks(ctx->chunks);
+    if (ctx->device == NULL || ctx->buffer == NULL) {
+        close(ctx->fd);
+        free(ctx->device);
+        free(ctx);
+        return NULL;
+    }
+    SHA_init(&ctx->sha1);
+    SHA256_init(&ctx->sha256);
+    SHA_init(&ctx->verify_sha1);
+    pthread_mutex_init(&ctx->mu, NULL);
+    pthread_cond_init(&ctx->cv, NULL);
+
+    ctx->verify_direct = ctx->direct;
+    if ((flags & MMC_COPY_VERIFY) &&
+        pthread_create(&ctx->verifier, NULL, flash_verifier, ctx) != 0) {
+        printf("Can't start verify thread\n");
+        ctx->flags &= ~MMC_COPY_VERIFY;
+        ctx->error = 1;
+    }
+    return ctx;
+}
 
-int
-mmc_raw_dump_internal (const char* in_file, const char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
+static void
+flash_publish (MmcFlashContext *ctx, off64_t readable, int final) {
+    pthread_mutex_lock(&ctx->mu);
+    ctx->readable = readable;
+    ctx->final = final;
+    pthread_cond_broadcast(&ctx->cv);
+    pthread_mutex_unlock(&ctx->mu);
+}
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+static int
+flash_chunk (MmcFlashContext *ctx, const unsigned char *data, size_t len) {
+    // O_DIRECT writes need a whole number of sectors; write an
+    // odd-sized tail through the page cache.
+    if (ctx->direct && len % MMC_COPY_SECTOR) {
+        fcntl(ctx->fd, F_SETFL, fcntl(ctx->fd, F_GETFL) & ~O_DIRECT);
+        ctx->direct = 0;
+    }
+    if (write_full(ctx->fd, data, len) != 0) {
+        printf("Error writing %s: %s\n", ctx->device, strerror(errno));
+        ctx->error = 1;
+        return -1;
+    }
+    ctx->written += len;
+    if (ctx->direct)
+        flash_publish(ctx, ctx->written, 0);
+    return 0;
+}
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+int
+mmc_flash_write (MmcFlashContext *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+    if (ctx->error)
+        return -1;
+    SHA_update(&ctx->sha1, p, len);
+    if (ctx->flags & MMC_COPY_SHA256)
+        SHA256_update(&ctx->sha256, p, len);
+
+    while (len > 0) {
+        // Whole, aligned chunks go straight from the caller's buffer.
+        if (ctx->stored == 0 && len >= MMC_COPY_CHUNK &&
+            ((uintptr_t) p & (getpagesize() - 1)) == 0) {
+            if (flash_chunk(ctx, p, MMC_COPY_CHUNK) != 0)
+                return -1;
+            p += MMC_COPY_CHUNK;
+            len -= MMC_COPY_CHUNK;
+            continue;
+        }
+        size_t copy = MMC_COPY_CHUNK - ctx->stored;
+        if (copy > len)
+            copy = len;
+        memcpy(ctx->buffer + ctx->stored, p, copy);
+        ctx->stored += copy;
+        p += copy;
+        len -= copy;
+        if (ctx->stored == MMC_COPY_CHUNK) {
+            if (flash_chunk(ctx, ctx->buffer, MMC_COPY_CHUNK) != 0)
+                return -1;
+            ctx->stored = 0;
+        }
+    }
+    return 0;
+}
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+int
+mmc_flash_close (MmcFlashContext *ctx, uint8_t *sha1, uint8_t *sha256) {
+    int ret = ctx->error ? -1 : 0;
+
+    if (ret == 0 && ctx->stored > 0 &&
+        flash_chunk(ctx, ctx->buffer, ctx->stored) != 0)
+        ret = -1;
+    if (ret == 0 && (ctx->flags & (MMC_COPY_FSYNC | MMC_COPY_VERIFY)) &&
+        fsync(ctx->fd) != 0) {
+        printf("Error syncing %s: %s\n", ctx->device, strerror(errno));
+        ret = -1;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
+
+    const uint8_t *digest = SHA_final(&ctx->sha1);
+    if (sha1 != NULL)
+        memcpy(sha1, digest, SHA_DIGEST_SIZE);
+    if (sha256 != NULL && (ctx->flags & MMC_COPY_SHA256))
+        memcpy(sha256, SHA256_final(&ctx->sha256), SHA256_DIGEST_SIZE);
+
+    if (ctx->flags & MMC_COPY_VERIFY) {
+        // On failure, stop the verifier where it is.
+        flash_publish(ctx, ret == 0 ? ctx->written : ctx->readable, 1);
+        pthread_join(ctx->verifier, NULL);
+        if (ret == 0 && (ctx->verify_error ||
+                         memcmp(digest, SHA_final(&ctx->verify_sha1),
+                                SHA_DIGEST_SIZE) != 0)) {
+            printf("verify: data read back from %s doesn't match\n",
+                   ctx->device);
+            ret = -1;
         }
     }
 
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
+    if (close(ctx->fd) != 0 && ret == 0) {
+        printf("Error closing %s: %s\n", ctx->device, strerror(errno));
+        ret = -1;
+    }
+    pthread_cond_destroy(&ctx->cv);
+    pthread_mutex_destroy(&ctx->mu);
+    munmap(ctx->buffer, ctx->chunks * MMC_COPY_CHUNK);
+    free(ctx->device);
+    free(ctx);
     return ret;
-
 }
 
-// TODO: refactor this to not be a giant copy paste mess
-int
-mmc_raw_dump (const MmcPartition *partition, char *out_file) {
-    return mmc_raw_dump_internal(partition->device_index, out_file);
-}
+typedef struct {
+    int fd;
+    unsigned char *buf[2];
+    ssize_t len[2];         // bytes in each buffer; 0 at EOF, -1 on error
+    int full[2];
+    int err;                // errno of a failed read
+    int stop;               // set by the writer if it gives up
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} MmcCopyReader;
+
+static void *
+copy_reader (void *cookie) {
+    MmcCopyReader *r = (MmcCopyReader *) cookie;
+    int slot = 0;
+    ssize_t n;
+
+    do {
+        pthread_mutex_lock(&r->mu);
+        while (r->full[slot] && !r->stop)
+            pthread_cond_wait(&r->cv, &r->mu);
+        pthread_mutex_unlock(&r->mu);
+        if (r->stop)
+            break;
 
+        n = read_full(r->fd, r->buf[slot], MMC_COPY_CHUNK);
+
+        pthread_mutex_lock(&r->mu);
+        if (n < 0)
+            r->err = errno;
+        r->len[slot] = n;
+        r->full[slot] = 1;
+        pthread_cond_broadcast(&r->cv);
+        pthread_mutex_unlock(&r->mu);
+        slot ^= 1;
+    } while (n == MMC_COPY_CHUNK);
+    return NULL;
+}
 
 int
-mmc_raw_read (const MmcPartition *partition, char *data, int data_size) {
-    int ch;
-    FILE *in;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
+mmc_raw_copy_file (const char *in_file, const char *out_file, int flags) {
+    MmcCopyReader r;
+    MmcFlashContext *out;
+    pthread_t reader;
+    unsigned char *bufs;
+    int slot = 0;
     int ret = -1;
-    char *in_file = partition->device_index;
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+    memset(&r, 0, sizeof(r));
+    r.fd = open_raw(in_file, O_RDONLY, flags & MMC_COPY_DIRECT_IN);
+    if (r.fd < 0) {
+        printf("Can't open %s: %s\n", in_file, strerror(errno));
+        return -1;
+    }
+    bufs = alloc_chunks(2);
+    if (bufs == NULL) {
+        close(r.fd);
+        return -1;
+    }
+    out = mmc_flash_open(out_file, flags);
+    if (out == NULL) {
+        munmap(bufs, 2 * MMC_COPY_CHUNK);
+        close(r.fd);
+        return -1;
+    }
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+    r.buf[0] = bufs;
+    r.buf[1] = bufs + MMC_COPY_CHUNK;
+    pthread_mutex_init(&r.mu, NULL);
+    pthread_cond_init(&r.cv, NULL);
+    if (pthread_create(&reader, NULL, copy_reader, &r) != 0) {
+        printf("Can't start copy thread\n");
+        goto done;
+    }
 
-    fread(data, data_size, 1, in);
+    for (;;) {
+        ssize_t n;
 
-    ret = 0;
-ERROR1:
-ERROR2:
-    fclose ( in );
-ERROR3:
+        pthread_mutex_lock(&r.mu);
+        while (!r.full[slot])
+            pthread_cond_wait(&r.cv, &r.mu);
+        n = r.len[slot];
+        pthread_mutex_unlock(&r.mu);
+
+        if (n < 0) {
+            printf("Error reading %s: %s\n", in_file, strerror(r.err));
+            break;
+        }
+        if (n > 0 && mmc_flash_write(out, r.buf[slot], n) != 0)
+            break;
+
+        pthread_mutex_lock(&r.mu);
+        r.full[slot] = 0;
+        pthread_cond_broadcast(&r.cv);
+        pthread_mutex_unlock(&r.mu);
+        slot ^= 1;
+
+        if (n < MMC_COPY_CHUNK) {
+            ret = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&r.mu);
+    r.stop = 1;
+    pthread_cond_broadcast(&r.cv);
+    pthread_mutex_unlock(&r.mu);
+    pthread_join(reader, NULL);
+
+done:
+    // Closing flushes, syncs and verifies, so it decides the result.
+    if (ret != 0)
+        out->error = 1;
+    ret = mmc_flash_close(out, NULL, NULL);
+    pthread_cond_destroy(&r.cv);
+    pthread_mutex_destroy(&r.mu);
+    munmap(bufs, 2 * MMC_COPY_CHUNK);
+    close(r.fd);
     return ret;
+}
 
+int
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    return mmc_raw_copy_file(in_file, partition->device_index,
+                             MMC_COPY_RESTORE);
 }
 
 int
-mmc_raw_write (const MmcPartition *partition, char *data, int data_size) {
-    int ch;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
+mmc_raw_dump (const MmcPartition *partition, char *out_file) {
+    return mmc_raw_copy_file(partition->device_index, out_file,
+                             MMC_COPY_BACKUP);
+}
 
-    out  = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR3;
+int
+mmc_raw_read (const MmcPartition *partition, char *data, int data_size) {
+    int fd = open(partition->device_index, O_RDONLY);
+    ssize_t n;
+
+    if (fd < 0)
+        return -1;
+    n = read_full(fd, (unsigned char *) data, data_size);
+    close(fd);
+    return n == data_size ? 0 : -1;
+}
 
-    fwrite(data, data_size, 1, out);
+int
+mmc_raw_write (const MmcPartition *partition, char *data, int data_size) {
+    int fd = open(partition->device_index, O_WRONLY);
+    int ret;
 
-    ret = 0;
-ERROR1:
-ERROR2:
-    fclose ( out );
-ERROR3:
+    if (fd < 0)
+        return -1;
+    ret = write_full(fd, (const unsigned char *) data, data_size);
+    if (close(fd) != 0)
+        ret = -1;
     return ret;
-
 }
 
 int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
@@ -594,7 +886,7 @@ int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
         return mmc_raw_copy(p, filename);
     }
     else {
-        return mmc_raw_dump_internal(filename, partition);
+        return mmc_raw_copy_file(filename, partition, MMC_COPY_RESTORE);
     }
 }
 
@@ -609,7 +901,7 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
         return mmc_raw_dump(p, filename);
     }
     else {
-        return mmc_raw_dump_internal(partition, filename);
+        return mmc_raw_copy_file(partition, filename, MMC_COPY_BACKUP);
     }
 }
 
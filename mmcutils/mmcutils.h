@@ -30,6 +30,9 @@
 #ifndef MMCUTILS_H_
 #define MMCUTILS_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* Some useful define used to access the MBR/EBR table */
 #if !defined (BLOCK_SIZE)
 #define BLOCK_SIZE                0x200
@@ -82,9 +85,37 @@ int mmc_format_ext3 (MmcPartition *partition);
 int mmc_mount_partition(const MmcPartition *partition, const char *mount_point, \
                         int read_only);
 int mmc_raw_copy (const MmcPartition *partition, char *in_file);
+int mmc_raw_dump (const MmcPartition *partition, char *out_file);
 int mmc_raw_read (const MmcPartition *partition, char *data, int data_size);
 int mmc_raw_write (const MmcPartition *partition, char *data, int data_size);
 
+/* Flags for mmc_raw_copy_file() */
+#define MMC_COPY_DIRECT_IN        0x01  /* read the source with O_DIRECT */
+#define MMC_COPY_DIRECT_OUT       0x02  /* write the destination with O_DIRECT */
+#define MMC_COPY_FSYNC            0x04  /* fsync the destination when done */
+#define MMC_COPY_VERIFY           0x08  /* read the destination back and compare
+                                           its SHA-1 with the data's */
+#define MMC_COPY_SHA256           0x10  /* also keep the data's SHA-256 */
+
+/* Flashing a partition from a file, and backing one up to a file */
+#define MMC_COPY_RESTORE          (MMC_COPY_DIRECT_OUT | MMC_COPY_VERIFY)
+#define MMC_COPY_BACKUP           (MMC_COPY_DIRECT_IN | MMC_COPY_FSYNC)
+
+/* Copy all of in_file to out_file; returns 0 on success */
+int mmc_raw_copy_file (const char *in_file, const char *out_file, int flags);
+
+/*
+ * Flash a partition (or write a file) from data passed in pieces of any
+ * size.  flags are MMC_COPY_DIRECT_OUT, MMC_COPY_FSYNC, MMC_COPY_VERIFY
+ * and MMC_COPY_SHA256.  mmc_flash_close() returns 0 if everything was
+ * written (and verified); it also gives the SHA-1 and, if asked for,
+ * the SHA-256 of the data.  Either digest pointer may be NULL.
+ */
+typedef struct MmcFlashContext MmcFlashContext;
+MmcFlashContext *mmc_flash_open (const char *device, int flags);
+int mmc_flash_write (MmcFlashContext *ctx, const void *data, size_t len);
+int mmc_flash_close (MmcFlashContext *ctx, uint8_t *sha1, uint8_t *sha256);
+
 int format_ext2_device(const char *device);
 int format_ext3_device(const char *device);
 
@@ -19,6 +19,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
@@ -30,6 +32,21 @@ static MountsState g_mounts_state = {
     0       // volume_count
 };
 
+/* The table is only re-read when it may have changed: the kernel flags
+ * an open /proc/self/mounts with POLLPRI|POLLERR whenever anything in
+ * the namespace is mounted or unmounted (by us, vold or a shell), and
+ * invalidate_mounted_volumes() covers the time before the fd is open.
+ */
+static int g_mounts_fd = -1;
+static int g_mounts_valid = 0;
+
+/* Open-addressed hashes of indices into g_mounts_state.volumes, keyed
+ * by mount point and by device.  -1 marks an empty slot.
+ */
+static int *g_by_mount_point = NULL;
+static int *g_by_device = NULL;
+static unsigned int g_hash_size = 0;     /* a power of two */
+
 static inline void
 free_volume_internals(const MountedVolume *volume, int zero)
 {
@@ -42,16 +59,150 @@ free_volume_internals(const MountedVolume *volume, int zero)
     }
 }
 
-#define PROC_MOUNTS_FILENAME   "/proc/mounts"
+#define PROC_MOUNTS_FILENAME   "/proc/self/mounts"
+
+static unsigned int
+hash_string(const char *s)
+{
+    unsigned int h = 5381;
+    while (*s != '\0') {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+static const char *
+volume_key(const MountedVolume *v, int by_device)
+{
+    return by_device ? v->device : v->mount_point;
+}
+
+static void
+hash_insert(int *table, int by_device, int index)
+{
+    const char *key = volume_key(&g_mounts_state.volumes[index], by_device);
+    unsigned int i = hash_string(key) & (g_hash_size - 1);
+    while (table[i] >= 0) {
+        /* Keep the first entry, as the old linear search did. */
+        const MountedVolume *v = &g_mounts_state.volumes[table[i]];
+        if (strcmp(volume_key(v, by_device), key) == 0) {
+            return;
+        }
+        i = (i + 1) & (g_hash_size - 1);
+    }
+    table[i] = index;
+}
+
+static const MountedVolume *
+hash_find(const int *table, int by_device, const char *key)
+{
+    unsigned int i = hash_string(key) & (g_hash_size - 1);
+    for (; table[i] >= 0; i = (i + 1) & (g_hash_size - 1)) {
+        const MountedVolume *v = &g_mounts_state.volumes[table[i]];
+        const char *k = volume_key(v, by_device);
+        /* May be null if it was unmounted and we haven't rescanned.
+         */
+        if (k != NULL && strcmp(k, key) == 0) {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+static void
+build_hashes(void)
+{
+    unsigned int size = 16;
+    int i;
+
+    while (size < (unsigned int)g_mounts_state.volume_count * 2) {
+        size *= 2;
+    }
+    if (size != g_hash_size) {
+        int *a = realloc(g_by_mount_point, size * sizeof(int));
+        int *b = realloc(g_by_device, size * sizeof(int));
+        if (a != NULL) g_by_mount_point = a;
+        if (b != NULL) g_by_device = b;
+        if (a == NULL || b == NULL) {
+            /* Lookups fall back to a linear search. */
+            g_hash_size = 0;
+            return;
+        }
+        g_hash_size = size;
+    }
+    memset(g_by_mount_point, 0xff, size * sizeof(int));
+    memset(g_by_device, 0xff, size * sizeof(int));
+    for (i = 0; i < g_mounts_state.volume_count; i++) {
+        hash_insert(g_by_mount_point, 0, i);
+        hash_insert(g_by_device, 1, i);
+    }
+}
+
+/* Read all of the (already open) mounts file into a malloc()ed,
+ * NUL-terminated buffer.
+ */
+static char *
+read_mounts(int fd, ssize_t *length)
+{
+    size_t size = 4096;
+    size_t used = 0;
+    char *buf = NULL;
+
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        return NULL;
+    }
+    for (;;) {
+        if (buf == NULL || used + 1 >= size) {
+            char *nbuf = realloc(buf, buf == NULL ? size : size * 2);
+            if (nbuf == NULL) {
+                free(buf);
+                errno = ENOMEM;
+                return NULL;
+            }
+            if (buf != NULL) size *= 2;
+            buf = nbuf;
+        }
+        ssize_t n = read(fd, buf + used, size - used - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) break;
+        used += n;
+    }
+    buf[used] = '\0';
+    *length = used;
+    return buf;
+}
+
+void
+invalidate_mounted_volumes()
+{
+    g_mounts_valid = 0;
+}
 
 int
 scan_mounted_volumes()
 {
-    char buf[2048];
+    char *buf;
     const char *bufp;
-    int fd;
     ssize_t nbytes;
 
+    if (g_mounts_fd < 0) {
+        g_mounts_fd = open(PROC_MOUNTS_FILENAME, O_RDONLY | O_CLOEXEC);
+        g_mounts_valid = 0;
+    }
+    if (g_mounts_fd >= 0) {
+        /* Polling also clears the notification, so do it even when the
+         * table is going to be re-read anyway.
+         */
+        struct pollfd pfd = { g_mounts_fd, POLLPRI, 0 };
+        if (poll(&pfd, 1, 0) == 0 && g_mounts_valid) {
+            return 0;
+        }
+    }
+
     if (g_mounts_state.volumes == NULL) {
         const int numv = 32;
         MountedVolume *volumes = malloc(numv * sizeof(*volumes));
@@ -71,19 +222,18 @@ scan_mounted_volumes()
         }
     }
     g_mounts_state.volume_count = 0;
+    g_mounts_valid = 0;
 
-    /* Open and read the file contents.
+    /* Read the file contents.  Anything mounted from here on raises a
+     * new notification, so it is picked up next time.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
+    if (g_mounts_fd < 0) {
         goto bail;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
+    buf = read_mounts(g_mounts_fd, &nbytes);
+    if (buf == NULL) {
         goto bail;
     }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -112,6 +262,21 @@ scan_mounted_volumes()
         matches = sscanf(bufp, "%63s %63s %63s %127s",
                 device, mount_point, filesystem, flags);
 
+        if (matches == 4 &&
+                g_mounts_state.volume_count == g_mounts_state.volumes_allocd) {
+            int numv = g_mounts_state.volumes_allocd * 2;
+            MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                    numv * sizeof(*volumes));
+            if (volumes == NULL) {
+                free(buf);
+                errno = ENOMEM;
+                goto bail;
+            }
+            memset(volumes + g_mounts_state.volumes_allocd, 0,
+                    (numv - g_mounts_state.volumes_allocd) * sizeof(*volumes));
+            g_mounts_state.volumes = volumes;
+            g_mounts_state.volumes_allocd = numv;
+        }
         if (matches == 4) {
             device[sizeof(device)-1] = '\0';
             mount_point[sizeof(mount_point)-1] = '\0';
@@ -139,7 +304,10 @@ printf("matches was %d on <<%.40s>>\n", matches, bufp);
             nbytes--;
         }
     }
+    free(buf);
 
+    build_hashes();
+    g_mounts_valid = 1;
     return 0;
 
 bail:
@@ -151,6 +319,9 @@ bail:
 const MountedVolume *
 find_mounted_volume_by_device(const char *device)
 {
+    if (g_mounts_valid && g_hash_size != 0) {
+        return hash_find(g_by_device, 1, device);
+    }
     if (g_mounts_state.volumes != NULL) {
         int i;
         for (i = 0; i < g_mounts_state.volume_count; i++) {
@@ -170,6 +341,9 @@ find_mounted_volume_by_device(const char *device)
 const MountedVolume *
 find_mounted_volume_by_mount_point(const char *mount_point)
 {
+    if (g_mounts_valid && g_hash_size != 0) {
+        return hash_find(g_by_mount_point, 0, mount_point);
+    }
     if (g_mounts_state.volumes != NULL) {
         int i;
         for (i = 0; i < g_mounts_state.volume_count; i++) {
@@ -195,6 +369,7 @@ unmount_mounted_volume(const MountedVolume *volume)
      */
     int ret = umount(volume->mount_point);
     if (ret == 0) {
+        g_mounts_valid = 0;
         free_volume_internals(volume, 1);
         return 0;
     }
@@ -204,6 +379,7 @@ unmount_mounted_volume(const MountedVolume *volume)
 int
 remount_read_only(const MountedVolume* volume)
 {
+    g_mounts_valid = 0;
     return mount(volume->device, volume->mount_point, volume->filesystem,
                  MS_NOATIME | MS_NODEV | MS_NODIRATIME |
                  MS_RDONLY | MS_REMOUNT, 0);
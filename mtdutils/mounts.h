@@ -32,8 +32,16 @@ typedef struct {
     int volume_count;
 } MountsState;
 
+/* Refresh the table of mounted volumes.  This is cheap when nothing
+ * has been mounted or unmounted since the last call.
+ */
 int scan_mounted_volumes(void);
 
+/* Make the next scan_mounted_volumes() re-read the table even if no
+ * change has been reported yet.
+ */
+void invalidate_mounted_volumes(void);
+
 const MountedVolume *find_mounted_volume_by_device(const char *device);
 
 const MountedVolume *
@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
@@ -38,14 +39,31 @@ struct MtdReadContext {
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
+    char *verify;  // read-back buffer, one erase block
     size_t stored;
     int fd;
 
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    // Erase-ahead (see mtd_write_erase_ahead()).  Blocks before
+    // erased_to have been erased by the eraser thread, except those
+    // marked in erase_failed.
+    int erase_ahead;
+    pthread_t eraser;
+    pthread_mutex_t erase_mu;
+    pthread_cond_t erase_cv;
+    off_t erase_start;
+    off_t write_pos;
+    off_t erased_to;
+    unsigned char *erase_failed;
+    int erase_stop;
 };
 
+#define BITMAP_GET(map, i)  (((map)[(i) >> 3] >> ((i) & 7)) & 1)
+#define BITMAP_SET(map, i)  ((map)[(i) >> 3] |= 1 << ((i) & 7))
+
 typedef struct {
     MtdPartition *partitions;
     int partitions_allocd;
@@ -134,6 +152,12 @@ mtd_scan_partitions()
          */
         if (matches == 4) {
             MtdPartition *p = &g_mtd_state.partitions[mtdnum];
+            if (p->bad_block_map != NULL &&
+                (p->size != (unsigned) mtdsize ||
+                 p->erase_size != (unsigned) mtderasesize)) {
+                free(p->bad_block_map);
+                p->bad_block_map = NULL;
+            }
             p->device_index = mtdnum;
             p->size = mtdsize;
             p->erase_size = mtderasesize;
@@ -359,17 +383,55 @@ void mtd_read_close(MtdReadContext *ctx)
     free(ctx);
 }
 
+/* The bad blocks of a partition, one bit per erase block.  Asking the
+ * driver about each block costs an ioctl (and, on some chips, a read
+ * of the spare area), so the map is built the first time a partition
+ * is written and kept across rescans.  Callers only hold const
+ * pointers, so the map is stored through g_mtd_state, which owns the
+ * partitions.
+ */
+static const unsigned char *get_bad_block_map(const MtdPartition *ptn,
+                                              int fd)
+{
+    if (g_mtd_state.partitions == NULL ||
+        ptn < g_mtd_state.partitions ||
+        ptn >= g_mtd_state.partitions + g_mtd_state.partitions_allocd) {
+        return NULL;
+    }
+    MtdPartition *partition = &g_mtd_state.partitions[ptn - g_mtd_state.partitions];
+    if (partition->bad_block_map == NULL) {
+        unsigned blocks = partition->size / partition->erase_size;
+        unsigned char *map = calloc(blocks / 8 + 1, 1);
+        unsigned i;
+        if (map == NULL) return NULL;
+        for (i = 0; i < blocks; ++i) {
+            loff_t bpos = (loff_t) i * partition->erase_size;
+            int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+            if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+                BITMAP_SET(map, i);
+            }
+        }
+        partition->bad_block_map = map;
+    }
+    return partition->bad_block_map;
+}
+
+static int is_bad_block(const MtdWriteContext *ctx, off_t pos)
+{
+    return BITMAP_GET(ctx->partition->bad_block_map,
+                      pos / ctx->partition->erase_size);
+}
+
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
-    MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
+    MtdWriteContext *ctx = (MtdWriteContext*) calloc(1, sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
-
     ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
+    ctx->verify = malloc(partition->erase_size);
+    if (ctx->buffer == NULL || ctx->verify == NULL) {
+        free(ctx->buffer);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
@@ -377,8 +439,11 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     char mtddevname[32];
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
     ctx->fd = open(mtddevname, O_RDWR);
-    if (ctx->fd < 0) {
+    if (ctx->fd < 0 ||
+        get_bad_block_map(partition, ctx->fd) == NULL) {
+        if (ctx->fd >= 0) close(ctx->fd);
         free(ctx->buffer);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
@@ -397,6 +462,106 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
+static void *erase_ahead_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) cookie;
+    const off_t size = ctx->partition->erase_size;
+    off_t pos;
+
+    pthread_mutex_lock(&ctx->erase_mu);
+    pos = ctx->erased_to;
+    for (;;) {
+        while (!ctx->erase_stop &&
+               pos >= ctx->write_pos + ctx->erase_ahead * size) {
+            pthread_cond_wait(&ctx->erase_cv, &ctx->erase_mu);
+        }
+        if (ctx->erase_stop || pos + size > ctx->partition->size) break;
+        pthread_mutex_unlock(&ctx->erase_mu);
+
+        int failed = 0;
+        if (!is_bad_block(ctx, pos)) {
+            struct erase_info_user erase_info;
+            erase_info.start = pos;
+            erase_info.length = size;
+            failed = ioctl(ctx->fd, MEMERASE, &erase_info) < 0;
+        }
+
+        pthread_mutex_lock(&ctx->erase_mu);
+        if (failed) BITMAP_SET(ctx->erase_failed, pos / size);
+        pos += size;
+        ctx->erased_to = pos;
+        pthread_cond_broadcast(&ctx->erase_cv);
+    }
+    // Let a waiting writer see that nothing more is coming.
+    ctx->erase_stop = 1;
+    pthread_cond_broadcast(&ctx->erase_cv);
+    pthread_mutex_unlock(&ctx->erase_mu);
+    return NULL;
+}
+
+int mtd_write_erase_ahead(MtdWriteContext *ctx, int blocks)
+{
+    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
+    if (pos == (off_t) -1 || blocks <= 0 || ctx->erase_ahead > 0) return -1;
+
+    unsigned count = ctx->partition->size / ctx->partition->erase_size;
+    ctx->erase_failed = calloc(count / 8 + 1, 1);
+    if (ctx->erase_failed == NULL) return -1;
+
+    // Start from the block the next write goes to.
+    pos -= pos % ctx->partition->erase_size;
+    if (ctx->stored > 0) pos += ctx->partition->erase_size;
+    ctx->erase_start = ctx->write_pos = ctx->erased_to = pos;
+    ctx->erase_stop = 0;
+    ctx->erase_ahead = blocks;
+    pthread_mutex_init(&ctx->erase_mu, NULL);
+    pthread_cond_init(&ctx->erase_cv, NULL);
+    if (pthread_create(&ctx->eraser, NULL, erase_ahead_thread, ctx) != 0) {
+        pthread_cond_destroy(&ctx->erase_cv);
+        pthread_mutex_destroy(&ctx->erase_mu);
+        free(ctx->erase_failed);
+        ctx->erase_failed = NULL;
+        ctx->erase_ahead = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_erase_ahead(MtdWriteContext *ctx)
+{
+    if (ctx->erase_ahead == 0) return;
+    pthread_mutex_lock(&ctx->erase_mu);
+    ctx->erase_stop = 1;
+    pthread_cond_broadcast(&ctx->erase_cv);
+    pthread_mutex_unlock(&ctx->erase_mu);
+    pthread_join(ctx->eraser, NULL);
+    pthread_cond_destroy(&ctx->erase_cv);
+    pthread_mutex_destroy(&ctx->erase_mu);
+    ctx->erase_ahead = 0;
+}
+
+/* Tell the eraser the writer has reached pos, and wait for it to erase
+ * that block.  Returns 1 if the block has been erased, 0 if the writer
+ * has to do it itself.
+ */
+static int wait_for_erase(MtdWriteContext *ctx, off_t pos)
+{
+    const off_t size = ctx->partition->erase_size;
+    int erased;
+
+    if (ctx->erase_ahead == 0) return 0;
+    pthread_mutex_lock(&ctx->erase_mu);
+    ctx->write_pos = pos;
+    pthread_cond_broadcast(&ctx->erase_cv);
+    while (ctx->erased_to <= pos && !ctx->erase_stop) {
+        pthread_cond_wait(&ctx->erase_cv, &ctx->erase_mu);
+    }
+    erased = pos >= ctx->erase_start && pos < ctx->erased_to &&
+             !BITMAP_GET(ctx->erase_failed, pos / size);
+    pthread_mutex_unlock(&ctx->erase_mu);
+    return erased;
+}
+
 static int write_block(MtdWriteContext *ctx, const char *data)
 {
     const MtdPartition *partition = ctx->partition;
@@ -406,19 +571,12 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
-
-    char *verify = malloc(size);
-    if (verify == NULL)
-        return 1;
+    char *verify = ctx->verify;
 
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+        if (is_bad_block(ctx, pos)) {
             add_bad_block_offset(ctx, pos);
-            fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
-                    pos, ret, errno);
+            fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
@@ -426,12 +584,15 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
+        int erased = wait_for_erase(ctx, pos);
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
-                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
+            if (retry > 0 || !erased) {
+                if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+                    fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+                            pos, strerror(errno));
+                    continue;
+                }
             }
             if (lseek(fd, pos, SEEK_SET) != pos ||
                 write(fd, data, size) != size) {
@@ -455,7 +616,6 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                 fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
             }
             fprintf(stderr, "mtd: successfully wrote block at %llx\n", pos);
-            free(verify);
             return 0;  // Success!
         }
 
@@ -466,8 +626,6 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         pos += partition->erase_size;
     }
 
-    free(verify);
-
     // Ran out of space on the device
     errno = ENOSPC;
     return -1;
@@ -508,9 +666,13 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
     if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
         memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
+        if (write_block(ctx, ctx->buffer)) {
+            stop_erase_ahead(ctx);
+            return -1;
+        }
         ctx->stored = 0;
     }
+    stop_erase_ahead(ctx);
 
     off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
@@ -524,12 +686,17 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (is_bad_block(ctx, pos)) {
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
+        if (ctx->erase_failed != NULL &&
+            pos >= ctx->erase_start && pos < ctx->erased_to &&
+            !BITMAP_GET(ctx->erase_failed, pos / ctx->partition->erase_size)) {
+            pos += ctx->partition->erase_size;
+            continue;  // Already erased ahead of the writer.
+        }
 
         struct erase_info_user erase_info;
         erase_info.start = pos;
@@ -548,9 +715,13 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+    // The eraser must be gone before its fd is.
+    stop_erase_ahead(ctx);
     if (close(ctx->fd)) r = -1;
     free(ctx->bad_block_offsets);
     free(ctx->buffer);
+    free(ctx->verify);
+    free(ctx->erase_failed);
     free(ctx);
     return r;
 }
@@ -610,6 +781,8 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
         printf("error writing %s", partition_name);
         return -1;
     }
+    // The rest of the partition is erased once the image is written.
+    mtd_write_erase_ahead(ctx, MTD_ERASE_AHEAD_BLOCKS);
 
     int success = 1;
     char* buffer = malloc(BUFSIZ);
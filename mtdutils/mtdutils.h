@@ -53,11 +53,20 @@ off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
 
+/* erase up to 'blocks' erase blocks ahead of the writer, on another
+ * thread.  blocks past the end of the data may be erased too, so this
+ * is only for callers that go on to mtd_erase_blocks(ctx, -1).
+ */
+int mtd_write_erase_ahead(MtdWriteContext *, int blocks);
+
+#define MTD_ERASE_AHEAD_BLOCKS 8
+
 struct MtdPartition {
     int device_index;
     unsigned int size;
     unsigned int erase_size;
     char *name;
+    unsigned char *bad_block_map;  /* cached by mtd_write_partition() */
 };
 
 #endif  // MTDUTILS_H_
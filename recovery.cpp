@@ -594,8 +594,8 @@ static intentResult* intent_wipe(int argc, char *argv[])
     {
         ensure_path_mounted("/data");
         ensure_path_mounted("/cache");
-        __system("rm -r /data/dalvik-cache");
-        __system("rm -r /cache/dalvik-cache");
+        dirUnlinkHierarchyParallel("/data/dalvik-cache");
+        dirUnlinkHierarchyParallel("/cache/dalvik-cache");
         result = 0;
     }
     else
@@ -625,13 +625,18 @@ static intentResult * intent_reboot(int argc, char *argv[])
     return miuiIntent_result_set(0, NULL);
 }
 //INTENT_INSTALL install path, wipe_cache, install_file
+//path may be a newline-separated list of packages to install in turn
 static intentResult* intent_install(int argc, char *argv[])
 {
+    static char *install_paths = NULL;
     return_intent_result_if_fail(argc == 1);
     return_intent_result_if_fail(argv != NULL);
     //int wipe_cache = atoi(argv[1]);
     //int echo = atoi(argv[2]);
-    miuiInstall_init(&install_package, argv[0]);
+    //the installer runs later, keep our own copy of the path(s)
+    free(install_paths);
+    install_paths = strdup(argv[0]);
+    miuiInstall_init(&install_package_list, install_paths);
     //miui_install(echo);
     //echo install failed
     return miuiIntent_result_set(RET_OK, NULL);
@@ -347,8 +347,17 @@ int root_device::check_for_script_file(const char* ors_boot_script)
     }
     return ret_val;
 }
+//hand a batch of queued install lines to the installer
+static void ors_flush_installs(string &install_queue) {
+    if (install_queue.empty())
+        return;
+    miuiIntent_send(INTENT_INSTALL, 1, (char*)install_queue.c_str());
+    install_queue.clear();
+}
 //run ors script code
 //this can start on boot or manually for custom ors
+//consecutive install lines are installed as one batch: while one zip
+//installs the next is verified and opened, and a failure skips the rest
 int root_device::run_ors_script(const char* ors_script) {
     FILE *fp = fopen(ors_script, "r");
     int ret_val = 0, cindex, line_len, i, remove_nl;
@@ -356,6 +365,7 @@ int root_device::run_ors_script(const char* ors_script) {
          value[SCRIPT_COMMAND_SIZE], mount[SCRIPT_COMMAND_SIZE],
          value1[SCRIPT_COMMAND_SIZE], value2[SCRIPT_COMMAND_SIZE];
     char *val_start, *tok;
+    string install_queue;
    /*
     int ors_system = 0;
     int ors_data = 0;
@@ -405,10 +415,14 @@ int root_device::run_ors_script(const char* ors_script) {
                 strncpy(command, script_line, line_len - remove_nl + 1);
                 ui_print("command is: '%s' and there is no value\n", command);
             }
+            if (strcmp(command, "install") != 0)
+                ors_flush_installs(install_queue);
             if (strcmp(command, "install") == 0) {
-                // Install zip
+                // Install zip, batched with any install lines that follow
                 if (cindex != 0) {
-                miuiIntent_send(INTENT_INSTALL, 3, value, "0", "1");
+                    if (!install_queue.empty())
+                        install_queue += "\n";
+                    install_queue += value;
 		} else {
 			//not input zip file
 		} 
@@ -552,6 +566,9 @@ int root_device::run_ors_script(const char* ors_script) {
                 ret_val = 1;
             }
         }
+        // Installs queued before a failing line still run, as they
+        // did when each install line ran on its own.
+        ors_flush_installs(install_queue);
         fclose(fp);
         ui_print("Done processing script file\n");
     } else {
@@ -15,7 +15,10 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -32,6 +35,7 @@ extern "C" {
 #include "mmcutils/mmcutils.h"
 #include "libcrecovery/common.h"
 #include "make_ext4fs.h"
+#include "minzip/DirUtil.h"
 }
 
 //#include "voldclient/voldclient.h"
@@ -286,6 +290,7 @@ int ensure_path_mounted_at_mount_point(const char* path, const char* mount_point
     }
 
     mkdir(mount_point, 0755);  // in case it doesn't already exist
+    invalidate_mounted_volumes();
 
     if (fs_mgr_is_voldmanaged(v)) {
         return (VoldClient::vold_mount_volume(mount_point, 1) == ResponseCode::CommandOkay ? 0 : -1);
@@ -354,6 +359,7 @@ int ensure_path_unmounted(const char* path) {
         return 0;
     }
 
+    invalidate_mounted_volumes();
      if (fs_mgr_is_voldmanaged(volume_for_path(v->mount_point)))
         return (VoldClient::vold_unmount_volume(v->mount_point, 0, 1) == ResponseCode::CommandOkay ? 0 : -1);
 
@@ -361,6 +367,41 @@ int ensure_path_unmounted(const char* path) {
 }
 
 
+// Tell the device that everything the new filesystem will cover is
+// free, so the controller doesn't keep copying the old data around.
+// 'length' is as in the fstab: 0 means the whole device, a negative
+// value leaves that many bytes at the end (e.g. a crypto footer) alone.
+// Failure is not fatal; formatting just goes ahead without it.
+static void discard_block_device(const char* device, long long length) {
+    int fd = open(device, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGW("discard: can't open %s: %s\n", device, strerror(errno));
+        return;
+    }
+
+    uint64_t size;
+    if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+        LOGW("discard: can't get size of %s: %s\n", device, strerror(errno));
+        close(fd);
+        return;
+    }
+    if (length > 0 && (uint64_t)length < size) {
+        size = length;
+    } else if (length < 0) {
+        size = ((uint64_t)-length < size) ? size + length : 0;
+    }
+
+    uint64_t range[2] = { 0, size };
+    if (size > 0 && ioctl(fd, BLKDISCARD, &range) < 0) {
+        if (errno == EOPNOTSUPP) {
+            LOGI("%s doesn't support discard\n", device);
+        } else {
+            LOGW("discard: failed on %s: %s\n", device, strerror(errno));
+        }
+    }
+    close(fd);
+}
+
 int format_volume(const char* volume) {
     if (is_data_media_volume_path(volume)) {
         return format_unknown_device(NULL, volume, NULL);
@@ -438,6 +479,7 @@ int format_volume(const char* volume) {
     }
 
     if (strcmp(v->fs_type, "ext4") == 0) {
+        discard_block_device(v->blk_device, v->length);
         int result = make_ext4fs(v->blk_device, v->length, volume, handle );
         if (result != 0) {
             LOGE("format_volume: make_extf4fs failed on %s\n", v->blk_device);
@@ -561,7 +603,7 @@ int format_device(const char *device, const char *path, const char *fs_type) {
     if (strcmp(fs_type, "ext4") == 0) {
         int length = 0;
         if (strcmp(v->fs_type, "ext4") == 0) {
-            
+            discard_block_device(v->blk_device, v->length);
        int result = make_ext4fs(v->blk_device, v->length, path, handle);
         if (result != 0) {
             LOGE("format_volume: make_extf4fs failed on %s\n", v->blk_device);
@@ -573,6 +615,7 @@ int format_device(const char *device, const char *path, const char *fs_type) {
 
 #ifdef USE_F2FS
     if (strcmp(v->fs_type, "f2fs") == 0) {
+        discard_block_device(v->blk_device, v->length);
         int result = make_f2fs_main(v->blk_device, v->mount_point);
         if (result != 0) {
             LOGE("format_volume: mkfs.f2f2 failed on %s\n", v->blk_device);
@@ -625,6 +668,7 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
                 LOGE("Error while unmounting %s.\n", path);
                 return -12;
             }
+            discard_block_device(device, 0);
             return format_ext3_device(device);
         }
 
@@ -634,6 +678,7 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
                 LOGE("Error while unmounting %s.\n", path);
                 return -12;
             }
+            discard_block_device(device, 0);
             return format_ext2_device(device);
         }
     }
@@ -645,16 +690,12 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
         return 0;
     }
 
-    static char tmp[PATH_MAX];
-    if (strcmp(path, "/data") == 0) {
-        sprintf(tmp, "cd /data ; for f in $(ls -a | grep -v ^[media|share]$); do rm -rf $f; done");
-        __system(tmp);
-    }
-    else {
-        sprintf(tmp, "rm -rf %s/*", path);
-        __system(tmp);
-        sprintf(tmp, "rm -rf %s/.*", path);
-        __system(tmp);
+    // /data keeps the internal storage that lives in /data/media.
+    static const char* const data_keep[] = { "media", "share", NULL };
+    if (dirUnlinkChildren(path, strcmp(path, "/data") == 0 ? data_keep : NULL) != 0) {
+        LOGE("couldn't remove everything in %s: %s\n", path, strerror(errno));
+        ensure_path_unmounted(path);
+        return -1;
     }
 
     ensure_path_unmounted(path);
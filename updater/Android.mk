@@ -5,6 +5,7 @@ LOCAL_PATH := $(call my-dir)
 updater_src_files := \
     mounts.c \
 	install.c \
+	blockimg.c \
 	updater.c
 
 #
@@ -32,6 +33,9 @@ LOCAL_STATIC_LIBRARIES += libflashutils_static  libmmcutils_static libbmlutils_s
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
 LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils_static libminzip libz
 LOCAL_STATIC_LIBRARIES += libmincrypt libbz
+ifeq ($(APPLYPATCH_BROTLI),true)
+LOCAL_STATIC_LIBRARIES += libbrotli
+endif
 LOCAL_STATIC_LIBRARIES += libminelf_static
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
 LOCAL_STATIC_LIBRARIES += libselinux
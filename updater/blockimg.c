@@ -0,0 +1,1231 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// block_image_update(partition, transfer_list, new_data, patch_data)
+//
+// Applies a block-based update to a raw partition.  transfer_list is
+// the contents of the transfer list (usually package_extract_file of
+// "system.transfer.list"); new_data and patch_data are the names of
+// package entries holding the new blocks and the concatenated patches.
+//
+// The transfer list (version 3) is:
+//
+//    3
+//    <total blocks written>
+//    <max simultaneous stash entries>
+//    <max simultaneous stashed blocks>
+//    <command>
+//    ...
+//
+// where a range set is written "<n>,<start>,<end>,..." with n numbers
+// following, each pair a half-open range of 4096-byte blocks, and the
+// commands are:
+//
+//    erase <range>                  discard the blocks
+//    zero <range>                   fill the blocks with zeros
+//    new <range>                    fill the blocks from new_data, in order
+//    stash <id> <range>             save the blocks in /cache as <id>
+//    free <id>                      drop a stash
+//    move <hash> <tgt_range> <src>
+//    bsdiff <off> <len> <src_hash> <tgt_hash> <tgt_range> <src>
+//    imgdiff <off> <len> <src_hash> <tgt_hash> <tgt_range> <src>
+//
+// A stash id is the SHA-1 of the stashed blocks.  <src> describes the
+// source buffer:
+//
+//    <blocks> <src_range>
+//    <blocks> - <id>:<buffer_range> ...
+//    <blocks> <src_range> <buffer_range> <id>:<buffer_range> ...
+//
+// i.e. source blocks read from the partition and/or stashes, each
+// placed at the given block positions of the buffer.
+//
+// An interrupted update can be run again.  Commands before the last
+// checkpoint are skipped, and a move or diff whose source no longer
+// matches is skipped if its target already has the expected contents.
+// Sources that overlap their own target are stashed before the target
+// is written, so a move cut off half-way can still be finished.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include "applypatch/applypatch.h"
+#include "blockimg.h"
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+#include "minzip/DirUtil.h"
+#include "updater.h"
+
+#define BLOCKSIZE 4096
+
+// Stashes and the checkpoint live in STASH_DIRECTORY_BASE/<sha1 of
+// the partition name>.
+#define STASH_DIRECTORY_BASE "/cache/recovery"
+#define STASH_DIRECTORY_MODE 0700
+#define STASH_FILE_MODE 0600
+#define CHECKPOINT_NAME "checkpoint"
+
+// Sync the partition and record progress after this many blocks.
+#define CHECKPOINT_INTERVAL_BLOCKS 8192
+
+typedef struct {
+    int count;      // number of ranges
+    int size;       // total blocks
+    int pos[0];     // count pairs of [start, end)
+} RangeSet;
+
+static RangeSet* parse_range(char* text) {
+    if (text == NULL) return NULL;
+
+    char* save;
+    char* token = strtok_r(text, ",", &save);
+    if (token == NULL) return NULL;
+    long num = strtol(token, NULL, 0);
+    if (num <= 0 || num % 2 != 0 ||
+        (unsigned long)num > (SIZE_MAX - sizeof(RangeSet)) / sizeof(int)) {
+        fprintf(stderr, "bad range set \"%s\"\n", text);
+        return NULL;
+    }
+
+    RangeSet* out = malloc(sizeof(RangeSet) + num * sizeof(int));
+    if (out == NULL) return NULL;
+    out->count = num / 2;
+    out->size = 0;
+
+    int i;
+    for (i = 0; i < num; ++i) {
+        token = strtok_r(NULL, ",", &save);
+        char* end;
+        long v = (token != NULL) ? strtol(token, &end, 0) : -1;
+        if (token == NULL || *end != '\0' || v < 0 || v > 0x7fffffff) {
+            fprintf(stderr, "bad range set \"%s\"\n", text);
+            free(out);
+            return NULL;
+        }
+        out->pos[i] = v;
+        // The ranges must be sorted and disjoint; spread_blocks() and
+        // scatter_blocks() rely on it to stay inside the buffer.
+        if (i > 0 && i % 2 == 0 && out->pos[i] < out->pos[i-1]) {
+            fprintf(stderr, "range starting at %d overlaps or precedes "
+                    "the one ending at %d\n", out->pos[i], out->pos[i-1]);
+            free(out);
+            return NULL;
+        }
+        if (i % 2 == 1) {
+            if (out->pos[i] <= out->pos[i-1]) {
+                fprintf(stderr, "bad range %d-%d\n",
+                        out->pos[i-1], out->pos[i]);
+                free(out);
+                return NULL;
+            }
+            out->size += out->pos[i] - out->pos[i-1];
+        }
+    }
+    return out;
+}
+
+static bool range_overlaps(const RangeSet* a, const RangeSet* b) {
+    int i, j;
+    for (i = 0; i < a->count; ++i) {
+        for (j = 0; j < b->count; ++j) {
+            if (a->pos[i*2] < b->pos[j*2+1] && b->pos[j*2] < a->pos[i*2+1]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int read_all(int fd, uint8_t* data, size_t size, off64_t offset) {
+    while (size > 0) {
+        ssize_t r = pread64(fd, data, size, offset);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "read failed: %s\n", strerror(errno));
+            return -1;
+        }
+        if (r == 0) {
+            fprintf(stderr, "read hit end of partition\n");
+            return -1;
+        }
+        data += r;
+        size -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t* data, size_t size,
+                     off64_t offset) {
+    while (size > 0) {
+        ssize_t w = pwrite64(fd, data, size, offset);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        data += w;
+        size -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+// Read the blocks of rs, in order, into buffer.
+static int read_blocks(int fd, const RangeSet* rs, uint8_t* buffer) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t len = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (read_all(fd, buffer, len, (off64_t)rs->pos[i*2] * BLOCKSIZE) < 0) {
+            return -1;
+        }
+        buffer += len;
+    }
+    return 0;
+}
+
+static int write_blocks(int fd, const RangeSet* rs, const uint8_t* buffer) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t len = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (write_all(fd, buffer, len, (off64_t)rs->pos[i*2] * BLOCKSIZE) < 0) {
+            return -1;
+        }
+        buffer += len;
+    }
+    return 0;
+}
+
+// The first locs->size blocks of buffer are packed; spread them out
+// to the block positions in locs.  Going backwards means nothing is
+// overwritten before it has been moved.
+static void spread_blocks(uint8_t* buffer, const RangeSet* locs) {
+    size_t start = locs->size;
+    int i;
+    for (i = locs->count - 1; i >= 0; --i) {
+        size_t blocks = locs->pos[i*2+1] - locs->pos[i*2];
+        start -= blocks;
+        memmove(buffer + (size_t)locs->pos[i*2] * BLOCKSIZE,
+                buffer + start * BLOCKSIZE, blocks * BLOCKSIZE);
+    }
+}
+
+// Copy packed blocks from src to the block positions in locs.
+static void scatter_blocks(uint8_t* buffer, const RangeSet* locs,
+                           const uint8_t* src) {
+    int i;
+    for (i = 0; i < locs->count; ++i) {
+        size_t len = (size_t)(locs->pos[i*2+1] - locs->pos[i*2]) * BLOCKSIZE;
+        memcpy(buffer + (size_t)locs->pos[i*2] * BLOCKSIZE, src, len);
+        src += len;
+    }
+}
+
+// Writes data sequentially into the blocks of a range set.  With fd
+// < 0 the data is counted but thrown away.
+typedef struct {
+    int fd;
+    const RangeSet* tgt;
+    int p_block;            // current range
+    uint64_t p_remain;      // bytes left in the current range
+    bool failed;
+} RangeSinkState;
+
+static void init_range_sink(RangeSinkState* rss, int fd, const RangeSet* tgt) {
+    rss->fd = fd;
+    rss->tgt = tgt;
+    rss->p_block = 0;
+    rss->p_remain = (uint64_t)(tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
+    rss->failed = false;
+}
+
+static bool range_sink_full(const RangeSinkState* rss) {
+    return rss->p_block >= rss->tgt->count;
+}
+
+// Returns the number of bytes consumed, which is less than size only
+// when the range set is full or a write failed.
+static ssize_t range_sink_write(unsigned char* data, ssize_t size,
+                                void* token) {
+    RangeSinkState* rss = (RangeSinkState*) token;
+    ssize_t written = 0;
+
+    while (size > 0 && !range_sink_full(rss) && !rss->failed) {
+        size_t len = size;
+        if (rss->p_remain < (uint64_t)len) len = rss->p_remain;
+
+        if (rss->fd >= 0) {
+            off64_t offset =
+                (off64_t)rss->tgt->pos[rss->p_block*2+1] * BLOCKSIZE -
+                (off64_t)rss->p_remain;
+            if (write_all(rss->fd, data, len, offset) < 0) {
+                rss->failed = true;
+                break;
+            }
+        }
+        data += len;
+        size -= len;
+        written += len;
+
+        rss->p_remain -= len;
+        if (rss->p_remain == 0 && ++rss->p_block < rss->tgt->count) {
+            rss->p_remain = (uint64_t)(rss->tgt->pos[rss->p_block*2+1] -
+                                       rss->tgt->pos[rss->p_block*2]) *
+                            BLOCKSIZE;
+        }
+    }
+    return written;
+}
+
+// new_data is inflated on its own thread straight into whichever
+// range set the current "new" command hands it.
+typedef struct {
+    ZipArchive* za;
+    const ZipEntry* entry;
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    RangeSinkState* rss;    // NULL while there is nowhere to write
+    bool finished;          // the thread has stopped
+    bool abort;             // set by the main thread to stop early
+} NewThreadInfo;
+
+static bool receive_new_data(const unsigned char* data, int size,
+                             void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+
+    while (size > 0) {
+        pthread_mutex_lock(&nti->mu);
+        while (nti->rss == NULL && !nti->abort) {
+            pthread_cond_wait(&nti->cv, &nti->mu);
+        }
+        RangeSinkState* rss = nti->rss;
+        pthread_mutex_unlock(&nti->mu);
+        if (rss == NULL) return false;
+
+        ssize_t written = range_sink_write((unsigned char*) data, size, rss);
+        data += written;
+        size -= written;
+
+        if (range_sink_full(rss) || rss->failed) {
+            pthread_mutex_lock(&nti->mu);
+            nti->rss = NULL;
+            pthread_cond_broadcast(&nti->cv);
+            pthread_mutex_unlock(&nti->mu);
+            if (rss->failed) return false;
+        }
+    }
+    return true;
+}
+
+static void* unzip_new_data(void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+    mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
+
+    pthread_mutex_lock(&nti->mu);
+    nti->finished = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+    return NULL;
+}
+
+// Stash ids are the SHA-1 of the contents, so an explicit stash and
+// the one a move or diff makes of its own source can share a file.
+// Each stash file is only removed once nothing refers to it.
+typedef struct {
+    char id[SHA_DIGEST_SIZE*2 + 1];
+    int refs;
+} StashRef;
+
+typedef struct {
+    UpdaterInfo* ui;
+    int fd;
+    char* stash_base;
+    uint8_t* patch_start;
+    size_t patch_len;       // size of the patch_data entry
+    NewThreadInfo nti;
+
+    uint8_t* buffer;
+    size_t buffer_alloc;
+    uint8_t* stash_buffer;
+    size_t stash_alloc;
+
+    char* save;             // strtok_r state for the current command
+    int written;            // blocks written (or skipped as done)
+    int total_blocks;
+    int stash_count;        // stashes made and not yet freed
+    int max_stash_entries;
+    StashRef* stash_refs;   // live stash ids
+    int stash_ref_count;
+    int stash_ref_alloc;
+} CommandParams;
+
+static char* next_word(CommandParams* p) {
+    return strtok_r(NULL, " ", &p->save);
+}
+
+static int reserve(uint8_t** buffer, size_t* alloc, size_t blocks) {
+    if (blocks > SIZE_MAX / BLOCKSIZE) {
+        fprintf(stderr, "can't allocate %zu blocks\n", blocks);
+        return -1;
+    }
+    size_t size = blocks * BLOCKSIZE;
+    if (size <= *alloc) return 0;
+    uint8_t* b = realloc(*buffer, size);
+    if (b == NULL) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", size);
+        return -1;
+    }
+    *buffer = b;
+    *alloc = size;
+    return 0;
+}
+
+static int parse_sha1_word(const char* word, uint8_t* digest) {
+    if (word == NULL || ParseSha1(word, digest) != 0) {
+        fprintf(stderr, "bad sha-1 \"%s\"\n", word ? word : "");
+        return -1;
+    }
+    return 0;
+}
+
+static bool blocks_match(const uint8_t* data, size_t blocks,
+                         const uint8_t* digest) {
+    uint8_t actual[SHA_DIGEST_SIZE];
+    SHA_hash(data, blocks * BLOCKSIZE, actual);
+    return memcmp(actual, digest, SHA_DIGEST_SIZE) == 0;
+}
+
+static void sha1_to_hex(const uint8_t* digest, char* out) {
+    static const char alphabet[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        out[i*2] = alphabet[digest[i] >> 4];
+        out[i*2+1] = alphabet[digest[i] & 0xf];
+    }
+    out[SHA_DIGEST_SIZE*2] = '\0';
+}
+
+static void stash_path(const CommandParams* p, const char* id,
+                       char* path, size_t len) {
+    snprintf(path, len, "%s/%s", p->stash_base, id);
+}
+
+// Write blocks to the stash named id, all or nothing.
+static int write_stash(CommandParams* p, const char* id,
+                       const uint8_t* data, size_t blocks) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    stash_path(p, id, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.partial", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create stash %s: %s\n",
+                tmp, strerror(errno));
+        return -1;
+    }
+    if (write_all(fd, data, blocks * BLOCKSIZE, 0) < 0 || fsync(fd) < 0) {
+        fprintf(stderr, "failed to write stash %s\n", tmp);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, path) < 0) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Load the stash named id into p->stash_buffer.  The id is the SHA-1
+// of the contents, so a damaged stash is never used.
+static int load_stash(CommandParams* p, const char* id, size_t* blocks) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (ParseSha1(id, digest) != 0) {
+        fprintf(stderr, "bad stash id \"%s\"\n", id);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    stash_path(p, id, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "failed to open stash %s: %s\n",
+                    path, strerror(errno));
+        }
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size % BLOCKSIZE != 0 ||
+        reserve(&p->stash_buffer, &p->stash_alloc,
+                st.st_size / BLOCKSIZE) < 0 ||
+        read_all(fd, p->stash_buffer, st.st_size, 0) < 0) {
+        fprintf(stderr, "failed to read stash %s\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    *blocks = st.st_size / BLOCKSIZE;
+    if (!blocks_match(p->stash_buffer, *blocks, digest)) {
+        fprintf(stderr, "stash %s is corrupt\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static StashRef* find_stash_ref(CommandParams* p, const char* id) {
+    int i;
+    for (i = 0; i < p->stash_ref_count; ++i) {
+        if (strcmp(p->stash_refs[i].id, id) == 0) return &p->stash_refs[i];
+    }
+    return NULL;
+}
+
+// Returns how many references id has, not counting this one.
+static int stash_ref(CommandParams* p, const char* id) {
+    StashRef* ref = find_stash_ref(p, id);
+    if (ref != NULL) return ref->refs++;
+
+    if (p->stash_ref_count == p->stash_ref_alloc) {
+        int alloc = p->stash_ref_alloc ? p->stash_ref_alloc * 2 : 16;
+        StashRef* refs = realloc(p->stash_refs, alloc * sizeof(StashRef));
+        if (refs == NULL) return -1;
+        p->stash_refs = refs;
+        p->stash_ref_alloc = alloc;
+    }
+    ref = &p->stash_refs[p->stash_ref_count++];
+    strlcpy(ref->id, id, sizeof(ref->id));
+    ref->refs = 1;
+    return 0;
+}
+
+// Drop a reference to id; returns how many are left.
+static int stash_unref(CommandParams* p, const char* id) {
+    StashRef* ref = find_stash_ref(p, id);
+    if (ref == NULL) return 0;
+    if (--ref->refs > 0) return ref->refs;
+    *ref = p->stash_refs[--p->stash_ref_count];
+    return 0;
+}
+
+static void free_stash(CommandParams* p, const char* id) {
+    if (stash_unref(p, id) > 0) return;
+
+    char path[PATH_MAX];
+    stash_path(p, id, path, sizeof(path));
+    if (unlink(path) < 0 && errno != ENOENT) {
+        fprintf(stderr, "failed to remove stash %s: %s\n",
+                path, strerror(errno));
+    }
+}
+
+// Parse "<blocks> <src_range|-> [<buffer_range>] [<id>:<buffer_range> ...]"
+// and assemble the source in p->buffer.  *src is set to the range read
+// from the partition, or NULL if it all came from stashes.
+static int load_source(CommandParams* p, size_t* blocks, RangeSet** src) {
+    *src = NULL;
+
+    char* word = next_word(p);
+    char* end;
+    long count = (word != NULL) ? strtol(word, &end, 0) : -1;
+    if (word == NULL || *end != '\0' || count <= 0) {
+        fprintf(stderr, "bad source block count\n");
+        return -1;
+    }
+    *blocks = count;
+    if (reserve(&p->buffer, &p->buffer_alloc, count) < 0) return -1;
+
+    word = next_word(p);
+    if (word == NULL) {
+        fprintf(stderr, "missing source range\n");
+        return -1;
+    }
+    bool stashes_only = strcmp(word, "-") == 0;
+    if (!stashes_only) {
+        *src = parse_range(word);
+        if (*src == NULL) return -1;
+        if ((*src)->size > count) {
+            fprintf(stderr, "source range larger than buffer\n");
+            return -1;
+        }
+        if (read_blocks(p->fd, *src, p->buffer) < 0) return -1;
+    }
+
+    word = next_word(p);
+    if (word == NULL) {
+        if (stashes_only || (*src)->size != count) {
+            fprintf(stderr, "source doesn't fill buffer\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!stashes_only) {
+        // Where the blocks read from the partition go in the buffer.
+        RangeSet* locs = parse_range(word);
+        if (locs == NULL) return -1;
+        if (locs->size != (*src)->size ||
+            locs->pos[locs->count*2-1] > count) {
+            fprintf(stderr, "bad source buffer map\n");
+            free(locs);
+            return -1;
+        }
+        spread_blocks(p->buffer, locs);
+        free(locs);
+        word = next_word(p);
+    }
+
+    for (; word != NULL; word = next_word(p)) {
+        char* colon = strchr(word, ':');
+        if (colon == NULL) {
+            fprintf(stderr, "bad stash reference \"%s\"\n", word);
+            return -1;
+        }
+        *colon = '\0';
+        size_t stash_blocks;
+        if (load_stash(p, word, &stash_blocks) < 0) {
+            fprintf(stderr, "failed to load stash %s\n", word);
+            return -1;
+        }
+        RangeSet* locs = parse_range(colon + 1);
+        if (locs == NULL) return -1;
+        if ((size_t)locs->size != stash_blocks ||
+            locs->pos[locs->count*2-1] > count) {
+            fprintf(stderr, "stash %s doesn't fit its buffer range\n", word);
+            free(locs);
+            return -1;
+        }
+        scatter_blocks(p->buffer, locs, p->stash_buffer);
+        free(locs);
+    }
+    return 0;
+}
+
+// Does the target already hold the data with this digest?
+static bool target_done(CommandParams* p, const RangeSet* tgt,
+                        const uint8_t* digest) {
+    if (reserve(&p->stash_buffer, &p->stash_alloc, tgt->size) < 0 ||
+        read_blocks(p->fd, tgt, p->stash_buffer) < 0) {
+        return false;
+    }
+    return blocks_match(p->stash_buffer, tgt->size, digest);
+}
+
+// Get the source for a move or diff into p->buffer.  Returns 1 if the
+// command should be skipped because an earlier run already did it.
+static int prepare_source(CommandParams* p, const char* cmd,
+                          const RangeSet* tgt, const uint8_t* src_digest,
+                          const uint8_t* tgt_digest, size_t* blocks,
+                          bool* stashed) {
+    RangeSet* src = NULL;
+    char id[SHA_DIGEST_SIZE*2 + 1];
+    sha1_to_hex(src_digest, id);
+    *stashed = false;
+
+    int r = load_source(p, blocks, &src);
+    if (r == 0 && blocks_match(p->buffer, *blocks, src_digest)) {
+        // Stash a source that overlaps its own target first, or a crash
+        // while writing would leave nothing to resume from.
+        if (src != NULL && range_overlaps(src, tgt)) {
+            // If the same blocks are stashed already, the file is there.
+            if (find_stash_ref(p, id) == NULL &&
+                write_stash(p, id, p->buffer, *blocks) < 0) {
+                r = -1;
+            } else if (stash_ref(p, id) < 0) {
+                r = -1;
+            } else {
+                *stashed = true;
+            }
+        }
+        free(src);
+        return r;
+    }
+    free(src);
+
+    if (target_done(p, tgt, tgt_digest)) {
+        return 1;
+    }
+
+    // Maybe an earlier run stashed this source and was cut off while
+    // writing the target.
+    size_t stash_blocks;
+    if (load_stash(p, id, &stash_blocks) == 0 &&
+        reserve(&p->buffer, &p->buffer_alloc, stash_blocks) == 0 &&
+        stash_ref(p, id) >= 0) {
+        memcpy(p->buffer, p->stash_buffer, stash_blocks * BLOCKSIZE);
+        *blocks = stash_blocks;
+        *stashed = true;
+        return 0;
+    }
+
+    fprintf(stderr, "%s: partition has unexpected contents\n", cmd);
+    return -1;
+}
+
+static int perform_move(CommandParams* p) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (parse_sha1_word(next_word(p), digest) < 0) return -1;
+    RangeSet* tgt = parse_range(next_word(p));
+    if (tgt == NULL) return -1;
+
+    size_t blocks;
+    bool stashed;
+    int r = prepare_source(p, "move", tgt, digest, digest, &blocks, &stashed);
+    if (r == 0) {
+        if (blocks != (size_t)tgt->size) {
+            fprintf(stderr, "move: source has %zu blocks, target %d\n",
+                    blocks, tgt->size);
+            r = -1;
+        } else {
+            r = write_blocks(p->fd, tgt, p->buffer);
+            if (r == 0) updater_add_bytes(p->ui, (uint64_t)blocks * BLOCKSIZE);
+        }
+    }
+    if (r >= 0) {
+        if (stashed) {
+            char id[SHA_DIGEST_SIZE*2 + 1];
+            sha1_to_hex(digest, id);
+            free_stash(p, id);
+        }
+        p->written += tgt->size;
+        r = 0;
+    }
+    free(tgt);
+    return r;
+}
+
+static int perform_diff(CommandParams* p, const char* cmd) {
+    char* word = next_word(p);
+    long long offset = (word != NULL) ? strtoll(word, NULL, 0) : -1;
+    word = next_word(p);
+    long long len = (word != NULL) ? strtoll(word, NULL, 0) : -1;
+    if (offset < 0 || len <= 0 || (size_t)offset > p->patch_len ||
+        (size_t)len > p->patch_len - offset) {
+        fprintf(stderr, "%s: bad patch offset/length\n", cmd);
+        return -1;
+    }
+
+    uint8_t src_digest[SHA_DIGEST_SIZE];
+    uint8_t tgt_digest[SHA_DIGEST_SIZE];
+    if (parse_sha1_word(next_word(p), src_digest) < 0 ||
+        parse_sha1_word(next_word(p), tgt_digest) < 0) {
+        return -1;
+    }
+    RangeSet* tgt = parse_range(next_word(p));
+    if (tgt == NULL) return -1;
+
+    size_t blocks;
+    bool stashed;
+    int r = prepare_source(p, cmd, tgt, src_digest, tgt_digest,
+                           &blocks, &stashed);
+    if (r == 0) {
+        Value patch_value;
+        patch_value.type = VAL_BLOB;
+        patch_value.size = len;
+        patch_value.data = (char*)(p->patch_start + offset);
+
+        RangeSinkState rss;
+        init_range_sink(&rss, p->fd, tgt);
+        if (cmd[0] == 'b') {
+            r = ApplyBSDiffPatch(p->buffer, blocks * BLOCKSIZE, &patch_value,
+                                 0, range_sink_write, &rss, NULL);
+        } else {
+            r = ApplyImagePatch(p->buffer, blocks * BLOCKSIZE, &patch_value,
+                                range_sink_write, &rss, NULL, NULL);
+        }
+        if (r != 0 || rss.failed) {
+            fprintf(stderr, "%s: failed to apply patch\n", cmd);
+            r = -1;
+        } else if (!range_sink_full(&rss)) {
+            fprintf(stderr, "%s: patch output is short of the target range\n",
+                    cmd);
+            r = -1;
+        } else {
+            updater_add_bytes(p->ui, (uint64_t)tgt->size * BLOCKSIZE);
+        }
+    }
+    if (r >= 0) {
+        if (stashed) {
+            char id[SHA_DIGEST_SIZE*2 + 1];
+            sha1_to_hex(src_digest, id);
+            free_stash(p, id);
+        }
+        p->written += tgt->size;
+        r = 0;
+    }
+    free(tgt);
+    return r;
+}
+
+static int perform_stash(CommandParams* p) {
+    char* id = next_word(p);
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (parse_sha1_word(id, digest) < 0) return -1;
+    if (p->stash_count >= p->max_stash_entries) {
+        fprintf(stderr, "stash %s: more than %d stashes\n",
+                id, p->max_stash_entries);
+        return -1;
+    }
+    RangeSet* src = parse_range(next_word(p));
+    if (src == NULL) return -1;
+
+    size_t blocks;
+    int r = 0;
+    if (load_stash(p, id, &blocks) == 0) {
+        // Already there from an earlier run.
+    } else if (reserve(&p->buffer, &p->buffer_alloc, src->size) < 0 ||
+               read_blocks(p->fd, src, p->buffer) < 0) {
+        r = -1;
+    } else if (!blocks_match(p->buffer, src->size, digest)) {
+        // The blocks were stashed and then overwritten by an earlier run
+        // that got past every command needing them.
+        fprintf(stderr, "stash %s: source has changed; assuming it was "
+                "already used\n", id);
+    } else {
+        r = write_stash(p, id, p->buffer, src->size);
+    }
+    if (r == 0 && stash_ref(p, id) < 0) r = -1;
+    if (r == 0) ++p->stash_count;
+    free(src);
+    return r;
+}
+
+static int perform_zero(CommandParams* p) {
+    RangeSet* tgt = parse_range(next_word(p));
+    if (tgt == NULL) return -1;
+
+    if (reserve(&p->buffer, &p->buffer_alloc, 1) < 0) {
+        free(tgt);
+        return -1;
+    }
+    size_t chunk = p->buffer_alloc / BLOCKSIZE;
+    memset(p->buffer, 0, chunk * BLOCKSIZE);
+
+    int i;
+    int r = 0;
+    for (i = 0; i < tgt->count && r == 0; ++i) {
+        off64_t block = tgt->pos[i*2];
+        while (block < tgt->pos[i*2+1]) {
+            size_t n = tgt->pos[i*2+1] - block;
+            if (n > chunk) n = chunk;
+            if (write_all(p->fd, p->buffer, n * BLOCKSIZE,
+                          block * BLOCKSIZE) < 0) {
+                r = -1;
+                break;
+            }
+            block += n;
+        }
+    }
+    if (r == 0) {
+        updater_add_bytes(p->ui, (uint64_t)tgt->size * BLOCKSIZE);
+        p->written += tgt->size;
+    }
+    free(tgt);
+    return r;
+}
+
+// Hand tgt to the new_data thread and wait for it to be filled.  With
+// discard set the data is consumed without being written.
+static int perform_new(CommandParams* p, bool discard) {
+    RangeSet* tgt = parse_range(next_word(p));
+    if (tgt == NULL) return -1;
+
+    RangeSinkState rss;
+    init_range_sink(&rss, discard ? -1 : p->fd, tgt);
+
+    pthread_mutex_lock(&p->nti.mu);
+    p->nti.rss = &rss;
+    pthread_cond_broadcast(&p->nti.cv);
+    while (p->nti.rss != NULL && !p->nti.finished) {
+        pthread_cond_wait(&p->nti.cv, &p->nti.mu);
+    }
+    p->nti.rss = NULL;
+    pthread_mutex_unlock(&p->nti.mu);
+
+    int r = 0;
+    if (rss.failed) {
+        fprintf(stderr, "new: failed to write new data\n");
+        r = -1;
+    } else if (!range_sink_full(&rss)) {
+        fprintf(stderr, "new: ran out of new data\n");
+        r = -1;
+    } else if (!discard) {
+        updater_add_bytes(p->ui, (uint64_t)tgt->size * BLOCKSIZE);
+        p->written += tgt->size;
+    }
+    free(tgt);
+    return r;
+}
+
+static int perform_erase(CommandParams* p) {
+    RangeSet* tgt = parse_range(next_word(p));
+    if (tgt == NULL) return -1;
+
+    struct stat st;
+    if (fstat(p->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        int i;
+        for (i = 0; i < tgt->count; ++i) {
+            uint64_t range[2];
+            range[0] = (uint64_t)tgt->pos[i*2] * BLOCKSIZE;
+            range[1] = (uint64_t)(tgt->pos[i*2+1] - tgt->pos[i*2]) * BLOCKSIZE;
+            if (ioctl(p->fd, BLKDISCARD, &range) < 0) {
+                // Erased blocks are never read back, so this only costs
+                // the flash some free space.
+                fprintf(stderr, "erase: BLKDISCARD failed: %s\n",
+                        strerror(errno));
+                break;
+            }
+        }
+    }
+    free(tgt);
+    return 0;
+}
+
+// The checkpoint holds the SHA-1 of the transfer list and the number
+// of commands known to be on disk.
+// Returns the number of commands already done, and sets p->written to
+// the blocks they wrote.
+static int read_checkpoint(CommandParams* p, const char* list_id) {
+    char path[PATH_MAX];
+    stash_path(p, CHECKPOINT_NAME, path, sizeof(path));
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return 0;
+
+    char id[SHA_DIGEST_SIZE*2 + 1];
+    int done = 0;
+    int written = 0;
+    if (fscanf(f, "%40s %d %d", id, &done, &written) != 3 ||
+        strcmp(id, list_id) != 0 || done < 0 || written < 0) {
+        done = 0;
+        written = 0;
+    }
+    fclose(f);
+    p->written = written;
+    return done;
+}
+
+static int write_checkpoint(CommandParams* p, const char* list_id, int done) {
+    if (fsync(p->fd) < 0) {
+        fprintf(stderr, "failed to sync partition: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    stash_path(p, CHECKPOINT_NAME, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.partial", path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "%s %d %d\n", list_id, done, p->written);
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return rename(tmp, path);
+}
+
+static char* make_stash_base(const char* partition) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    char id[SHA_DIGEST_SIZE*2 + 1];
+    SHA_hash(partition, strlen(partition), digest);
+    sha1_to_hex(digest, id);
+
+    char* base = malloc(strlen(STASH_DIRECTORY_BASE) + 1 + sizeof(id));
+    sprintf(base, "%s/%s", STASH_DIRECTORY_BASE, id);
+    return base;
+}
+
+static bool enough_stash_space(const char* base, int max_stash_blocks) {
+    struct statfs sf;
+    if (statfs(STASH_DIRECTORY_BASE, &sf) < 0) {
+        fprintf(stderr, "failed to statfs %s: %s\n",
+                STASH_DIRECTORY_BASE, strerror(errno));
+        return false;
+    }
+    uint64_t avail = (uint64_t)sf.f_bavail * sf.f_bsize;
+    uint64_t needed = (uint64_t)max_stash_blocks * BLOCKSIZE;
+    if (avail < needed) {
+        fprintf(stderr, "not enough space for stash in %s: %llu < %llu\n",
+                base, (unsigned long long)avail, (unsigned long long)needed);
+        return false;
+    }
+    return true;
+}
+
+static int header_int(char** save) {
+    char* line = strtok_r(NULL, "\n", save);
+    char* end;
+    long v = (line != NULL) ? strtol(line, &end, 0) : -1;
+    if (line == NULL || *end != '\0' || v < 0) return -1;
+    return v;
+}
+
+Value* BlockImageUpdateFn(const char* name, State* state,
+                          int argc, Expr* argv[]) {
+    Value* partition_value = NULL;
+    Value* transfer_list_value = NULL;
+    Value* new_data_value = NULL;
+    Value* patch_data_value = NULL;
+    if (argc != 4) {
+        return ErrorAbort(state, "%s() expects 4 args, got %d", name, argc);
+    }
+    if (ReadValueArgs(state, argv, 4, &partition_value, &transfer_list_value,
+                      &new_data_value, &patch_data_value) < 0) {
+        return NULL;
+    }
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    CommandParams p;
+    memset(&p, 0, sizeof(p));
+    p.ui = ui;
+    p.fd = -1;
+    pthread_mutex_init(&p.nti.mu, NULL);
+    pthread_cond_init(&p.nti.cv, NULL);
+    bool thread_started = false;
+    uint8_t* patch_copy = NULL;
+    char* list = NULL;
+    bool success = false;
+    pthread_t new_data_thread;
+
+    if (partition_value->type != VAL_STRING ||
+        new_data_value->type != VAL_STRING ||
+        patch_data_value->type != VAL_STRING) {
+        ErrorAbort(state, "partition, new_data and patch_data arguments to "
+                   "%s must be strings", name);
+        goto done;
+    }
+    if (transfer_list_value->type != VAL_BLOB ||
+        transfer_list_value->size < 0) {
+        ErrorAbort(state, "transfer_list argument to %s must be blob", name);
+        goto done;
+    }
+
+    ZipArchive* za = ui->package_zip;
+    const ZipEntry* new_entry = mzFindZipEntry(za, new_data_value->data);
+    if (new_entry == NULL) {
+        fprintf(stderr, "%s: no %s in package\n", name, new_data_value->data);
+        goto done;
+    }
+    const ZipEntry* patch_entry = mzFindZipEntry(za, patch_data_value->data);
+    if (patch_entry == NULL) {
+        fprintf(stderr, "%s: no %s in package\n", name,
+                patch_data_value->data);
+        goto done;
+    }
+    if (mzIsZipEntryStored(patch_entry)) {
+        // Patches are addressed by offset, so use the mapped package.
+        p.patch_start = (uint8_t*)za->map.addr +
+                        mzGetZipEntryOffset(patch_entry);
+        p.patch_len = mzGetZipEntryUncompLen(patch_entry);
+    } else {
+        patch_copy = malloc(mzGetZipEntryUncompLen(patch_entry));
+        if (patch_copy == NULL ||
+            !mzExtractZipEntryToBuffer(za, patch_entry, patch_copy)) {
+            fprintf(stderr, "%s: failed to extract %s\n", name,
+                    patch_data_value->data);
+            goto done;
+        }
+        p.patch_start = patch_copy;
+        p.patch_len = mzGetZipEntryUncompLen(patch_entry);
+    }
+
+    list = malloc(transfer_list_value->size + 1);
+    memcpy(list, transfer_list_value->data, transfer_list_value->size);
+    list[transfer_list_value->size] = '\0';
+
+    uint8_t list_digest[SHA_DIGEST_SIZE];
+    char list_id[SHA_DIGEST_SIZE*2 + 1];
+    SHA_hash(list, transfer_list_value->size, list_digest);
+    sha1_to_hex(list_digest, list_id);
+
+    char* save;
+    char* line = strtok_r(list, "\n", &save);
+    int version = (line != NULL) ? strtol(line, NULL, 0) : -1;
+    if (version != 3) {
+        fprintf(stderr, "%s: unsupported transfer list version %d\n",
+                name, version);
+        goto done;
+    }
+    p.total_blocks = header_int(&save);
+    p.max_stash_entries = header_int(&save);
+    int max_stash_blocks = header_int(&save);
+    if (p.total_blocks < 0 || p.max_stash_entries < 0 || max_stash_blocks < 0) {
+        fprintf(stderr, "%s: bad transfer list header\n", name);
+        goto done;
+    }
+
+    p.fd = open(partition_value->data, O_RDWR);
+    if (p.fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %s\n", name,
+                partition_value->data, strerror(errno));
+        goto done;
+    }
+
+    p.stash_base = make_stash_base(partition_value->data);
+    mkdir(STASH_DIRECTORY_BASE, STASH_DIRECTORY_MODE);
+    if (mkdir(p.stash_base, STASH_DIRECTORY_MODE) < 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: failed to create %s: %s\n", name,
+                p.stash_base, strerror(errno));
+        goto done;
+    }
+    if (max_stash_blocks > 0 &&
+        !enough_stash_space(p.stash_base, max_stash_blocks)) {
+        goto done;
+    }
+
+    int resume_from = read_checkpoint(&p, list_id);
+    if (resume_from > 0) {
+        fprintf(stderr, "%s: resuming %s after command %d\n", name,
+                partition_value->data, resume_from);
+    }
+
+    p.nti.za = za;
+    p.nti.entry = new_entry;
+    if (pthread_create(&new_data_thread, NULL, unzip_new_data, &p.nti) != 0) {
+        fprintf(stderr, "%s: failed to start new data thread\n", name);
+        goto done;
+    }
+    thread_started = true;
+
+    int index = 0;
+    int since_checkpoint = 0;
+    int last_percent = -1;
+    while ((line = strtok_r(NULL, "\n", &save)) != NULL) {
+        char* cmd = strtok_r(line, " ", &p.save);
+        if (cmd == NULL) continue;
+
+        int before = p.written;
+        int r;
+        if (index < resume_from) {
+            // Done by an earlier run; only keep new_data and the stash
+            // counts in step.  p.written already includes these.
+            r = (strcmp(cmd, "new") == 0) ? perform_new(&p, true) : 0;
+            if (strcmp(cmd, "stash") == 0) {
+                char* id = next_word(&p);
+                if (id == NULL || stash_ref(&p, id) < 0) r = -1;
+                ++p.stash_count;
+            }
+            if (strcmp(cmd, "free") == 0) {
+                char* id = next_word(&p);
+                if (id != NULL) stash_unref(&p, id);
+                if (p.stash_count > 0) --p.stash_count;
+            }
+        } else if (strcmp(cmd, "move") == 0) {
+            r = perform_move(&p);
+        } else if (strcmp(cmd, "bsdiff") == 0 || strcmp(cmd, "imgdiff") == 0) {
+            r = perform_diff(&p, cmd);
+        } else if (strcmp(cmd, "stash") == 0) {
+            r = perform_stash(&p);
+        } else if (strcmp(cmd, "free") == 0) {
+            char* id = next_word(&p);
+            if (id != NULL) free_stash(&p, id);
+            if (id != NULL && p.stash_count > 0) --p.stash_count;
+            r = (id != NULL) ? 0 : -1;
+        } else if (strcmp(cmd, "zero") == 0) {
+            r = perform_zero(&p);
+        } else if (strcmp(cmd, "new") == 0) {
+            r = perform_new(&p, false);
+        } else if (strcmp(cmd, "erase") == 0) {
+            r = perform_erase(&p);
+        } else {
+            fprintf(stderr, "%s: unknown command \"%s\"\n", name, cmd);
+            r = -1;
+        }
+        if (r < 0) {
+            fprintf(stderr, "%s: command %d (%s) failed\n", name, index, cmd);
+            goto done;
+        }
+        ++index;
+
+        since_checkpoint += p.written - before;
+        if (since_checkpoint >= CHECKPOINT_INTERVAL_BLOCKS) {
+            if (write_checkpoint(&p, list_id, index) < 0) {
+                fprintf(stderr, "%s: failed to record progress\n", name);
+            }
+            since_checkpoint = 0;
+        }
+
+        if (p.total_blocks > 0) {
+            int percent = (int)((int64_t)p.written * 100 / p.total_blocks);
+            if (percent != last_percent) {
+                updater_set_progress(ui, (double)p.written / p.total_blocks);
+                last_percent = percent;
+            }
+        }
+    }
+
+    if (fsync(p.fd) < 0) {
+        fprintf(stderr, "%s: failed to sync %s: %s\n", name,
+                partition_value->data, strerror(errno));
+        goto done;
+    }
+    if (p.written != p.total_blocks) {
+        fprintf(stderr, "%s: wrote %d blocks; expected %d\n", name,
+                p.written, p.total_blocks);
+    }
+    success = true;
+
+  done:
+    if (thread_started) {
+        pthread_mutex_lock(&p.nti.mu);
+        p.nti.abort = true;
+        pthread_cond_broadcast(&p.nti.cv);
+        pthread_mutex_unlock(&p.nti.mu);
+        pthread_join(new_data_thread, NULL);
+    }
+    if (p.fd >= 0) close(p.fd);
+    if (success && p.stash_base != NULL) {
+        dirUnlinkHierarchy(p.stash_base);
+    }
+    pthread_cond_destroy(&p.nti.cv);
+    pthread_mutex_destroy(&p.nti.mu);
+    free(p.stash_base);
+    free(p.stash_refs);
+    free(p.buffer);
+    free(p.stash_buffer);
+    free(patch_copy);
+    free(list);
+    FreeValue(partition_value);
+    FreeValue(transfer_list_value);
+    FreeValue(new_data_value);
+    FreeValue(patch_data_value);
+    return StringValue(strdup(success ? "t" : ""));
+}
+
+void RegisterBlockImageFunctions() {
+    RegisterFunction("block_image_update", BlockImageUpdateFn);
+}
@@ -0,0 +1,253 @@
+#!/bin/bash
+#
+# A test suite for block_image_update.  Run in a client where you have
+# done envsetup, lunch, etc.  It builds (on the host) a source image, a
+# transfer list and an update package, then runs the updater on the
+# device (or emulator) against an image file and checks the result.
+#
+# The device needs a writable /cache: stashes are kept in
+# /cache/recovery while an update runs.
+#
+# TODO: find some way to get this run regularly along with the rest of
+# the tests.
+
+EMULATOR_PORT=5580
+
+# set to 0 to use a device instead
+USE_EMULATOR=0
+
+# where on the device to do all the work.
+WORK_DIR=/data/local/tmp/blockimg
+
+# host tools; the bsdiff test is skipped if there's no bsdiff.
+IMGDIFF=${IMGDIFF:-$ANDROID_HOST_OUT/bin/imgdiff}
+BSDIFF=${BSDIFF:-$(which bsdiff)}
+
+BLOCKSIZE=4096
+
+# ------------------------
+
+tmpdir=$(mktemp -d)
+
+if [ "$USE_EMULATOR" == 1 ]; then
+  emulator -wipe-data -noaudio -no-window -port $EMULATOR_PORT &
+  pid_emulator=$!
+  ADB="adb -s emulator-$EMULATOR_PORT "
+else
+  ADB="adb -d "
+fi
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+testname() {
+  echo
+  echo "$1"...
+  testname="$1"
+}
+
+fail() {
+  echo
+  echo FAIL: $testname
+  echo
+  [ "$pid_emulator" == "" ] || kill $pid_emulator
+  exit 1
+}
+
+sha1() {
+  sha1sum $1 | awk '{print $1}'
+}
+
+size() {
+  stat -c %s $1 | tr -d '\n'
+}
+
+# blocks <image> <start> <end>: copy out blocks [start, end).
+blocks() {
+  dd if=$1 bs=$BLOCKSIZE skip=$2 count=$(($3 - $2)) 2>/dev/null
+}
+
+# blocks_sha1 <image> <start> <end>
+blocks_sha1() {
+  blocks $1 $2 $3 | sha1sum | awk '{print $1}'
+}
+
+# put <image> <start> <file>: write file over the image at block start.
+put() {
+  dd if=$3 of=$1 bs=$BLOCKSIZE seek=$2 conv=notrunc 2>/dev/null
+}
+
+cleanup() {
+  # not necessary if we're about to kill the emulator, but nice for
+  # running on real devices or already-running emulators.
+  testname "removing test files"
+  run_command rm -r $WORK_DIR
+
+  [ "$pid_emulator" == "" ] || kill $pid_emulator
+
+  rm -rf $tmpdir
+}
+
+# make_package <dir>: zip up dir's transfer list, new data, patches
+# and a script that applies them to $WORK_DIR/part.img.
+make_package() {
+  mkdir -p $1/META-INF/com/google/android
+  cat > $1/META-INF/com/google/android/updater-script <<EOF
+block_image_update("$WORK_DIR/part.img",
+                   package_extract_file("part.transfer.list"),
+                   "part.new.dat", "part.patch.dat") ||
+  abort("block_image_update failed");
+EOF
+  touch $1/part.new.dat $1/part.patch.dat
+  (cd $1 && zip -qr ../$(basename $1).zip .)
+}
+
+# run_update <package> <image>: push the image, apply the package to it
+# and pull it back.  Returns the updater's exit status.
+run_update() {
+  $ADB push $2 $WORK_DIR/part.img >/dev/null || fail
+  $ADB push $1 $WORK_DIR/package.zip >/dev/null || fail
+  run_command $WORK_DIR/updater 3 3 $WORK_DIR/package.zip 3\>/dev/null
+  local status=$?
+  $ADB pull $WORK_DIR/part.img $tmpdir/result.img >/dev/null || fail
+  return $status
+}
+
+testname "setting up"
+run_command mkdir -p $WORK_DIR || fail
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/updater $WORK_DIR/updater || fail
+run_command chmod 755 $WORK_DIR/updater || fail
+
+# The source image: 64 random blocks, where blocks 48-51 repeat 40-43
+# so that two stashes share an id.
+src=$tmpdir/source.img
+dd if=/dev/urandom of=$src bs=$BLOCKSIZE count=64 2>/dev/null
+blocks $src 40 44 > $tmpdir/dup
+put $src 48 $tmpdir/dup
+
+# Build the expected target alongside the transfer list, applying each
+# command to a copy of the source in the same order the updater will.
+pkg=$tmpdir/update
+mkdir -p $pkg
+tgt=$tmpdir/target.img
+cp $src $tgt
+written=0
+cmds=$tmpdir/commands
+
+dup_id=$(blocks_sha1 $src 40 44)
+echo "stash $dup_id 2,40,44" >> $cmds
+echo "stash $dup_id 2,48,52" >> $cmds
+
+dd if=/dev/urandom of=$pkg/part.new.dat bs=$BLOCKSIZE count=4 2>/dev/null
+put $tgt 0 $pkg/part.new.dat
+echo "new 2,0,4" >> $cmds
+written=$((written + 4))
+
+dd if=/dev/zero of=$tmpdir/zero bs=$BLOCKSIZE count=4 2>/dev/null
+put $tgt 4 $tmpdir/zero
+echo "zero 2,4,8" >> $cmds
+written=$((written + 4))
+
+blocks $src 16 24 > $tmpdir/move
+put $tgt 8 $tmpdir/move
+echo "move $(sha1 $tmpdir/move) 2,8,16 8 2,16,24" >> $cmds
+written=$((written + 8))
+
+# This source overlaps its target, so it gets stashed under the same
+# id as the two explicit stashes; those must survive it.
+put $tgt 49 $tmpdir/dup
+echo "move $dup_id 2,49,53 4 2,48,52" >> $cmds
+written=$((written + 4))
+echo "free $dup_id" >> $cmds
+
+put $tgt 56 $tmpdir/dup
+echo "move $dup_id 2,56,60 4 - $dup_id:2,0,4" >> $cmds
+written=$((written + 4))
+echo "free $dup_id" >> $cmds
+
+patch_offset=0
+# add_diff <bsdiff|imgdiff> <start> <end>: patch blocks [start, end) in
+# place, changing a few bytes of each block.
+add_diff() {
+  blocks $tgt $2 $3 > $tmpdir/diff.old
+  cp $tmpdir/diff.old $tmpdir/diff.new
+  local i
+  for i in $(seq 0 $(($3 - $2 - 1))); do
+    printf 'block %d' $i | dd of=$tmpdir/diff.new bs=1 \
+        seek=$((i * BLOCKSIZE + 100)) conv=notrunc 2>/dev/null
+  done
+  if [ "$1" == "bsdiff" ]; then
+    $BSDIFF $tmpdir/diff.old $tmpdir/diff.new $tmpdir/diff.p || fail
+  else
+    $IMGDIFF $tmpdir/diff.old $tmpdir/diff.new $tmpdir/diff.p || fail
+  fi
+  local len=$(size $tmpdir/diff.p)
+  cat $tmpdir/diff.p >> $pkg/part.patch.dat
+  echo "$1 $patch_offset $len $(sha1 $tmpdir/diff.old)" \
+       "$(sha1 $tmpdir/diff.new) 2,$2,$3 $(($3 - $2)) 2,$2,$3" >> $cmds
+  patch_offset=$((patch_offset + len))
+  put $tgt $2 $tmpdir/diff.new
+  written=$((written + $3 - $2))
+}
+
+testname "making patches"
+add_diff imgdiff 24 32
+if [ -x "$BSDIFF" ]; then
+  add_diff bsdiff 32 40
+else
+  echo "no bsdiff on the host; not testing bsdiff commands"
+fi
+
+(echo 3; echo $written; echo 2; echo 8; cat $cmds) > $pkg/part.transfer.list
+make_package $pkg
+
+testname "applying update"
+run_update $tmpdir/update.zip $src || fail
+[ "$(sha1 $tmpdir/result.img)" == "$(sha1 $tgt)" ] || fail
+
+testname "applying update again to its own result"
+run_update $tmpdir/update.zip $tgt || fail
+[ "$(sha1 $tmpdir/result.img)" == "$(sha1 $tgt)" ] || fail
+
+# Malformed transfer lists must fail cleanly: a nonzero exit status
+# from the updater rather than a crash.
+bad_update() {
+  local bad=$tmpdir/bad
+  rm -rf $bad $bad.zip
+  mkdir -p $bad
+  (echo 3; echo 4; echo 0; echo 0; echo "$1") > $bad/part.transfer.list
+  make_package $bad
+  run_update $bad.zip $src
+  local status=$?
+  [ $status -ne 0 -a $status -lt 128 ] || fail
+  [ "$(sha1 $tmpdir/result.img)" == "$(sha1 $src)" ] || fail
+}
+
+testname "rejecting a huge source buffer"
+bad_update "move $dup_id 2,0,4 2147483647 2,40,44"
+
+testname "rejecting unsorted ranges"
+bad_update "move $dup_id 2,0,4 4 4,42,44,40,42"
+
+testname "rejecting a source range outside its buffer"
+bad_update "move $dup_id 2,0,4 4 2,40,44 2,60,64"
+
+testname "rejecting a patch outside the patch data"
+bad_update "imgdiff 0 4096 $dup_id $dup_id 2,0,4 4 2,40,44"
+
+testname "rejecting a missing stash"
+bad_update "move $dup_id 2,0,4 4 - $(sha1 $tmpdir/zero):2,0,4"
+
+# --------------- cleanup ----------------------
+
+cleanup
+
+echo
+echo PASS
+echo
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_CMD_PROTOCOL_H_
+#define _UPDATER_CMD_PROTOCOL_H_
+
+#include <stdint.h>
+
+// Binary command protocol between the update binary and recovery.
+//
+// Recovery sets CMD_PROTOCOL_ENV in the update binary's environment to
+// the highest protocol version it understands.  An update binary that
+// sees it may send framed messages on the command pipe instead of text
+// lines.  Recovery still accepts text lines (from older update binaries)
+// and tells the two apart by the first byte: no text command starts
+// with CMD_MSG_MAGIC.
+//
+// Each message is a CmdMsgHeader followed by payload_len bytes of
+// payload.  All integers are in host byte order.
+
+#define CMD_PROTOCOL_ENV      "UPDATER_CMD_PROTOCOL"
+#define CMD_PROTOCOL_VERSION  1
+
+// If set in the update binary's environment, the updater-script is
+// profiled (see ProfileStart() in edify/expr.h) and the report is
+// written to stderr and to the file named by the variable.
+#define UPDATER_PROFILE_ENV   "UPDATER_PROFILE"
+#define UPDATER_PROFILE_FILE  "/tmp/updater_profile"
+
+#define CMD_MSG_MAGIC         0xb5
+#define CMD_MSG_MAX_PAYLOAD   4096
+
+enum {
+    // payload: one line of text (no newline, not NUL-terminated)
+    CMD_MSG_UI_PRINT = 1,
+    // payload: CmdMsgProgress
+    CMD_MSG_PROGRESS,
+    // payload: CmdMsgProgress (seconds is ignored)
+    CMD_MSG_SET_PROGRESS,
+    // no payload; only bytes_done in the header matters
+    CMD_MSG_BYTES,
+    // payload: any text-protocol command line, e.g. "wipe_cache"
+    CMD_MSG_COMMAND,
+};
+
+typedef struct {
+    uint8_t  magic;           // CMD_MSG_MAGIC
+    uint8_t  version;         // CMD_PROTOCOL_VERSION
+    uint8_t  type;            // CMD_MSG_*
+    uint8_t  reserved;
+    uint32_t payload_len;     // at most CMD_MSG_MAX_PAYLOAD
+    uint64_t timestamp_us;    // CLOCK_MONOTONIC when the message was sent
+    uint64_t bytes_done;      // bytes written by the update so far
+} __attribute__((packed)) CmdMsgHeader;
+
+typedef struct {
+    uint32_t fraction_ppm;    // fraction of the bar, in millionths
+    int32_t  seconds;
+} __attribute__((packed)) CmdMsgProgress;
+
+#endif
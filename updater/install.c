@@ -16,6 +16,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +36,7 @@
 #include "minzip/DirUtil.h"
 #include "mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "mmcutils/mmcutils.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
 #include "flashutils/flashutils.h"
@@ -326,7 +328,7 @@ Value* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     int sec = strtol(sec_str, NULL, 10);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    updater_show_progress(ui, frac, sec);
 
     free(sec_str);
     return StringValue(frac_str);
@@ -344,11 +346,20 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     double frac = strtod(frac_str, NULL);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    updater_set_progress(ui, frac);
 
     return StringValue(frac_str);
 }
 
+// mzExtractRecursive callback: count each extracted file towards the
+// bytes written.
+static void count_extracted_bytes(const char* fn, void* cookie) {
+    struct stat st;
+    if (lstat(fn, &st) == 0 && S_ISREG(st.st_mode)) {
+        updater_add_bytes((UpdaterInfo*) cookie, st.st_size);
+    }
+}
+
 // package_extract_dir(package_path, destination_path)
 Value* PackageExtractDirFn(const char* name, State* state,
                           int argc, Expr* argv[]) {
@@ -366,7 +377,8 @@ Value* PackageExtractDirFn(const char* name, State* state,
 
     bool success = mzExtractRecursive(za, zip_path, dest_path,
                                       MZ_EXTRACT_FILES_ONLY, &timestamp,
-                                      NULL, NULL, sehandle);
+                                      count_extracted_bytes, state->cookie,
+                                      sehandle);
     free(zip_path);
     free(dest_path);
     return StringValue(strdup(success ? "t" : ""));
@@ -407,6 +419,10 @@ Value* PackageExtractFileFn(const char* name, State* state,
         }
         success = mzExtractZipEntryToFile(za, entry, fileno(f));
         fclose(f);
+        if (success) {
+            updater_add_bytes((UpdaterInfo*)(state->cookie),
+                              mzGetZipEntryUncompLen(entry));
+        }
 
       done2:
         free(zip_path);
@@ -520,6 +536,14 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
+// Logs each path set_perm_recursive couldn't change.  As before, these
+// don't fail the script.
+static void SetPermRecursiveError(const char* path, const char* op, int err,
+                                  void* cookie) {
+    fprintf(stderr, "%s: %s of %s failed: %s\n",
+            (const char*)cookie, op, path, strerror(err));
+}
+
 Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
     bool recursive = (strcmp(name, "set_perm_recursive") == 0);
@@ -564,7 +588,8 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
         }
 
         for (i = 4; i < argc; ++i) {
-            dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode);
+            dirSetHierarchyPermissionsWithCallback(args[i], uid, gid,
+                    dir_mode, file_mode, SetPermRecursiveError, (void*)name);
         }
     } else {
         int mode = strtoul(args[2], &end, 0);
@@ -717,23 +742,170 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
+// Streams raw image data to a partition: through mtd_write_data() on
+// MTD, or through an mmcutils flash context on eMMC, which also reads
+// the data back and checks it.  The SHA-1 of everything written is
+// kept on the way.
+typedef struct {
+    MtdWriteContext* mtd;
+    MmcFlashContext* mmc;
+    SHA_CTX sha_ctx;
+    UpdaterInfo* ui;
+} RawImageWriter;
+
 static bool write_raw_image_cb(const unsigned char* data,
                                int data_len, void* ctx) {
-    int r = mtd_write_data((MtdWriteContext*)ctx, (const char *)data, data_len);
-    if (r == data_len) return true;
-    fprintf(stderr, "%s\n", strerror(errno));
-    return false;
+    RawImageWriter* w = (RawImageWriter*)ctx;
+    updater_add_bytes(w->ui, data_len);
+
+    if (w->mtd != NULL) {
+        SHA_update(&w->sha_ctx, data, data_len);
+        int r = mtd_write_data(w->mtd, (const char *)data, data_len);
+        if (r == data_len) return true;
+        fprintf(stderr, "%s\n", strerror(errno));
+        return false;
+    }
+    return mmc_flash_write(w->mmc, data, data_len) == 0;
+}
+
+// Inflate a package entry straight onto a partition, without staging
+// the image in /tmp.  Returns 0 on success.
+static int stream_raw_image(UpdaterInfo* ui, const ZipEntry* entry,
+                            const char* partition, uint8_t* digest) {
+    RawImageWriter w;
+    memset(&w, 0, sizeof(w));
+    w.ui = ui;
+    SHA_init(&w.sha_ctx);
+
+    if (device_flash_type() == MTD && partition[0] != '/') {
+        if (mtd_scan_partitions() <= 0) {
+            fprintf(stderr, "write_raw_image: error scanning partitions\n");
+            return -1;
+        }
+        const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+        if (mtd == NULL) {
+            fprintf(stderr, "write_raw_image: no mtd partition %s\n",
+                    partition);
+            return -1;
+        }
+        w.mtd = mtd_write_partition(mtd);
+        if (w.mtd == NULL) {
+            fprintf(stderr, "write_raw_image: can't write %s\n", partition);
+            return -1;
+        }
+        mtd_write_erase_ahead(w.mtd, MTD_ERASE_AHEAD_BLOCKS);
+    } else {
+        char device[PATH_MAX];
+        if (partition[0] == '/') {
+            strlcpy(device, partition, sizeof(device));
+        } else if (get_partition_device(partition, device) != 0) {
+            fprintf(stderr, "write_raw_image: no device for %s\n", partition);
+            return -1;
+        }
+        w.mmc = mmc_flash_open(device, MMC_COPY_DIRECT_OUT | MMC_COPY_VERIFY);
+        if (w.mmc == NULL) {
+            fprintf(stderr, "write_raw_image: can't open %s\n", device);
+            return -1;
+        }
+    }
+
+    ZipArchive* za = ui->package_zip;
+    bool success = mzProcessZipEntryContents(za, entry, write_raw_image_cb, &w);
+
+    if (w.mtd != NULL) {
+        if (success && mtd_erase_blocks(w.mtd, -1) == -1) {
+            fprintf(stderr, "write_raw_image: error erasing blocks of %s\n",
+                    partition);
+            success = false;
+        }
+        if (mtd_write_close(w.mtd) != 0) {
+            fprintf(stderr, "write_raw_image: error closing write of %s\n",
+                    partition);
+            success = false;
+        }
+        memcpy(digest, SHA_final(&w.sha_ctx), SHA_DIGEST_SIZE);
+    } else {
+        // Closing flushes, syncs and verifies what was written.
+        if (mmc_flash_close(w.mmc, digest, NULL) != 0) {
+            fprintf(stderr, "write_raw_image: error writing %s\n", partition);
+            success = false;
+        }
+    }
+
+    return success ? 0 : -1;
 }
 
-// write_raw_image(filename_or_blob, partition)
+// Extract a package entry to a file in /tmp, for partitions that can
+// only be flashed from a file.
+static int extract_raw_image(UpdaterInfo* ui, const ZipEntry* entry,
+                             const char* filename) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "write_raw_image: can't create %s: %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+    bool success = mzExtractZipEntryToFile(ui->package_zip, entry, fd);
+    close(fd);
+    return success ? 0 : -1;
+}
+
+// Check that an image file's SHA-1 matches expected before it is
+// flashed from that file.  Returns 0 if it does.
+static int check_raw_image_sha1(const char* filename, const uint8_t* expected,
+                                const char* expected_str) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "write_raw_image: can't open %s: %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    unsigned char buffer[65536];
+    ssize_t len;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        SHA_update(&ctx, buffer, len);
+    }
+    close(fd);
+    if (len < 0) {
+        fprintf(stderr, "write_raw_image: error reading %s: %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+    if (memcmp(SHA_final(&ctx), expected, SHA_DIGEST_SIZE) != 0) {
+        fprintf(stderr, "write_raw_image: sha-1 of %s doesn't match %s\n",
+                filename, expected_str);
+        return -1;
+    }
+    return 0;
+}
+
+// write_raw_image(filename_or_package_entry, partition [, sha1])
+//
+// The image is either a file, or "PACKAGE:<name>" for an entry of the
+// update package; the latter is streamed to the partition as it is
+// inflated.  If a SHA-1 is given, the written data must match it; images
+// flashed from a file are checked before anything is written.
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
 
+    if (argc != 2 && argc != 3) {
+        return ErrorAbort(state, "%s() expects 2 or 3 args, got %d",
+                          name, argc);
+    }
+
     Value* partition_value;
     Value* contents;
+    Value* sha1_value = NULL;
     if (ReadValueArgs(state, argv, 2, &contents, &partition_value) < 0) {
         return NULL;
     }
+    if (argc == 3 && ReadValueArgs(state, argv+2, 1, &sha1_value) < 0) {
+        FreeValue(contents);
+        FreeValue(partition_value);
+        return NULL;
+    }
 
     if (partition_value->type != VAL_STRING) {
         ErrorAbort(state, "partition argument to %s must be string", name);
@@ -748,9 +920,57 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         ErrorAbort(state, "file argument to %s can't be empty", name);
         goto done;
     }
+    uint8_t expected[SHA_DIGEST_SIZE];
+    if (sha1_value != NULL &&
+        (sha1_value->type != VAL_STRING ||
+         ParseSha1(sha1_value->data, expected) != 0)) {
+        ErrorAbort(state, "sha1 argument to %s is not a valid sha-1", name);
+        goto done;
+    }
 
     char* filename = contents->data;
-    if (0 == restore_raw_partition(NULL, partition, filename))
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    uint8_t digest[SHA_DIGEST_SIZE];
+    bool have_digest = false;
+    int ret;
+
+    if (strncmp(filename, "PACKAGE:", 8) == 0) {
+        const ZipEntry* entry = mzFindZipEntry(ui->package_zip, filename + 8);
+        if (entry == NULL) {
+            fprintf(stderr, "%s: no %s in package\n", name, filename + 8);
+            result = strdup("");
+            goto done;
+        }
+        if (device_flash_type() == BML) {
+            // bmlutils flashes boot and recovery together from a file.
+            const char* tmp = "/tmp/write_raw_image.img";
+            ret = extract_raw_image(ui, entry, tmp);
+            if (ret == 0 && sha1_value != NULL) {
+                ret = check_raw_image_sha1(tmp, expected, sha1_value->data);
+            }
+            if (ret == 0) ret = restore_raw_partition(NULL, partition, tmp);
+            unlink(tmp);
+        } else {
+            ret = stream_raw_image(ui, entry, partition, digest);
+            have_digest = true;
+        }
+    } else {
+        ret = 0;
+        if (sha1_value != NULL) {
+            ret = check_raw_image_sha1(filename, expected, sha1_value->data);
+        }
+        if (ret == 0) ret = restore_raw_partition(NULL, partition, filename);
+    }
+
+    if (ret == 0 && have_digest && sha1_value != NULL) {
+        if (memcmp(digest, expected, SHA_DIGEST_SIZE) != 0) {
+            fprintf(stderr, "%s: sha-1 of data written to %s doesn't "
+                    "match %s\n", name, partition, sha1_value->data);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
         result = strdup(partition);
     else {
         result = strdup("");
@@ -760,6 +980,7 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
 done:
     if (result != partition) FreeValue(partition_value);
     FreeValue(contents);
+    if (sha1_value != NULL) FreeValue(sha1_value);
     return StringValue(result);
 }
 
@@ -846,6 +1067,9 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     int result = applypatch(source_filename, target_filename,
                             target_sha1, target_size,
                             patchcount, patch_sha_str, patches, NULL);
+    if (result == 0) {
+        updater_add_bytes((UpdaterInfo*)(state->cookie), target_size);
+    }
 
     for (i = 0; i < patchcount; ++i) {
         FreeValue(patches[i]);
@@ -904,13 +1128,13 @@ Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     free(args);
     buffer[size] = '\0';
 
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
     char* line = strtok(buffer, "\n");
     while (line) {
-        fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print %s\n", line);
+        updater_ui_print(ui, line);
         line = strtok(NULL, "\n");
     }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "ui_print\n");
+    updater_ui_print(ui, "");
 
     return StringValue(buffer);
 }
@@ -919,7 +1143,7 @@ Value* WipeCacheFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 0) {
         return ErrorAbort(state, "%s() expects no args, got %d", name, argc);
     }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "wipe_cache\n");
+    updater_send_command((UpdaterInfo*)(state->cookie), "wipe_cache");
     return StringValue(strdup("t"));
 }
 
@@ -1006,6 +1230,7 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
     uint8_t digest[SHA_DIGEST_SIZE];
     SHA_hash(args[0]->data, args[0]->size, digest);
+    ProfileAddBytes(args[0]->size);
     FreeValue(args[0]);
 
     if (argc == 1) {
@@ -17,11 +17,15 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "edify/expr.h"
 #include "updater.h"
+#include "cmd_protocol.h"
 #include "install.h"
+#include "blockimg.h"
 #include "minzip/Zip.h"
 
 // Generated by the makefile, this function defines the
@@ -38,6 +42,84 @@
 
 struct selabel_handle *sehandle;
 
+// Don't tell recovery about bytes written more often than this.
+#define BYTES_REPORT_INTERVAL_US 250000
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void send_message(UpdaterInfo* ui, int type,
+                         const void* payload, size_t len) {
+    CmdMsgHeader header;
+
+    if (len > CMD_MSG_MAX_PAYLOAD) len = CMD_MSG_MAX_PAYLOAD;
+    header.magic = CMD_MSG_MAGIC;
+    header.version = CMD_PROTOCOL_VERSION;
+    header.type = type;
+    header.reserved = 0;
+    header.payload_len = len;
+    header.timestamp_us = now_us();
+    header.bytes_done = ui->bytes_done;
+    fwrite(&header, sizeof(header), 1, ui->cmd_pipe);
+    if (len > 0) fwrite(payload, 1, len, ui->cmd_pipe);
+    fflush(ui->cmd_pipe);
+}
+
+void updater_ui_print(UpdaterInfo* ui, const char* line) {
+    if (ui->cmd_protocol) {
+        send_message(ui, CMD_MSG_UI_PRINT, line, strlen(line));
+    } else if (*line) {
+        fprintf(ui->cmd_pipe, "ui_print %s\n", line);
+    } else {
+        fprintf(ui->cmd_pipe, "ui_print\n");
+    }
+}
+
+void updater_show_progress(UpdaterInfo* ui, double frac, int sec) {
+    if (ui->cmd_protocol) {
+        CmdMsgProgress p;
+        p.fraction_ppm = frac * 1000000;
+        p.seconds = sec;
+        send_message(ui, CMD_MSG_PROGRESS, &p, sizeof(p));
+    } else {
+        fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    }
+}
+
+void updater_set_progress(UpdaterInfo* ui, double frac) {
+    if (ui->cmd_protocol) {
+        CmdMsgProgress p;
+        p.fraction_ppm = frac * 1000000;
+        p.seconds = 0;
+        send_message(ui, CMD_MSG_SET_PROGRESS, &p, sizeof(p));
+    } else {
+        fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    }
+}
+
+void updater_send_command(UpdaterInfo* ui, const char* command) {
+    if (ui->cmd_protocol) {
+        send_message(ui, CMD_MSG_COMMAND, command, strlen(command));
+    } else {
+        fprintf(ui->cmd_pipe, "%s\n", command);
+    }
+}
+
+void updater_add_bytes(UpdaterInfo* ui, uint64_t bytes) {
+    ui->bytes_done += bytes;
+    ProfileAddBytes(bytes);
+    if (ui->cmd_protocol) {
+        uint64_t now = now_us();
+        if (now - ui->bytes_reported_us >= BYTES_REPORT_INTERVAL_US) {
+            send_message(ui, CMD_MSG_BYTES, NULL, 0);
+            ui->bytes_reported_us = now;
+        }
+    }
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -67,6 +149,13 @@ int main(int argc, char** argv) {
     FILE* cmd_pipe = fdopen(fd, "wb");
     setlinebuf(cmd_pipe);
 
+    // Use the binary protocol if recovery understands it.
+    const char* protocol = getenv(CMD_PROTOCOL_ENV);
+    int cmd_protocol = 0;
+    if (protocol != NULL && atoi(protocol) >= CMD_PROTOCOL_VERSION) {
+        cmd_protocol = CMD_PROTOCOL_VERSION;
+    }
+
     // Extract the script from the package.
 
     char* package_data = argv[3];
@@ -115,9 +204,15 @@ int main(int argc, char** argv) {
 
     RegisterBuiltins();
     RegisterInstallFunctions();
+    RegisterBlockImageFunctions();
     RegisterDeviceExtensions();
     FinishRegistration();
 
+    const char* profile_file = getenv(UPDATER_PROFILE_ENV);
+    if (profile_file != NULL) {
+        ProfileStart();
+    }
+
     // Parse the script.
 
     Expr* root;
@@ -128,6 +223,12 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%d parse errors\n", error_count);
         return 6;
     }
+    Expr* program = CompileExpr(root);
+    if (program == NULL) {
+        fprintf(stderr, "failed to compile script\n");
+        return 6;
+    }
+    FreeExpr(root);
 
    if (access(SELINUX_CONTEXTS_TMP, R_OK) == 0) {
 	   struct selinux_opt seopts[] = {
@@ -155,25 +256,38 @@ int main(int argc, char** argv) {
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
     updater_info.version = atoi(version);
+    updater_info.cmd_protocol = cmd_protocol;
+    updater_info.bytes_done = 0;
+    updater_info.bytes_reported_us = 0;
 
     State state;
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
 
-    char* result = Evaluate(&state, root);
+    char* result = Evaluate(&state, program);
+
+    if (profile_file != NULL) {
+        ProfileReport(stderr, &state);
+        FILE* f = fopen(profile_file, "w");
+        if (f != NULL) {
+            ProfileReport(f, &state);
+            fclose(f);
+        }
+    }
+
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
-            fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
+            updater_ui_print(&updater_info, "script aborted (no error message)");
         } else {
             fprintf(stderr, "script aborted: %s\n", state.errmsg);
             char* line = strtok(state.errmsg, "\n");
             while (line) {
-                fprintf(cmd_pipe, "ui_print %s\n", line);
+                updater_ui_print(&updater_info, line);
                 line = strtok(NULL, "\n");
             }
-            fprintf(cmd_pipe, "ui_print\n");
+            updater_ui_print(&updater_info, "");
         }
         free(state.errmsg);
         return 7;
@@ -185,6 +299,7 @@ int main(int argc, char** argv) {
     if (updater_info.package_zip) {
         mzCloseZipArchive(updater_info.package_zip);
     }
+    free(program);
     free(script);
 
     return 0;
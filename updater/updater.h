@@ -17,6 +17,7 @@
 #ifndef _UPDATER_UPDATER_H_
 #define _UPDATER_UPDATER_H_
 
+#include <stdint.h>
 #include <stdio.h>
 #include "minzip/Zip.h"
 
@@ -27,8 +28,22 @@ typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
     int version;
+    int cmd_protocol;             // 0 for text, else CMD_PROTOCOL_VERSION
+    uint64_t bytes_done;          // bytes written so far, for MB/s
+    uint64_t bytes_reported_us;   // when bytes_done was last sent
 } UpdaterInfo;
 
 extern struct selabel_handle *sehandle;
 
+// Commands sent to recovery over cmd_pipe, in whichever protocol
+// recovery asked for (see cmd_protocol.h).
+void updater_ui_print(UpdaterInfo* ui, const char* line);
+void updater_show_progress(UpdaterInfo* ui, double frac, int sec);
+void updater_set_progress(UpdaterInfo* ui, double frac);
+void updater_send_command(UpdaterInfo* ui, const char* command);
+
+// Count bytes written to the device; recovery is told at most a few
+// times a second.
+void updater_add_bytes(UpdaterInfo* ui, uint64_t bytes);
+
 #endif
@@ -25,6 +25,91 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The signed part of the package is mapped and hashed this much at a
+// time, so that huge packages don't need a huge chunk of address space.
+#define HASH_WINDOW_SIZE (8 << 20)
+
+// Don't redraw the progress bar more often than this.
+#define PROGRESS_INTERVAL_MS 100
+
+typedef struct {
+    int fd;
+    size_t signed_len;
+    bool use_sha256;
+    bool report_progress;
+    double progress_base;       // progress shown is base + scale * done
+    double progress_scale;
+    bool ok;
+    SHA_CTX sha1_ctx;
+    SHA256_CTX sha256_ctx;
+} HashJob;
+
+static void init_hash_job(HashJob* job, int fd, size_t signed_len, bool use_sha256) {
+    job->fd = fd;
+    job->signed_len = signed_len;
+    job->use_sha256 = use_sha256;
+    job->report_progress = false;
+    job->progress_base = 0.0;
+    job->progress_scale = 1.0;
+    job->ok = true;
+    SHA_init(&job->sha1_ctx);
+    SHA256_init(&job->sha256_ctx);
+}
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Hash the first signed_len bytes of job->fd into the job's context,
+// mapping it one window at a time.  Safe to run on its own thread as
+// long as report_progress is false.
+static void* hash_signed_range(void* cookie) {
+    HashJob* job = (HashJob*) cookie;
+    long long last_progress = 0;
+    size_t so_far = 0;
+
+    while (so_far < job->signed_len) {
+        size_t size = HASH_WINDOW_SIZE;
+        if (job->signed_len - so_far < size) size = job->signed_len - so_far;
+
+        // verify_file_internal() rejects files whose offsets don't fit.
+        void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, job->fd,
+                          (off_t) so_far);
+        if (data == MAP_FAILED) {
+            LOGE("failed to map %zu bytes at %zu (%s)\n",
+                 size, so_far, strerror(errno));
+            job->ok = false;
+            return NULL;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+        if (job->use_sha256) {
+            SHA256_update(&job->sha256_ctx, data, size);
+        } else {
+            SHA_update(&job->sha1_ctx, data, size);
+        }
+        munmap(data, size);
+        so_far += size;
+
+        if (job->report_progress) {
+            long long now = now_ms();
+            if (now - last_progress >= PROGRESS_INTERVAL_MS ||
+                so_far == job->signed_len) {
+                ui_set_progress(job->progress_base + job->progress_scale *
+                                so_far / (double)job->signed_len);
+                last_progress = now;
+            }
+        }
+    }
+    return NULL;
+}
 
 // Look for an RSA signature embedded in the .ZIP file comment given
 // the path to the zip.  Verify it matches one of the given public
@@ -33,8 +118,14 @@
 // Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
 // or no key matches the signature).
 
-int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+// On success, *key_index is set to the key that matched and the
+// verified digest (hash_len bytes) is copied to digest.  The progress
+// bar is left alone unless show_progress is true.
+
+static int verify_file_internal(const char* path, const Certificate* pKeys,
+                                unsigned int numKeys, int* key_index,
+                                uint8_t* digest, bool show_progress) {
+    if (show_progress) ui_set_progress(0.0);
 
     FILE* f = fopen(path, "rb");
     if (f == NULL) {
@@ -42,6 +133,15 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         return VERIFY_FAILURE;
     }
 
+    // Offsets are handled as long/off_t/size_t below, which are only 32
+    // bits on 32-bit builds.
+    struct stat64 st;
+    if (fstat64(fileno(f), &st) == 0 && (uint64_t)st.st_size > LONG_MAX) {
+        LOGE("%s is too large to verify\n", path);
+        fclose(f);
+        return VERIFY_FAILURE;
+    }
+
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -137,8 +237,6 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         }
     }
 
-#define BUFFER_SIZE 4096
-
     bool need_sha1 = false;
     bool need_sha256 = false;
     for (i = 0; i < numKeys; ++i) {
@@ -148,43 +246,49 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         }
     }
 
-    SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
-    SHA_init(&sha1_ctx);
-    SHA256_init(&sha256_ctx);
-    unsigned char* buffer = (unsigned char*)malloc(BUFFER_SIZE);
-    
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-
-    double frac = -1.0;
-    size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
-    while (so_far < signed_len) {
-       unsigned int size = BUFFER_SIZE;
-        if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
-        }
-        if (need_sha1) SHA_update(&sha1_ctx, buffer, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, buffer, size);
-        so_far += size;
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            ui_set_progress(f);
-            frac = f;
+    // When both digests are needed, compute the SHA-1 on a second
+    // thread while this one does the SHA-256 (and reports progress).
+    HashJob sha1_job;
+    HashJob sha256_job;
+    init_hash_job(&sha1_job, fileno(f), signed_len, false);
+    init_hash_job(&sha256_job, fileno(f), signed_len, true);
+
+    bool ok = true;
+    if (need_sha1 && need_sha256) {
+        pthread_t sha1_thread;
+        if (pthread_create(&sha1_thread, NULL, hash_signed_range, &sha1_job) == 0) {
+            sha256_job.report_progress = show_progress;
+            hash_signed_range(&sha256_job);
+            pthread_join(sha1_thread, NULL);
+        } else {
+            // One after the other, each taking half the bar.
+            sha1_job.report_progress = show_progress;
+            sha1_job.progress_scale = 0.5;
+            hash_signed_range(&sha1_job);
+            sha256_job.report_progress = show_progress;
+            sha256_job.progress_base = 0.5;
+            sha256_job.progress_scale = 0.5;
+            hash_signed_range(&sha256_job);
         }
+        ok = sha1_job.ok && sha256_job.ok;
+    } else if (need_sha1) {
+        sha1_job.report_progress = show_progress;
+        hash_signed_range(&sha1_job);
+        ok = sha1_job.ok;
+    } else if (need_sha256) {
+        sha256_job.report_progress = show_progress;
+        hash_signed_range(&sha256_job);
+        ok = sha256_job.ok;
     }
     fclose(f);
-    free(buffer);
+    if (!ok) {
+        LOGE("failed to read data from %s\n", path);
+        free(eocd);
+        return VERIFY_FAILURE;
+    }
 
-    const uint8_t* sha1 = SHA_final(&sha1_ctx);
-    const uint8_t* sha256 = SHA256_final(&sha256_ctx);
+    const uint8_t* sha1 = SHA_final(&sha1_job.sha1_ctx);
+    const uint8_t* sha256 = SHA256_final(&sha256_job.sha256_ctx);
 
     for (i = 0; i < numKeys; ++i) {
 	const uint8_t* hash;
@@ -198,6 +302,8 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         if (RSA_verify(pKeys[i].public_key, eocd + eocd_size - 6 - RSANUMBYTES,
                        RSANUMBYTES, hash, pKeys[i].hash_len)) {
             LOGI("whole-file signature verified against key %d\n", i);
+            *key_index = i;
+            memcpy(digest, hash, pKeys[i].hash_len);
             free(eocd);
             return VERIFY_SUCCESS;
 	} else {
@@ -209,6 +315,240 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     return VERIFY_FAILURE;
 }
 
+int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
+    int key_index;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    return verify_file_internal(path, pKeys, numKeys, &key_index, digest, true);
+}
+
+// Packages that passed verify_file_cached() are remembered, one per
+// line, as
+//
+//   <dev> <ino> <size> <mtime> <ctime> <key index> <key sha1> <digest> <tail sha1> <path>
+//
+// where the tail is everything from the EOCD record to the end of the
+// file (i.e. the zip comment holding the signature and the footer).
+// The list lives in tmpfs, so it only covers packages verified since
+// recovery started; ctime can't be set back, so a package written to
+// in place since then doesn't match its entry.
+
+#define VERIFY_CACHE_MAX_ENTRIES 16
+#define VERIFY_CACHE_LINE_SIZE (PATH_MAX + 256)
+
+static void to_hex(const uint8_t* data, int len, char* out) {
+    static const char hex[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < len; ++i) {
+        out[i*2] = hex[data[i] >> 4];
+        out[i*2+1] = hex[data[i] & 0xf];
+    }
+    out[len*2] = '\0';
+}
+
+// Parse len bytes of hex from 'in'; the string must be exactly that long.
+static bool from_hex(const char* in, uint8_t* data, int len) {
+    int i;
+    if ((int)strlen(in) != len * 2) return false;
+    for (i = 0; i < len * 2; ++i) {
+        char c = in[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' :
+                (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (v < 0) return false;
+        if (i % 2 == 0) data[i/2] = v << 4;
+        else data[i/2] |= v;
+    }
+    return true;
+}
+
+static void key_fingerprint(const Certificate* cert, char* out) {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    SHA_hash(cert->public_key, sizeof(RSAPublicKey), sha1);
+    to_hex(sha1, SHA_DIGEST_SIZE, out);
+}
+
+// Hash the EOCD record and everything after it.  This covers the
+// signature itself, so if the tail (and the file's identity) hasn't
+// changed there's no need to hash the rest of the package again.  The
+// RSANUMBYTES signature is copied to signature.
+static bool hash_package_tail(const char* path, char* out, uint8_t* signature) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return false;
+
+    bool ok = false;
+    unsigned char footer[FOOTER_SIZE];
+    if (fseek(f, -FOOTER_SIZE, SEEK_END) == 0 &&
+        fread(footer, 1, FOOTER_SIZE, f) == FOOTER_SIZE &&
+        footer[2] == 0xff && footer[3] == 0xff) {
+        size_t eocd_size = footer[4] + (footer[5] << 8) + EOCD_HEADER_SIZE;
+        unsigned char* tail = (unsigned char*) malloc(eocd_size);
+        if (tail != NULL && eocd_size >= RSANUMBYTES + FOOTER_SIZE &&
+            fseek(f, -(long)eocd_size, SEEK_END) == 0 &&
+            fread(tail, 1, eocd_size, f) == eocd_size) {
+            uint8_t sha1[SHA_DIGEST_SIZE];
+            SHA_hash(tail, eocd_size, sha1);
+            to_hex(sha1, SHA_DIGEST_SIZE, out);
+            memcpy(signature, tail + eocd_size - FOOTER_SIZE - RSANUMBYTES,
+                   RSANUMBYTES);
+            ok = true;
+        }
+        free(tail);
+    }
+    fclose(f);
+    return ok;
+}
+
+static bool find_cached_verification(const char* cache_file, const char* path,
+                                     const struct stat* st, const char* tail,
+                                     const uint8_t* signature,
+                                     const Certificate* pKeys, unsigned int numKeys) {
+    FILE* f = fopen(cache_file, "r");
+    if (f == NULL) return false;
+
+    bool found = false;
+    char line[VERIFY_CACHE_LINE_SIZE];
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        unsigned long long dev, ino;
+        long long size;
+        long mtime, ctime;
+        int key_index;
+        char key_sha1[SHA_DIGEST_SIZE*2+1];
+        char digest[SHA256_DIGEST_SIZE*2+1];
+        char tail_sha1[SHA_DIGEST_SIZE*2+1];
+        char entry_path[PATH_MAX];
+
+        if (sscanf(line, "%llu %llu %lld %ld %ld %d %40s %64s %40s %4095[^\n]",
+                   &dev, &ino, &size, &mtime, &ctime, &key_index, key_sha1,
+                   digest, tail_sha1, entry_path) != 10) {
+            continue;
+        }
+        if (strcmp(entry_path, path) != 0 ||
+            dev != (unsigned long long)st->st_dev ||
+            ino != (unsigned long long)st->st_ino ||
+            size != (long long)st->st_size ||
+            mtime != (long)st->st_mtime ||
+            ctime != (long)st->st_ctime ||
+            strcmp(tail_sha1, tail) != 0) {
+            continue;
+        }
+
+        // The key it was verified against must still be loaded.
+        char fingerprint[SHA_DIGEST_SIZE*2+1];
+        if (key_index < 0 || (unsigned int)key_index >= numKeys) continue;
+        key_fingerprint(&pKeys[key_index], fingerprint);
+        if (strcmp(fingerprint, key_sha1) != 0) continue;
+
+        // And the package's signature must still be over the recorded
+        // digest, so a damaged or edited entry can't vouch for it.
+        uint8_t digest_bytes[SHA256_DIGEST_SIZE];
+        if (!from_hex(digest, digest_bytes, pKeys[key_index].hash_len) ||
+            !RSA_verify(pKeys[key_index].public_key, signature, RSANUMBYTES,
+                        digest_bytes, pKeys[key_index].hash_len)) {
+            LOGW("%s: cached digest doesn't match the signature\n", path);
+            continue;
+        }
+
+        LOGI("%s already verified against key %d (digest %s)\n",
+             path, key_index, digest);
+        found = true;
+    }
+    fclose(f);
+    return found;
+}
+
+// Rewrite cache_file with new_line appended, dropping any old entries
+// for the same path and keeping only the newest few.
+static void store_cached_verification(const char* cache_file, const char* path,
+                                      const char* new_line) {
+    char* lines[VERIFY_CACHE_MAX_ENTRIES];
+    int count = 0;
+    int i;
+
+    FILE* f = fopen(cache_file, "r");
+    if (f != NULL) {
+        char line[VERIFY_CACHE_LINE_SIZE];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char entry_path[PATH_MAX];
+            if (sscanf(line, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %4095[^\n]",
+                       entry_path) != 1 ||
+                strcmp(entry_path, path) == 0) {
+                continue;
+            }
+            if (count == VERIFY_CACHE_MAX_ENTRIES - 1) {
+                free(lines[0]);
+                memmove(lines, lines + 1, (count - 1) * sizeof(char*));
+                --count;
+            }
+            lines[count++] = strdup(line);
+        }
+        fclose(f);
+    }
+
+    f = fopen(cache_file, "w");
+    if (f == NULL) {
+        LOGW("failed to write %s (%s)\n", cache_file, strerror(errno));
+    } else {
+        for (i = 0; i < count; ++i) {
+            if (lines[i] != NULL) fputs(lines[i], f);
+        }
+        fputs(new_line, f);
+        fclose(f);
+    }
+    for (i = 0; i < count; ++i) {
+        free(lines[i]);
+    }
+}
+
+static int verify_file_cached_internal(const char* path,
+                                       const Certificate* pKeys,
+                                       unsigned int numKeys,
+                                       bool show_progress) {
+    struct stat st;
+    char tail[SHA_DIGEST_SIZE*2+1];
+    uint8_t signature[RSANUMBYTES];
+    int key_index;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    if (stat(path, &st) != 0 || !hash_package_tail(path, tail, signature)) {
+        // Let the full check report the problem.
+        return verify_file_internal(path, pKeys, numKeys, &key_index, digest,
+                                    show_progress);
+    }
+
+    if (find_cached_verification(VERIFY_CACHE_FILE, path, &st, tail,
+                                 signature, pKeys, numKeys)) {
+        if (show_progress) ui_set_progress(1.0);
+        return VERIFY_SUCCESS;
+    }
+
+    int result = verify_file_internal(path, pKeys, numKeys, &key_index, digest,
+                                      show_progress);
+    if (result != VERIFY_SUCCESS) return result;
+
+    char fingerprint[SHA_DIGEST_SIZE*2+1];
+    char digest_hex[SHA256_DIGEST_SIZE*2+1];
+    key_fingerprint(&pKeys[key_index], fingerprint);
+    to_hex(digest, pKeys[key_index].hash_len, digest_hex);
+
+    char line[VERIFY_CACHE_LINE_SIZE];
+    snprintf(line, sizeof(line), "%llu %llu %lld %ld %ld %d %s %s %s %s\n",
+             (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+             (long long)st.st_size, (long)st.st_mtime, (long)st.st_ctime,
+             key_index,
+             fingerprint, digest_hex, tail, path);
+    store_cached_verification(VERIFY_CACHE_FILE, path, line);
+    return result;
+}
+
+int verify_file_cached(const char* path, const Certificate* pKeys,
+                       unsigned int numKeys) {
+    return verify_file_cached_internal(path, pKeys, numKeys, true);
+}
+
+int verify_file_cached_quiet(const char* path, const Certificate* pKeys,
+                             unsigned int numKeys) {
+    return verify_file_cached_internal(path, pKeys, numKeys, false);
+}
+
 
 // Reads a file containing one or more public keys as produced by
 // DumpPublicKey:  this is an RSAPublicKey struct as it would appear
@@ -29,6 +29,23 @@ typedef struct Certificate {
  */
 int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys);
 
+/* Like verify_file(), but skip hashing the package if the same file
+ * (same path, device, inode, size, mtime and ctime, with an unchanged
+ * EOCD record and signature) already passed verification against one
+ * of the given keys since recovery started.  Packages that pass are
+ * remembered in VERIFY_CACHE_FILE.
+ */
+int verify_file_cached(const char* path, const Certificate *pKeys,
+                       unsigned int numKeys);
+
+/* Like verify_file_cached(), but never touches the progress bar, so it
+ * can run in the background while another package is being installed.
+ */
+int verify_file_cached_quiet(const char* path, const Certificate *pKeys,
+                             unsigned int numKeys);
+
+#define VERIFY_CACHE_FILE "/tmp/verified_packages"
+
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0